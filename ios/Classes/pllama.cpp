@@ -2,9 +2,25 @@
 // See the comment in ../{projectName}}.podspec for more information.
 #include "../../src/pllama.cpp"
 #include "../../src/pllama_chat_template.cpp"
+#include "../../src/pllama_context_pool.cpp"
+#include "../../src/pllama_dart_port.cpp"
+#include "../../src/pllama_decoder.cpp"
+#include "../../src/pllama_detokenize.cpp"
 #include "../../src/pllama_eos.cpp"
+#include "../../src/pllama_grammar.cpp"
 #include "../../src/pllama_inference_queue.cpp"
 #include "../../src/pllama_llava.cpp"
+#include "../../src/pllama_log.cpp"
+#include "../../src/pllama_lookahead.cpp"
+#include "../../src/pllama_loop.cpp"
+#include "../../src/pllama_memory.cpp"
+#include "../../src/pllama_model.cpp"
+#include "../../src/pllama_ring.cpp"
+#include "../../src/pllama_runtime.cpp"
+#include "../../src/pllama_sampling.cpp"
+#include "../../src/pllama_speculative.cpp"
+#include "../../src/pllama_stop.cpp"
+#include "../../src/pllama_stream.cpp"
 #include "../../src/pllama_tokenize.cpp"
 #include "../../src/clip.cpp"
 #include "../../src/llava.cpp"
@@ -1,6 +1,9 @@
 import 'dart:async';
+import 'dart:convert';
 import 'dart:ffi';
 import 'dart:io';
+import 'dart:isolate';
+import 'dart:typed_data';
 
 import 'package:ffi/ffi.dart';
 
@@ -11,48 +14,139 @@ import '../errors.dart';
 // 콜백 타입 정의 - C++ 시그니처와 일치
 typedef NativeInferenceCallback = Void Function(Pointer<Char> response, Uint8 done);
 typedef DartInferenceCallback = void Function(Pointer<Char> response, int done);
+typedef NativeLogCallback = Void Function(Pointer<Char> message);
 
-// 네이티브 함수 타입 정의
+// 네이티브 함수 타입 정의 - 요청 구조체는 C와 같이 값으로 전달
 typedef InferenceNativeFunc = Void Function(
-    Pointer<pllama_inference_request>,
+    pllama_inference_request,
     Pointer<NativeFunction<NativeInferenceCallback>>);
 typedef InferenceDartFunc = void Function(
-    Pointer<pllama_inference_request>,
+    pllama_inference_request,
     Pointer<NativeFunction<NativeInferenceCallback>>);
 
-typedef TokenizeNativeFunc = Int32 Function(Pointer<pllama_tokenize_request>);
-typedef TokenizeDartFunc = int Function(Pointer<pllama_tokenize_request>);
+typedef CancelNativeFunc = Void Function(Int32 requestId);
+typedef CancelDartFunc = void Function(int requestId);
 
-/// Native struct definitions
+typedef DartInitNativeFunc = Int32 Function(Pointer<Void> apiDlData);
+typedef DartInitDartFunc = int Function(Pointer<Void> apiDlData);
+
+typedef TokenizeNativeFunc = Size Function(pllama_tokenize_request);
+typedef TokenizeDartFunc = int Function(pllama_tokenize_request);
+
+/// Native struct definitions. Field order and types must match
+/// `pllama_inference_request` in src/pllama.h exactly.
 final class pllama_inference_request extends Struct {
-  external Pointer<Utf8> input;
-  external Pointer<Utf8> model_path;
-  external Pointer<Utf8> grammar;
-  external Pointer<Utf8> eos_token;
-  
+  @Int32()
+  external int request_id;
+
   @Int32()
   external int context_size;
-  
+
+  external Pointer<Utf8> input;
+
   @Int32()
   external int max_tokens;
-  
+
+  external Pointer<Utf8> model_path;
+  external Pointer<Utf8> model_mmproj_path;
+
   @Int32()
   external int num_gpu_layers;
-  
+
   @Int32()
   external int num_threads;
-  
+
   @Float()
   external double temperature;
-  
+
   @Float()
   external double top_p;
-  
+
   @Float()
   external double penalty_freq;
-  
+
   @Float()
   external double penalty_repeat;
+
+  external Pointer<Utf8> grammar;
+  external Pointer<Utf8> eos_token;
+  external Pointer<NativeFunction<NativeLogCallback>> dart_logger;
+  external Pointer<Void> progress_callback;
+  external Pointer<Void> delta_callback;
+
+  @Int32()
+  external int stream_flush_tokens;
+
+  @Int32()
+  external int stream_flush_interval_ms;
+
+  @Uint8()
+  external int stream_async;
+
+  external Pointer<Void> token_ring;
+
+  @Int64()
+  external int dart_port;
+
+  external Pointer<Pointer<Utf8>> stop_strings;
+
+  @Int32()
+  external int n_stop_strings;
+
+  external Pointer<Int32> stop_token_ids;
+
+  @Int32()
+  external int n_stop_token_ids;
+
+  external Pointer<Utf8> draft_model_path;
+
+  @Int32()
+  external int n_draft;
+
+  @Uint8()
+  external int prompt_lookup;
+
+  @Int32()
+  external int decoder;
+
+  external Pointer<Utf8> json_schema;
+
+  external Pointer<pllama_logit_bias> logit_bias;
+
+  @Int32()
+  external int n_logit_bias;
+
+  external Pointer<Int32> banned_token_ids;
+
+  @Int32()
+  external int n_banned_token_ids;
+
+  @Int32()
+  external int loop_window;
+
+  @Int32()
+  external int loop_min_repeats;
+
+  external Pointer<Void> finish_callback;
+
+  @Int32()
+  external int n_batch;
+
+  @Int32()
+  external int n_ubatch;
+
+  external Pointer<Void> prefill_callback;
+
+  @Int32()
+  external int n_prefault_threads;
+}
+
+final class pllama_logit_bias extends Struct {
+  @Int32()
+  external int token;
+
+  @Float()
+  external double bias;
 }
 
 final class pllama_tokenize_request extends Struct {
@@ -60,21 +154,25 @@ final class pllama_tokenize_request extends Struct {
   external Pointer<Utf8> model_path;
 }
 
-// 전역 콜백 인스턴스
-Completer<void>? _activeCompleter;
-void Function(String, bool)? _activeTokenCallback;
+// Port message kinds, see src/pllama_dart_port.h
+const int _portPiece = 0;
+const int _portDone = 1;
+const int _portEnded = 2;
 
-// 정적 네이티브 콜백 핸들러
-void _nativeCallbackHandler(Pointer<Char> response, int done) {
-  final responseStr = response.cast<Utf8>().toDartString();
-  
-  if (_activeTokenCallback != null) {
-    _activeTokenCallback!(responseStr, done == 1);
-  }
-  
-  if (done == 1 && _activeCompleter != null && !_activeCompleter!.isCompleted) {
-    _activeCompleter!.complete();
+// Forwards each decoded chunk; a piece may end inside a UTF-8 sequence, so
+// bytes go through one chunked decoder per request.
+class _ChunkSink implements Sink<String> {
+  final void Function(String) onChunk;
+
+  _ChunkSink(this.onChunk);
+
+  @override
+  void add(String data) {
+    if (data.isNotEmpty) onChunk(data);
   }
+
+  @override
+  void close() {}
 }
 
 /// 네이티브 라이브러리 인터페이스
@@ -82,15 +180,26 @@ class NativeLibrary {
   static final NativeLibrary instance = NativeLibrary._();
   late final DynamicLibrary _lib;
   late final InferenceDartFunc _pllama_inference;
+  late final CancelDartFunc _pllama_inference_cancel;
   late final TokenizeDartFunc _pllama_tokenize;
+  int _nextRequestId = 1;
 
   NativeLibrary._() {
     try {
       _lib = _loadLibrary();
       _pllama_inference = _lib
-          .lookupFunction<InferenceNativeFunc, InferenceDartFunc>('pllama_inference_sync');
+          .lookupFunction<InferenceNativeFunc, InferenceDartFunc>('pllama_inference');
+      _pllama_inference_cancel = _lib
+          .lookupFunction<CancelNativeFunc, CancelDartFunc>('pllama_inference_cancel');
       _pllama_tokenize = _lib
           .lookupFunction<TokenizeNativeFunc, TokenizeDartFunc>('pllama_tokenize');
+
+      // Dart_PostCObject 사용을 위한 Dart API DL 초기화
+      final dartInit = _lib
+          .lookupFunction<DartInitNativeFunc, DartInitDartFunc>('pllama_dart_init');
+      if (dartInit(NativeApi.initializeApiDLData) != 0) {
+        throw StateError('Unsupported Dart API DL version');
+      }
     } catch (e) {
       print("Failed to initialize native bindings: $e");
       rethrow;
@@ -112,17 +221,19 @@ class NativeLibrary {
     throw UnsupportedError('Unsupported platform: ${Platform.operatingSystem}');
   }
 
-  void pllama_inference_sync(Pointer<pllama_inference_request> request) {
-    // 정적 콜백 함수 등록 - exceptionalReturn 제거
-    final callbackPtr = Pointer.fromFunction<NativeInferenceCallback>(
-      _nativeCallbackHandler,
-    );
-    
-    _pllama_inference(request, callbackPtr);
+  int nextRequestId() => _nextRequestId++;
+
+  /// Queues the request; results are posted to `request.dart_port`.
+  void pllama_inference(Pointer<pllama_inference_request> request) {
+    _pllama_inference(request.ref, nullptr);
+  }
+
+  void pllama_inference_cancel(int requestId) {
+    _pllama_inference_cancel(requestId);
   }
 
   int pllama_tokenize(Pointer<pllama_tokenize_request> request) {
-    return _pllama_tokenize(request);
+    return _pllama_tokenize(request.ref);
   }
 }
 
@@ -133,6 +244,7 @@ class InferenceNative {
     required InferenceConfig config,
     required String modelPath,
     required void Function(String response, bool done) onToken,
+    void Function(FinishReason reason)? onFinish,
   }) async {
     // Validate inputs
     if (modelPath.isEmpty) {
@@ -151,64 +263,134 @@ class InferenceNative {
       );
     }
 
-    // 이전 콜백이 있으면 제거
-    _activeCompleter = Completer<void>();
-    
-    // 네이티브 요청 준비
-    final request = calloc<pllama_inference_request>();
-    
-    // Input과 model path를 네이티브 메모리로 변환
+    final nativeLib = NativeLibrary.instance;
+    final requestId = nativeLib.nextRequestId();
+    final completer = Completer<void>();
+    final port = ReceivePort();
+
+    // Input과 model path를 네이티브 메모리로 변환. 요청은 큐에서 비동기로
+    // 실행되므로 종료 메시지를 받을 때까지 해제하지 않는다.
     final inputPtr = config.prompt.toNativeUtf8();
     final modelPathPtr = modelPath.toNativeUtf8();
-    
-    // 요청 파라미터 설정
+    final draftModelPathPtr = config.draftModelPath?.toNativeUtf8() ?? nullptr;
+    final grammarPtr = config.grammar?.toNativeUtf8() ?? nullptr;
+    final jsonSchemaPtr = config.jsonSchema?.toNativeUtf8() ?? nullptr;
+    final biases = config.logitBias.entries.toList();
+    final biasPtr = calloc<pllama_logit_bias>(biases.length);
+    for (var i = 0; i < biases.length; i++) {
+      biasPtr[i].token = biases[i].key;
+      biasPtr[i].bias = biases[i].value;
+    }
+    final banned = config.bannedTokens;
+    final bannedPtr = calloc<Int32>(banned.length);
+    for (var i = 0; i < banned.length; i++) {
+      bannedPtr[i] = banned[i];
+    }
+    final stops = config.stopSequences;
+    final stopPtrs = calloc<Pointer<Utf8>>(stops.length);
+    for (var i = 0; i < stops.length; i++) {
+      stopPtrs[i] = stops[i].toNativeUtf8();
+    }
+    Timer? abandonTimer;
+    void release() {
+      abandonTimer?.cancel();
+      port.close();
+      calloc.free(inputPtr);
+      calloc.free(modelPathPtr);
+      if (draftModelPathPtr != nullptr) calloc.free(draftModelPathPtr);
+      if (grammarPtr != nullptr) calloc.free(grammarPtr);
+      if (jsonSchemaPtr != nullptr) calloc.free(jsonSchemaPtr);
+      calloc.free(biasPtr);
+      calloc.free(bannedPtr);
+      for (var i = 0; i < stops.length; i++) {
+        calloc.free(stopPtrs[i]);
+      }
+      calloc.free(stopPtrs);
+    }
+
+    final decoder = const Utf8Decoder(allowMalformed: true)
+        .startChunkedConversion(_ChunkSink((chunk) => onToken(chunk, false)));
+    port.listen((message) {
+      final fields = message as List;
+      switch (fields[1] as int) {
+        case _portPiece:
+          decoder.add(fields[2] as Uint8List);
+          break;
+        case _portDone:
+          decoder.close();
+          release();
+          onFinish?.call(FinishReason.values[fields[4] as int]);
+          onToken('', true);
+          if (!completer.isCompleted) completer.complete();
+          break;
+        case _portEnded:
+          release();
+          final error = fields[2] as String;
+          if (completer.isCompleted) break;
+          if (error.isEmpty) {
+            // Cancelled
+            onToken('', true);
+            completer.complete();
+          } else {
+            completer.completeError(
+              InferenceError(error, maxTokens: config.maxTokens)
+            );
+          }
+          break;
+      }
+    });
+
+    // 네이티브 요청 준비 - 구조체는 값으로 복사되므로 바로 해제 가능
+    final request = calloc<pllama_inference_request>();
+    request.ref.request_id = requestId;
     request.ref.input = inputPtr;
     request.ref.model_path = modelPathPtr;
     request.ref.context_size = config.contextSize;
     request.ref.max_tokens = config.maxTokens;
     request.ref.temperature = config.temperature;
     request.ref.top_p = config.topP;
+    request.ref.penalty_freq = config.penaltyFreq;
+    request.ref.penalty_repeat = config.penaltyRepeat;
+    request.ref.grammar = grammarPtr;
     request.ref.num_threads = config.numThreads;
     request.ref.num_gpu_layers = config.numGpuLayers;
-
+    request.ref.dart_port = port.sendPort.nativePort;
+    request.ref.stop_strings = stopPtrs;
+    request.ref.n_stop_strings = stops.length;
+    request.ref.draft_model_path = draftModelPathPtr;
+    request.ref.prompt_lookup = config.promptLookup ? 1 : 0;
+    request.ref.decoder = config.decoder.index;
+    request.ref.json_schema = jsonSchemaPtr;
+    request.ref.logit_bias = biasPtr;
+    request.ref.n_logit_bias = biases.length;
+    request.ref.banned_token_ids = bannedPtr;
+    request.ref.n_banned_token_ids = banned.length;
+    request.ref.loop_window = config.loopWindow;
+    request.ref.loop_min_repeats = config.loopMinRepeats;
+    request.ref.n_batch = config.batchSize;
+    request.ref.n_ubatch = config.microBatchSize;
+    request.ref.n_prefault_threads = config.prefaultThreads;
     try {
-      // 토큰 콜백 설정
-      _activeTokenCallback = onToken;
-
-      // Perform native inference
-      final nativeLib = NativeLibrary.instance;
-      nativeLib.pllama_inference_sync(request);
-
-      // Wait for inference to complete
-      await _activeCompleter!.future.timeout(
-        const Duration(minutes: 5),
-        onTimeout: () {
-          throw InferenceError(
-            'Inference timed out after 5 minutes', 
-            maxTokens: config.maxTokens
-          );
-        }
-      );
-    } catch (e) {
-      if (_activeCompleter != null && !_activeCompleter!.isCompleted) {
-        _activeCompleter!.completeError(
-          InferenceError(
-            'Native inference failed: ${e.toString()}', 
-            maxTokens: config.maxTokens
-          )
-        );
-      }
-      rethrow;
+      nativeLib.pllama_inference(request);
     } finally {
-      // 정리
-      _activeTokenCallback = null;
-      _activeCompleter = null;
-      
-      // 네이티브 메모리 해제
-      calloc.free(inputPtr);
-      calloc.free(modelPathPtr);
       calloc.free(request);
     }
+
+    // Wait for inference to complete
+    await completer.future.timeout(
+      const Duration(minutes: 5),
+      onTimeout: () {
+        nativeLib.pllama_inference_cancel(requestId);
+        // A request cancelled while still queued never reports back; stop
+        // listening eventually, leaving its strings allocated since the
+        // native side may still hold them.
+        abandonTimer = Timer(const Duration(seconds: 30), port.close);
+        throw InferenceError(
+          'Inference timed out after 5 minutes', 
+          maxTokens: config.maxTokens
+        );
+      }
+    );
   }
 
   /// Runs tokenization using the native library
@@ -9,6 +9,41 @@ class InferenceConfig {
   final int numGpuLayers;
   final bool optimizeForLargeModel;
   final int loadTimeoutSeconds;
+  /// Generation ends before the first of these appears in the output.
+  final List<String> stopSequences;
+  /// Small model with the same vocab that drafts tokens for speculative
+  /// decoding. Same output, faster when its guesses are accepted.
+  final String? draftModelPath;
+  /// Speculative decoding that drafts by copying spans of the prompt; helps
+  /// when the output quotes the input.
+  final bool promptLookup;
+  final DecoderStrategy decoder;
+  /// Above 1, makes the last 64 tokens less likely to repeat.
+  final double penaltyRepeat;
+  /// Lowers the likelihood of recent tokens by this much per occurrence.
+  final double penaltyFreq;
+  /// GBNF grammar the output must match, starting at its `root` rule.
+  final String? grammar;
+  /// JSON schema the output must match; not combined with [grammar].
+  final String? jsonSchema;
+  /// Added to the logits of these token ids, ex. -5 to make one rarer.
+  final Map<int, double> logitBias;
+  /// Token ids that are never generated.
+  final List<int> bannedTokens;
+  /// When above 0, generation ends with [FinishReason.loop] once this many
+  /// trailing tokens are one block repeated [loopMinRepeats] times.
+  final int loopWindow;
+  /// Repetitions [loopWindow] must hold; 0 means 3.
+  final int loopMinRepeats;
+  /// Prompt tokens decoded at once; cancelling takes effect between them.
+  /// 0 means 512.
+  final int batchSize;
+  /// Tokens computed at once within [batchSize]; lower needs less memory.
+  /// 0 means 512, or less to fit the memory budget.
+  final int microBatchSize;
+  /// When the request loads the model, this many threads read its weights
+  /// into memory alongside the load. 0 leaves it to the load.
+  final int prefaultThreads;
 
   InferenceConfig({
     required this.prompt,
@@ -20,9 +55,50 @@ class InferenceConfig {
     this.numGpuLayers = 0,
     this.optimizeForLargeModel = true,
     this.loadTimeoutSeconds = 240,
+    this.stopSequences = const [],
+    this.draftModelPath,
+    this.promptLookup = false,
+    this.decoder = DecoderStrategy.auto,
+    this.penaltyRepeat = 1.0,
+    this.penaltyFreq = 0.0,
+    this.grammar,
+    this.jsonSchema,
+    this.logitBias = const {},
+    this.bannedTokens = const [],
+    this.loopWindow = 0,
+    this.loopMinRepeats = 0,
+    this.batchSize = 0,
+    this.microBatchSize = 0,
+    this.prefaultThreads = 0,
   });
 }
 
+/// How tokens are generated; same output, different speed. Order matches
+/// `pllama_decoder_type` in src/pllama.h.
+enum DecoderStrategy {
+  /// Draft model if set, else prompt lookup if enabled, else single token.
+  auto,
+  single,
+  draftModel,
+  promptLookup,
+  /// Lookahead (Jacobi) decoding: no second model, more compute per step.
+  lookahead,
+}
+
+/// Why generation ended. Order matches `pllama_finish_reason` in
+/// src/pllama.h.
+enum FinishReason {
+  /// End of the model's turn, a stop sequence or a stop token.
+  stop,
+  /// Max tokens reached or the context is full.
+  length,
+  /// The output kept repeating; see [InferenceConfig.loopWindow].
+  loop,
+  cancelled,
+  /// Decoding failed; the output so far was kept.
+  error,
+}
+
 /// Request for tokenization
 class TokenizeRequest {
   final String input;
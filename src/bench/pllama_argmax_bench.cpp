@@ -0,0 +1,148 @@
+// Times temperature 0 sampling the way requests used to do it, llama.cpp's
+// min_p -> temp -> dist chain through llama_sampler_sample, against the
+// chain run_inference builds now through pllama_sampler_sample, on random
+// logits written into a real context's output. pllama_argmax and the scalar
+// loop it replaced are timed too, for the cost of the scan alone.
+//
+// Usage: pllama_argmax_bench <model.gguf> [iterations]
+// The model's vocab sets the size of the logits; a Llama 3 model gives the
+// 128256 tokens this was tuned for. Defaults to 2000 iterations.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "llama.h"
+#include "pllama_sampling.h"
+
+// What requests used for min_p before temperature 0 had its own chain:
+// 1 - top_p, with the default top_p of 0.95.
+static const float OLD_MIN_P = 0.05f;
+
+static llama_token scalar_argmax(const float *logits, int32_t n_vocab) {
+  llama_token best = 0;
+  for (llama_token token = 1; token < n_vocab; token++) {
+    if (logits[token] > logits[best]) {
+      best = token;
+    }
+  }
+  return best;
+}
+
+// Average time of f(i) per iteration, not counting prepare(i), which puts
+// row i in place first.
+template <typename P, typename F>
+static double time_us(int iterations, std::vector<llama_token> &picked,
+                      P prepare, F f) {
+  double total = 0.0;
+  for (int i = 0; i < iterations; i++) {
+    prepare(i);
+    const auto start = std::chrono::steady_clock::now();
+    picked[i] = f(i);
+    const auto end = std::chrono::steady_clock::now();
+    total += std::chrono::duration<double, std::micro>(end - start).count();
+  }
+  return total / iterations;
+}
+
+int main(int argc, char **argv) {
+  const int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+  if (argc < 2 || iterations <= 0) {
+    fprintf(stderr, "usage: %s <model.gguf> [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  llama_backend_init();
+  llama_model *model =
+      llama_model_load_from_file(argv[1], llama_model_default_params());
+  if (model == nullptr) {
+    fprintf(stderr, "unable to load %s\n", argv[1]);
+    return 1;
+  }
+  llama_context_params ctx_params = llama_context_default_params();
+  ctx_params.n_ctx = 64;
+  ctx_params.n_batch = 64;
+  llama_context *ctx = llama_init_from_model(model, ctx_params);
+  if (ctx == nullptr) {
+    fprintf(stderr, "unable to create a context\n");
+    return 1;
+  }
+  // One decode, so the context has an output row to sample from; the rows
+  // below are written over it.
+  const llama_vocab *vocab = llama_model_get_vocab(model);
+  const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+  llama_token bos = llama_vocab_bos(vocab);
+  if (bos == LLAMA_TOKEN_NULL) {
+    bos = 0;
+  }
+  if (llama_decode(ctx, llama_batch_get_one(&bos, 1)) != 0) {
+    fprintf(stderr, "decode failed\n");
+    return 1;
+  }
+  float *output = llama_get_logits_ith(ctx, -1);
+
+  // A few distinct rows, so the timings are not of one cached answer.
+  const int n_rows = 16;
+  std::mt19937 rng(42);
+  std::normal_distribution<float> dist(0.0f, 4.0f);
+  std::vector<std::vector<float>> rows(n_rows);
+  for (auto &row : rows) {
+    row.resize((size_t)n_vocab);
+    for (float &logit : row) {
+      logit = dist(rng);
+    }
+  }
+  auto no_prepare = [](int) {};
+  auto load_row = [&](int i) {
+    std::memcpy(output, rows[i % n_rows].data(), sizeof(float) * n_vocab);
+  };
+
+  llama_sampler *old_chain =
+      llama_sampler_chain_init(llama_sampler_chain_default_params());
+  llama_sampler_chain_add(old_chain, llama_sampler_init_min_p(OLD_MIN_P, 1));
+  llama_sampler_chain_add(old_chain, llama_sampler_init_temp(0.0f));
+  llama_sampler_chain_add(old_chain,
+                          llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+  llama_sampler *new_chain =
+      llama_sampler_chain_init(llama_sampler_chain_default_params());
+  llama_sampler_chain_add(new_chain, pllama_sampler_init_greedy());
+
+  std::vector<llama_token> expected(iterations);
+  std::vector<llama_token> picked(iterations);
+  const double scalar_us =
+      time_us(iterations, expected, no_prepare, [&](int i) {
+        return scalar_argmax(rows[i % n_rows].data(), n_vocab);
+      });
+  const double pllama_us = time_us(iterations, picked, no_prepare, [&](int i) {
+    return pllama_argmax(rows[i % n_rows].data(), n_vocab);
+  });
+  bool same = picked == expected;
+  const double old_us = time_us(iterations, picked, load_row, [&](int) {
+    return llama_sampler_sample(old_chain, ctx, -1);
+  });
+  same = same && picked == expected;
+  const double new_us = time_us(iterations, picked, load_row, [&](int) {
+    return pllama_sampler_sample(new_chain, ctx, -1);
+  });
+  same = same && picked == expected;
+
+  llama_sampler_free(old_chain);
+  llama_sampler_free(new_chain);
+  llama_free(ctx);
+  llama_model_free(model);
+  llama_backend_free();
+
+  printf("n_vocab = %d, iterations = %d\n", n_vocab, iterations);
+  printf("old chain, llama_sampler_sample     %9.2f us/token\n", old_us);
+  printf("new chain, pllama_sampler_sample    %9.2f us/token\n", new_us);
+  printf("pllama_argmax                       %9.2f us/token\n", pllama_us);
+  printf("scalar loop                         %9.2f us/token\n", scalar_us);
+  if (!same) {
+    fprintf(stderr, "sampled tokens differ\n");
+    return 1;
+  }
+  return 0;
+}
@@ -1,9 +1,24 @@
 #include "pllama.h"
 #include "clip.h"
 #include "pllama_chat_template.h"
+#include "pllama_context_pool.h"
+#include "pllama_dart_port.h"
+#include "pllama_decoder.h"
+#include "pllama_detokenize.h"
 #include "pllama_eos.h"
+#include "pllama_grammar.h"
 #include "pllama_inference_queue.h"
 #include "pllama_llava.h"
+#include "pllama_log.h"
+#include "pllama_lookahead.h"
+#include "pllama_loop.h"
+#include "pllama_memory.h"
+#include "pllama_model.h"
+#include "pllama_runtime.h"
+#include "pllama_sampling.h"
+#include "pllama_speculative.h"
+#include "pllama_stop.h"
+#include "pllama_stream.h"
 #include "llava.h"
 
 // LLaMA.cpp cross-platform support
@@ -35,7 +50,6 @@
 #include "llama.cpp/include/llama.h"
 #endif
 
-#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cinttypes>
@@ -48,6 +62,7 @@
 #include <functional>
 #include <iostream>
 #include <limits.h>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <string>
@@ -61,50 +76,25 @@
 #include "ggml-backend.h"
 #include "llama.cpp/src/llama-sampling.h"
 
-// Global atomic for tracking model loading state
-static std::atomic<bool> model_loading_in_progress(false);
-
-// Forward declare logging functions
-static void log_message(const char *message, pllama_log_callback dart_logger = nullptr);
-static void log_message(const std::string &message, pllama_log_callback dart_logger = nullptr);
-
-// Memory utilities
-static void force_memory_release() {
-  // Attempt to free memory by forcing system calls
-#ifdef _WIN32
-  // Windows: call EmptyWorkingSet
-  EmptyWorkingSet(GetCurrentProcess());
-#else
-  // Linux/Mac: malloc trim if available
-#ifdef __GLIBC__
-  malloc_trim(0);
-#endif
-#endif
-  // Allow some time for memory to be released
-  std::this_thread::sleep_for(std::chrono::milliseconds(100));
-}
+static InferenceQueue global_inference_queue;
 
-// Implement logging functions
-static void log_message(const char *message, pllama_log_callback dart_logger) {
-    if (dart_logger == nullptr) {
-        fprintf(stderr, "%s\n", message);
-    } else {
-        dart_logger(message);
+// Marks the request's token ring done however the request ends, so a host
+// waiting on it always wakes up.
+struct RingFinisher {
+  pllama_token_ring *ring;
+  ~RingFinisher() {
+    if (ring != NULL) {
+      pllama_ring_finish(ring);
     }
-}
-
-static void log_message(const std::string &message, pllama_log_callback dart_logger) {
-    log_message(message.c_str(), dart_logger);
-}
-
-static InferenceQueue global_inference_queue;
+  }
+};
 
 extern "C" {
 
 EMSCRIPTEN_KEEPALIVE void pllama_inference(pllama_inference_request request,
                                            pllama_inference_callback callback) {
-  std::cout << "[pllama] Hello from pllama.cpp! Queueing your request."
-            << std::endl;
+  PLLAMA_LOG_DEBUG(request.dart_logger, "Queueing request %d",
+                   request.request_id);
   global_inference_queue.enqueue(request, callback);
 }
 
@@ -113,87 +103,104 @@ pllama_inference_cancel(int request_id) {
   global_inference_queue.cancel(request_id);
 }
 
-static bool add_tokens_to_context(struct llama_context *ctx_llama,
-                                  const std::vector<llama_token>& tokens, int n_batch,
-                                  int *n_past, pllama_log_callback logger) {
-    log_message("[DEBUG] add_tokens_to_context start", logger);
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_model_inference(pllama_model_handle *handle,
+                       pllama_inference_request request,
+                       pllama_inference_callback callback) {
+  if (handle == NULL) {
+    if (callback != NULL) {
+      callback("Error: Model handle is null", true);
+    }
+    return;
+  }
+  global_inference_queue.enqueue(handle, request, callback);
+}
+
+// Decodes tokens n_batch at a time. After each chunk, on_chunk (if set) is
+// told how many tokens are done; returning false stops before the next one,
+// and so does this function.
+static bool add_tokens_to_context(
+    struct llama_context *ctx_llama, const std::vector<llama_token> &tokens,
+    int n_batch, int *n_past, pllama_log_callback logger,
+    const std::function<bool(int n_done)> &on_chunk = nullptr) {
     const int N = (int)tokens.size();
-    log_message("[DEBUG] token count: " + std::to_string(N), logger);
+    PLLAMA_LOG_DEBUG(logger, "add_tokens_to_context: %d tokens", N);
     if (N == 0) return true;
 
     // Keep tokens data alive until we're done with the batch
     std::vector<llama_token> tokens_data = tokens;
-    log_message("[DEBUG] about to call llama_batch_get_one", logger);
     
     // Safety check for nullptr
     if (!ctx_llama) {
-        log_message("[ERROR] Context is null in add_tokens_to_context", logger);
+        PLLAMA_LOG_ERROR(logger, "Context is null in add_tokens_to_context");
         return false;
     }
     
-    llama_batch batch = llama_batch_get_one(tokens_data.data(), tokens_data.size());
-    log_message("[DEBUG] got batch with " + std::to_string(batch.n_tokens) + " tokens", logger);
-    
     // Check context space
     int n_ctx = llama_n_ctx(ctx_llama);
     int n_ctx_used = llama_get_kv_cache_used_cells(ctx_llama);
-    log_message("[DEBUG] ctx space: used=" + std::to_string(n_ctx_used) + ", total=" + std::to_string(n_ctx), logger);
+    PLLAMA_LOG_DEBUG(logger, "ctx space: used=%d, total=%d", n_ctx_used, n_ctx);
     
-    if (n_ctx_used + batch.n_tokens > n_ctx) {
-        log_message("context size exceeded", logger);
+    if (n_ctx_used + N > n_ctx) {
+        PLLAMA_LOG_ERROR(logger, "context size exceeded");
         return false;
     }
     
-    log_message("[DEBUG] about to decode batch", logger);
-    if (llama_decode(ctx_llama, batch)) {
-        log_message("failed to decode", logger);
-        return false;
+    // llama_decode takes at most n_batch tokens at once
+    n_batch = std::max(n_batch, 1);
+    for (int i = 0; i < N; i += n_batch) {
+        const int n_eval = std::min(n_batch, N - i);
+        llama_batch batch = llama_batch_get_one(tokens_data.data() + i, n_eval);
+        if (llama_decode(ctx_llama, batch)) {
+            PLLAMA_LOG_ERROR(logger, "failed to decode");
+            return false;
+        }
+        if (on_chunk && !on_chunk(i + n_eval)) {
+            PLLAMA_LOG_DEBUG(logger, "stopped after %d of %d tokens",
+                             i + n_eval, N);
+            return false;
+        }
     }
-    log_message("[DEBUG] decode successful", logger);
     
     // Update past token count
     *n_past = llama_get_kv_cache_used_cells(ctx_llama);
-    log_message("[DEBUG] updated n_past to " + std::to_string(*n_past), logger);
+    PLLAMA_LOG_DEBUG(logger, "decode successful, n_past: %d", *n_past);
     return true;
 }
 
 static bool add_token_to_context(struct llama_context *ctx_llama,
                                  llama_token id, int *n_past, pllama_log_callback logger) {
-    log_message("[DEBUG] adding token " + std::to_string(id) + " to context", logger);
-    log_message("[DEBUG] add_token_to_context start, token id: " + std::to_string(id), logger);
+    PLLAMA_LOG_DEBUG(logger, "add_token_to_context: token %d", id);
     
     // Safety check for nullptr
     if (!ctx_llama) {
-        log_message("[ERROR] Context is null in add_token_to_context", logger);
+        PLLAMA_LOG_ERROR(logger, "Context is null in add_token_to_context");
         return false;
     }
     
     // Check context space first
     int n_ctx = llama_n_ctx(ctx_llama);
     int n_ctx_used = llama_get_kv_cache_used_cells(ctx_llama);
-    log_message("[DEBUG] ctx space: used=" + std::to_string(n_ctx_used) + ", total=" + std::to_string(n_ctx), logger);
+    PLLAMA_LOG_DEBUG(logger, "ctx space: used=%d, total=%d", n_ctx_used, n_ctx);
     
     if (n_ctx_used + 1 > n_ctx) {
-        log_message("context size exceeded", logger);
+        PLLAMA_LOG_ERROR(logger, "context size exceeded");
         return false;
     }
 
     // Create batch with a single token, following simple-chat.cpp
     llama_batch batch = llama_batch_get_one(&id, 1);
-    log_message("[DEBUG] created batch with token " + std::to_string(id), logger);
 
     // No need to manually manage logits - llama_batch_get_one handles this
     
-    log_message("[DEBUG] about to decode", logger);
     if (llama_decode(ctx_llama, batch)) {
-        log_message("failed to decode", logger);
+        PLLAMA_LOG_ERROR(logger, "failed to decode");
         
         return false;
     }
-    log_message("[DEBUG] decode successful", logger);
 
     *n_past = llama_get_kv_cache_used_cells(ctx_llama);
-    log_message("[DEBUG] add_token_to_context complete, n_past: " + std::to_string(*n_past), logger);
+    PLLAMA_LOG_DEBUG(logger, "add_token_to_context complete, n_past: %d", *n_past);
     return true;
 }
 
@@ -202,14 +209,14 @@ static bool add_string_to_context(struct llama_context *ctx_llama,
                                   bool add_bos, pllama_log_callback logger) {
   // Safety check for null pointers
   if (!ctx_llama || !str) {
-    log_message("[ERROR] Null pointer passed to add_string_to_context", logger);
+    PLLAMA_LOG_ERROR(logger, "Null pointer passed to add_string_to_context");
     return false;
   }
 
   std::string str2 = str;
   const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx_llama));
   if (!vocab) {
-    log_message("[ERROR] Failed to get vocabulary from model", logger);
+    PLLAMA_LOG_ERROR(logger, "Failed to get vocabulary from model");
     return false;
   }
 
@@ -218,133 +225,106 @@ static bool add_string_to_context(struct llama_context *ctx_llama,
   std::vector<llama_token> embd_inp(n_prompt_tokens);
   if (llama_tokenize(vocab, str2.c_str(), str2.length(), embd_inp.data(),
                      embd_inp.size(), add_bos, true) < 0) {
-    log_message("tokenization failed", logger);
+    PLLAMA_LOG_ERROR(logger, "tokenization failed");
     return false;
   }
   return add_tokens_to_context(ctx_llama, embd_inp, n_batch, n_past, logger);
 }
 
-static void log_callback_wrapper(enum ggml_log_level level, const char *text,
-                                 void *user_data) {
-  std::cout << "[llama] " << text;
-}
-
-// Verifies model file header to ensure it's a valid GGUF file
-static bool verify_model_file(const char* path, bool detailed_check = false) {
-  std::ifstream file(path, std::ios::binary);
-  if (!file.good()) {
-    std::cerr << "[pllama] Cannot open model file: " << path << std::endl;
-    return false;
+// Runs one request. With a resident handle the model load is skipped
+// entirely; otherwise the model is acquired from the registry by path, which
+// still reuses it if another caller keeps it open.
+static void run_inference(pllama_model_handle *resident,
+                          pllama_inference_request request,
+                          pllama_inference_callback callback) {
+  RingFinisher ring_finisher{request.token_ring};
+  // With a Dart port, every response goes there; errors and cancellation
+  // become ended messages through the routed callback.
+  DartPortRoute port_route(request.dart_port, request.request_id);
+  if (request.dart_port != 0) {
+    callback = pllama_dart_port_callback;
   }
-  
-  // Check file size
-  file.seekg(0, std::ios::end);
-  size_t size = file.tellg();
-  file.seekg(0, std::ios::beg);
-  
-  if (size < 32) { // Very small files can't be valid models
-    std::cerr << "[pllama] File too small to be a valid model: " << size << " bytes" << std::endl;
-    return false;
-  }
-  
-  // Check GGUF magic
-  char header[4];
-  file.read(header, 4);
-  bool valid_header = header[0] == 'G' && header[1] == 'G' && 
-                     header[2] == 'U' && header[3] == 'F';
-  
-  if (!valid_header) {
-    std::cerr << "[pllama] Invalid model file format (not a GGUF file)" << std::endl;
-    return false;
-  }
-  
-  // For detailed validation, we could check file version, tensor counts, etc.
-  if (detailed_check) {
-    // Read GGUF version
-    uint32_t version;
-    file.read(reinterpret_cast<char*>(&version), sizeof(version));
-    
-    // More detailed validation as needed
-    std::cout << "[pllama] GGUF version: " << version << std::endl;
-  }
-  
-  return true;
-}
 
-EMSCRIPTEN_KEEPALIVE void
-pllama_inference_sync(pllama_inference_request request,
-                      pllama_inference_callback callback) {
-  // Prevent concurrent model loading
-  if (model_loading_in_progress.exchange(true)) {
-    // Another loading operation is already in progress
-    if (callback != NULL) {
-      callback("Error: Another model loading operation is already in progress", true);
-    }
-    model_loading_in_progress.store(false);
-    return;
-  }
-  
-  // Reset the flag when we exit this function
-  auto reset_loading_flag = [&]() {
-    model_loading_in_progress.store(false);
-  };
-  
   // Setup parameters, then load the model and create a context.
   int64_t start = ggml_time_ms();
-  std::cout << "[pllama] Inference thread start" << std::endl;
+  PLLAMA_LOG_DEBUG(request.dart_logger, "Inference thread start");
   
   // Validate input parameters before proceeding
-  if (!request.model_path || !request.input) {
+  if ((resident == nullptr && !request.model_path) || !request.input) {
     if (callback != NULL) {
       callback("Error: Missing required input parameters (model_path and input are required)", true);
     }
-    std::cerr << "[pllama] Missing required input parameters" << std::endl;
-    reset_loading_flag();
-    return;
-  }
-  
-  // Verify model file header
-  if (!verify_model_file(request.model_path)) {
-    if (callback != NULL) {
-      callback("Error: Invalid or inaccessible model file", true);
-    }
-    reset_loading_flag();
+    PLLAMA_LOG_ERROR(request.dart_logger, "Missing required input parameters");
     return;
   }
   
+  pllama_model_handle *handle = nullptr;
+  llama_model *model = nullptr;
+  pllama_pooled_context *pooled = nullptr;
+  llama_context *ctx = nullptr;
+  pllama_model_handle *draft_handle = nullptr;
+  pllama_pooled_context *draft_pooled = nullptr;
+  std::unique_ptr<DecoderStrategy> decoder;
+  llama_sampler *smpl = nullptr;
+  std::vector<llava_image_embed *> image_embeddings;
+
+  // Declared outside the try below so that an exception releases them too.
+  // Safe to call more than once.
+  auto cleanup = [&]() {
+    // Proper resource cleanup in order
+    // The decoder may still clean up its KV cache sequences.
+    decoder.reset();
+    if (smpl)
+      llama_sampler_free(smpl);
+    smpl = nullptr;
+    // Return the context to the pool before the model can go away.
+    if (pooled)
+      pllama_context_release(pooled);
+    pooled = nullptr;
+    ctx = nullptr;
+    if (handle)
+      pllama_model_release(handle);
+    handle = nullptr;
+    model = nullptr;
+    if (draft_pooled)
+      pllama_context_release(draft_pooled);
+    draft_pooled = nullptr;
+    if (draft_handle)
+      pllama_model_release(draft_handle);
+    draft_handle = nullptr;
+    pllama_runtime_set_request_logger(nullptr);
+  };
+  // After an exception the KV cache may hold more than pooled->tokens says;
+  // forgetting them makes the next request start from an empty cache.
+  auto abandon_context = [&]() {
+    if (pooled)
+      pooled->tokens.clear();
+  };
+
   try {
-    // Release memory before loading
-    force_memory_release();
+    // Only trims / evicts when RSS is over the configured budget
+    pllama_memory_relieve_pressure(request.dart_logger);
     
-    ggml_backend_load_all();
-    std::cout << "[pllama] Backend initialized." << std::endl;
+    // Backends, logging and threadpools are set up once per process
+    pllama_runtime_ensure_init();
 
-    // Create model parameters with optimized settings for better loading performance
-    llama_model_params model_params = llama_model_default_params();
-    
-    // Optimize for memory-constrained environments
-    model_params.n_gpu_layers = request.num_gpu_layers;
-    model_params.use_mmap = true;  // Use memory mapping for efficiency
-    model_params.use_mlock = false; // Don't lock memory
-    model_params.progress_callback = NULL; // No progress callback for cleaner loading
-    
     // Optimize context parameters
     llama_context_params ctx_params = llama_context_default_params();
     ctx_params.n_ctx = request.context_size;
-    ctx_params.n_batch = request.context_size;
+    ctx_params.n_batch =
+        request.n_batch > 0 ? request.n_batch : PLLAMA_DEFAULT_N_BATCH;
+    ctx_params.n_ubatch =
+        request.n_ubatch > 0 ? request.n_ubatch : PLLAMA_DEFAULT_N_UBATCH;
     
     // Enforce safe limits for mobile
     #if defined(__ANDROID__) || (defined(__APPLE__) && (TARGET_OS_IOS || TARGET_IPHONE_SIMULATOR))
-      // Mobile device - force even more conservative settings
-      model_params.n_gpu_layers = 0; // CPU only on mobile
-      model_params.use_mmap = true;
-      
+      // Mobile device - force even more conservative settings. The model
+      // registry already keeps mobile loads CPU only.
       // Limit thread count on mobile
       if (request.num_threads > 2) {
         ctx_params.n_threads = 2;
-        if (request.dart_logger) {
-          request.dart_logger("[pllama] Mobile detected: limiting to 2 threads for stability");
-        }
+        PLLAMA_LOG_INFO(request.dart_logger,
+                        "Mobile detected: limiting to 2 threads for stability");
       } else {
         ctx_params.n_threads = request.num_threads;
       }
@@ -355,119 +335,245 @@ pllama_inference_sync(pllama_inference_request request,
     
     // ctx_params.seed = LLAMA_DEFAULT_SEED; // 이 라인은 오류 발생으로 제거
     ctx_params.flash_attn = false; // Disable flash attention for compatibility
-    
-    std::cout << "[pllama] Context size: " << ctx_params.n_ctx << std::endl;
-    std::cout << "[pllama] Batch size: " << ctx_params.n_batch << std::endl;
-    std::cout << "[pllama] Threads: " << ctx_params.n_threads << std::endl;
-    std::cout << "[pllama] GPU layers: " << model_params.n_gpu_layers << std::endl;
-
-    // Configure sampling
-    llama_sampler *smpl =
-        llama_sampler_chain_init(llama_sampler_chain_default_params());
-    llama_sampler_chain_add(
-        smpl, llama_sampler_init_min_p((1.0f - request.top_p), 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(request.temperature));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-
-    // Configure logging
-    if (request.dart_logger != NULL) {
-      std::cout << "[pllama] Using custom logger" << std::endl;
-      llama_log_set(
-          [](enum ggml_log_level level, const char *text, void *user_data) {
-            pllama_log_callback dart_logger =
-                reinterpret_cast<pllama_log_callback>(user_data);
-            dart_logger(text);
-          },
-          reinterpret_cast<void *>(request.dart_logger));
-    } else {
-      llama_log_set(log_callback_wrapper, NULL);
+
+    // With a memory budget set, size the request from the GGUF header before
+    // any weights are mapped: shrink micro-batches and the context, or refuse
+    // the request
+    const std::string plan_model_path =
+        resident != nullptr ? resident->path : request.model_path;
+    // Weights already mapped by a handle or a prefetch are part of RSS
+    // already; counting them again would shrink requests that fit.
+    bool weights_resident = resident != nullptr;
+    if (!weights_resident) {
+      pllama_model_handle *found = pllama_model_find(plan_model_path);
+      if (found != nullptr) {
+        weights_resident = true;
+        pllama_model_release(found);
+      }
+    }
+    const uint32_t requested_ctx = ctx_params.n_ctx;
+    const uint32_t min_ctx = (uint32_t)std::max(request.max_tokens, 1) + 1;
+    if (!pllama_memory_plan_context(plan_model_path, weights_resident,
+                                    min_ctx, &ctx_params.n_ctx,
+                                    &ctx_params.n_batch, &ctx_params.n_ubatch,
+                                    request.dart_logger)) {
+      if (callback != NULL) {
+        callback("Error: Request does not fit in the memory budget", true);
+      }
+      return;
     }
+
+    PLLAMA_LOG_INFO(request.dart_logger,
+                    "Context size: %u, batch size: %u, micro-batch size: %u, "
+                    "threads: %d, GPU layers: %d",
+                    ctx_params.n_ctx, ctx_params.n_batch, ctx_params.n_ubatch,
+                    ctx_params.n_threads, request.num_gpu_layers);
+
+    // Route llama.cpp logs to the request's logger while it runs
+    pllama_runtime_set_request_logger(request.dart_logger);
     
     // Multimodal handling
     bool prompt_contains_img = prompt_contains_image(request.input);
     bool should_load_clip = false;
     if (prompt_contains_img) {
-      log_message("Prompt contains images, will process them later.",
-                 request.dart_logger);
+      PLLAMA_LOG_INFO(request.dart_logger,
+                      "Prompt contains images, will process them later.");
       std::string mmproj =
           request.model_mmproj_path == NULL ? "" : request.model_mmproj_path;
       if (mmproj.empty()) {
-        log_message(
-              "Warning: prompt contains images, but inference request doesn't "
+        PLLAMA_LOG_WARN(
+              request.dart_logger,
+              "Prompt contains images, but inference request doesn't "
               "specify model_mmproj_path. Multimodal model requires a .mmproj "
-              "file.",
-              request.dart_logger);
+              "file.");
       } else {
         should_load_clip = true;
       }
     }
 
-    llama_model *model = nullptr;
-    llama_context *ctx = nullptr;
-    std::vector<llava_image_embed *> image_embeddings;
-    char *c_result = nullptr;
+    // How generated tokens are decoded. Every strategy but single-token
+    // decoding follows the KV cache by token, which is not known with images.
+    int decoder_type = request.decoder;
+    if (decoder_type == PLLAMA_DECODER_AUTO) {
+      if (request.draft_model_path != NULL &&
+          request.draft_model_path[0] != '\0') {
+        decoder_type = PLLAMA_DECODER_DRAFT_MODEL;
+      } else if (request.prompt_lookup) {
+        decoder_type = PLLAMA_DECODER_PROMPT_LOOKUP;
+      } else {
+        decoder_type = PLLAMA_DECODER_SINGLE;
+      }
+    }
+    if (decoder_type == PLLAMA_DECODER_DRAFT_MODEL &&
+        (request.draft_model_path == NULL ||
+         request.draft_model_path[0] == '\0')) {
+      PLLAMA_LOG_WARN(request.dart_logger,
+                      "Draft model decoding needs draft_model_path.");
+      decoder_type = PLLAMA_DECODER_SINGLE;
+    }
+    if (decoder_type != PLLAMA_DECODER_SINGLE && prompt_contains_img) {
+      PLLAMA_LOG_WARN(request.dart_logger,
+                      "Only single-token decoding is supported with images.");
+      decoder_type = PLLAMA_DECODER_SINGLE;
+    }
+    if (decoder_type == PLLAMA_DECODER_LOOKAHEAD) {
+      ctx_params.n_seq_max = LookaheadDecoder::LOOKAHEAD_N_SEQ;
+    }
 
-    auto cleanup = [&]() {
-      // Proper resource cleanup in order
-      if (ctx)
-        llama_free(ctx);
-      if (model)
-        llama_model_free(model);
-      if (smpl)
-        llama_sampler_free(smpl);
-      llama_backend_free();
-      if (c_result) free(c_result);
-      reset_loading_flag();
-    };
+    if (resident != nullptr) {
+      // Resident model: nothing to load, though a prefetch may still be
+      // finishing.
+      pllama_model_retain(resident);
+      handle = resident;
+      if (!pllama_model_wait(handle)) {
+        if (callback != NULL) {
+          callback("Error: Invalid, inaccessible or unloadable model file", true);
+        }
+        cleanup();
+        return;
+      }
+    } else {
+      // Reuse the resident copy, or validate the header and load the model in
+      // a single pass
+      if (request.dart_logger) {
+        PLLAMA_LOG_INFO(request.dart_logger,
+                        "Loading model - this may take some time...");
+      }
 
-    // Progressive model loading approach for better memory management
-    log_message("Starting progressive model loading...", request.dart_logger);
-    
-    // Step 1: Load vocabulary only first (much faster and lower memory)
-    std::cout << "[pllama] Phase 1: Loading model vocabulary..." << std::endl;
-    model_params.vocab_only = true;
-    model = llama_model_load_from_file(request.model_path, model_params);
-    
-    if (model == NULL) {
-      std::cout << "[pllama] Unable to load model vocabulary." << std::endl;
-      if (callback != NULL) {
-        callback("Error: Unable to load model vocabulary", true);
+      // Reports progress and gives up as soon as the request is cancelled,
+      // instead of finishing a load nobody is waiting for
+      auto load_progress = [&request](float progress) {
+        if (request.progress_callback != NULL) {
+          request.progress_callback(progress);
+        }
+        return !global_inference_queue.is_cancelled(request.request_id);
+      };
+      handle = pllama_model_acquire(request.model_path, request.num_gpu_layers,
+                                    load_progress,
+                                    request.n_prefault_threads);
+      if (handle == nullptr &&
+          global_inference_queue.is_cancelled(request.request_id)) {
+        PLLAMA_LOG_INFO(request.dart_logger, "Request cancelled during model load");
+        if (callback != NULL) {
+          callback("", true);
+        }
+        cleanup();
+        return;
+      }
+      if (handle == nullptr) {
+        PLLAMA_LOG_ERROR(request.dart_logger, "Unable to load model.");
+        if (callback != NULL) {
+          callback("Error: Invalid, inaccessible or unloadable model file", true);
+        }
+        cleanup();
+        return;
       }
-      cleanup();
-      return;
     }
-    
-    // Release memory again after vocabulary load
-    force_memory_release();
-    
-    // Step 2: Now load the full model
-    std::cout << "[pllama] Phase 2: Loading full model..." << std::endl;
-    llama_model_free(model);
-    model = nullptr;
-    
-    model_params.vocab_only = false;
-    
-    // More detailed progress logging for full model load
-    if (request.dart_logger) {
-      request.dart_logger("[pllama] Loading full model - this may take some time...");
+    model = handle->model;
+
+    PLLAMA_LOG_DEBUG(request.dart_logger, "Model loaded successfully");
+
+    // Configure sampling. Temperature 0 always picks the most likely token,
+    // whatever min_p keeps, so it skips min_p, temp and dist.
+    smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    // 0 is what callers that leave penalty_repeat unset pass; it would zero
+    // out positive logits.
+    const float penalty_repeat =
+        request.penalty_repeat > 0.0f ? request.penalty_repeat : 1.0f;
+    llama_sampler *penalties = nullptr;
+    if (penalty_repeat != 1.0f || request.penalty_freq != 0.0f) {
+      penalties = pllama_sampler_init_penalties(
+          PLLAMA_PENALTY_LAST_N, penalty_repeat, request.penalty_freq);
+      llama_sampler_chain_add(smpl, penalties);
     }
-    
-    model = llama_model_load_from_file(request.model_path, model_params);
-    if (model == NULL) {
-      std::cout << "[pllama] Unable to load full model." << std::endl;
+    if ((request.logit_bias != NULL && request.n_logit_bias > 0) ||
+        (request.banned_token_ids != NULL && request.n_banned_token_ids > 0)) {
+      const int32_t n_vocab =
+          llama_vocab_n_tokens(llama_model_get_vocab(model));
+      std::vector<std::pair<llama_token, float>> biases;
+      for (int32_t i = 0; request.logit_bias != NULL && i < request.n_logit_bias;
+           i++) {
+        const pllama_logit_bias &entry = request.logit_bias[i];
+        if (entry.token < 0 || entry.token >= n_vocab ||
+            !std::isfinite(entry.bias)) {
+          PLLAMA_LOG_WARN(request.dart_logger,
+                          "Ignoring logit bias %f for token %d.", entry.bias,
+                          entry.token);
+          continue;
+        }
+        biases.emplace_back(entry.token, entry.bias);
+      }
+      for (int32_t i = 0;
+           request.banned_token_ids != NULL && i < request.n_banned_token_ids;
+           i++) {
+        const int32_t token = request.banned_token_ids[i];
+        if (token < 0 || token >= n_vocab) {
+          PLLAMA_LOG_WARN(request.dart_logger,
+                          "Ignoring banned token %d, not in the vocab.", token);
+          continue;
+        }
+        biases.emplace_back(token, -INFINITY);
+      }
+      if (!biases.empty()) {
+        llama_sampler_chain_add(smpl, pllama_sampler_init_logit_bias(biases));
+      }
+    }
+    const bool has_grammar =
+        request.grammar != NULL && request.grammar[0] != '\0';
+    const bool has_json_schema =
+        request.json_schema != NULL && request.json_schema[0] != '\0';
+    if (has_grammar && has_json_schema) {
+      PLLAMA_LOG_ERROR(request.dart_logger,
+                       "Request sets both grammar and json_schema.");
       if (callback != NULL) {
-        callback("Error: Unable to load full model", true);
+        callback("Error: Either grammar or json_schema can be set, not both",
+                 true);
       }
       cleanup();
       return;
     }
-
-    log_message("Model loaded successfully", request.dart_logger);
+    if (has_grammar) {
+      llama_sampler *grammar =
+          pllama_sampler_init_grammar(handle->grammars, request.grammar);
+      if (grammar == nullptr) {
+        PLLAMA_LOG_ERROR(request.dart_logger, "Unable to parse grammar.");
+        if (callback != NULL) {
+          callback("Error: Invalid grammar", true);
+        }
+        cleanup();
+        return;
+      }
+      llama_sampler_chain_add(smpl, grammar);
+    }
+    if (has_json_schema) {
+      llama_sampler *schema = pllama_sampler_init_json_schema(
+          handle->grammars, request.json_schema);
+      if (schema == nullptr) {
+        PLLAMA_LOG_ERROR(request.dart_logger, "Unable to convert JSON schema.");
+        if (callback != NULL) {
+          callback("Error: Invalid JSON schema", true);
+        }
+        cleanup();
+        return;
+      }
+      llama_sampler_chain_add(smpl, schema);
+    }
+    if (request.temperature <= 0.0f) {
+      llama_sampler_chain_add(smpl, pllama_sampler_init_greedy());
+    } else {
+      llama_sampler_chain_add(
+          smpl, llama_sampler_init_min_p((1.0f - request.top_p), 1));
+      llama_sampler_chain_add(smpl,
+                              llama_sampler_init_temp(request.temperature));
+      llama_sampler_chain_add(smpl,
+                              llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    }
     
-    // Create context with the loaded model
-    ctx = llama_init_from_model(model, ctx_params);
+    // Take a warm context for this model from the pool, or create one
+    pooled = pllama_context_acquire(model, ctx_params);
+    ctx = pooled != nullptr ? pooled->ctx : nullptr;
     if (ctx == NULL) {
-      std::cout << "[pllama] Unable to create context." << std::endl;
+      PLLAMA_LOG_ERROR(request.dart_logger, "Unable to create context.");
       if (callback != NULL) {
         callback("Error: Unable to create context", true);
       }
@@ -481,13 +587,13 @@ pllama_inference_sync(pllama_inference_request request,
     if (should_load_clip) {
       std::string mmproj_path_std_str =
           request.model_mmproj_path == NULL ? "" : request.model_mmproj_path;
-      log_message("Loading multimodal model...", request.dart_logger);
+      PLLAMA_LOG_INFO(request.dart_logger, "Loading multimodal model...");
       const char *mmproj_path = mmproj_path_std_str.c_str();
       
       // Validate CLIP model path
       std::ifstream clip_file_check(mmproj_path);
       if (!clip_file_check.good()) {
-        std::cout << "[pllama] Unable to load CLIP model." << std::endl;
+        PLLAMA_LOG_ERROR(request.dart_logger, "Unable to load CLIP model.");
         if (callback != NULL) {
           callback("Error: Unable to load CLIP model", true);
         }
@@ -498,7 +604,7 @@ pllama_inference_sync(pllama_inference_request request,
       
       auto ctx_clip = clip_model_load(mmproj_path, /*verbosity=*/1);
       if (!ctx_clip) {
-        std::cout << "[pllama] Failed to load CLIP model." << std::endl;
+        PLLAMA_LOG_ERROR(request.dart_logger, "Failed to load CLIP model.");
         if (callback != NULL) {
           callback("Error: Failed to load CLIP model", true);
         }
@@ -506,7 +612,7 @@ pllama_inference_sync(pllama_inference_request request,
         return;
       }
       
-      std::cout << "Loaded CLIP model successfully" << std::endl;
+      PLLAMA_LOG_DEBUG(request.dart_logger, "Loaded CLIP model successfully");
       image_embeddings = llava_image_embed_make_with_prompt_base64(
           ctx_clip, ctx_params.n_threads, final_request_input);
       clip_free(ctx_clip);
@@ -515,30 +621,28 @@ pllama_inference_sync(pllama_inference_request request,
     // Process and clean up prompt if it contains images
     if (prompt_contains_img) {
       if (image_embeddings.empty()) {
-        std::cout
-            << "[pllama] Unable to create image embeddings, removing image "
-               "data from prompt."
-            << std::endl;
+        PLLAMA_LOG_WARN(request.dart_logger,
+                        "Unable to create image embeddings, removing image "
+                        "data from prompt.");
       } else {
-        std::cout << "[pllama] Images loaded, replacing image data in prompt "
-                     "with clip output"
-                  << std::endl;
+        PLLAMA_LOG_DEBUG(request.dart_logger,
+                         "Images loaded, replacing image data in prompt "
+                         "with clip output");
       }
       final_request_input = remove_all_images_from_prompt(request.input, "");
     }
 
     int64_t model_load_end = ggml_time_ms();
     int64_t model_load_duration_ms = model_load_end - start;
-    log_message("Model loaded in " + std::to_string(model_load_duration_ms) +
-                   " ms.",
-               request.dart_logger);
+    PLLAMA_LOG_INFO(request.dart_logger, "Model loaded in %lld ms.",
+                    (long long)model_load_duration_ms);
 
     // Tokenize the prompt
     const int n_ctx = llama_n_ctx(ctx);
     const llama_vocab * vocab = llama_model_get_vocab(model);
     
     if (!vocab) {
-      std::cout << "[pllama] Failed to get vocabulary." << std::endl;
+      PLLAMA_LOG_ERROR(request.dart_logger, "Failed to get vocabulary.");
       if (callback != NULL) {
         callback("Error: Failed to get vocabulary", true);
       }
@@ -551,7 +655,7 @@ pllama_inference_sync(pllama_inference_request request,
                         final_request_input.length(), NULL, 0, true, true);
     
     if (n_prompt_tokens <= 0) {
-      std::cout << "[pllama] Tokenization failed." << std::endl;
+      PLLAMA_LOG_ERROR(request.dart_logger, "Tokenization failed.");
       if (callback != NULL) {
         callback("Error: Tokenization failed", true);
       }
@@ -563,7 +667,7 @@ pllama_inference_sync(pllama_inference_request request,
     if (llama_tokenize(vocab, final_request_input.c_str(),
                        final_request_input.length(), tokens_list.data(),
                        tokens_list.size(), true, true) < 0) {
-      fprintf(stderr, "%s: tokenization failed\n", __func__);
+      PLLAMA_LOG_ERROR(request.dart_logger, "%s: tokenization failed", __func__);
       if (callback != NULL) {
         callback("Error: Unable to tokenize input", true);
       }
@@ -571,26 +675,49 @@ pllama_inference_sync(pllama_inference_request request,
       return;
     }
     
-    log_message("Input token count: " + std::to_string(tokens_list.size()),
-               request.dart_logger);
-    log_message("Output token count: " + std::to_string(request.max_tokens),
-               request.dart_logger);
+    PLLAMA_LOG_INFO(request.dart_logger,
+                    "Input token count: %zu, output token count: %d",
+                    tokens_list.size(), request.max_tokens);
     
     const int n_max_tokens = request.max_tokens;
     const int n_batch = ctx_params.n_batch;
     
-    // Validate context capacity
+    // Validate context capacity. The plan only knew max_tokens; when the
+    // prompt would have fit in the requested context, the budget is why.
     if (tokens_list.size() > static_cast<size_t>(n_ctx - n_max_tokens)) {
-      std::cout << "[pllama] Input too large for context size." << std::endl;
-      if (callback != NULL) {
-        callback("Error: Input too large for context size", true);
+      if ((uint32_t)n_ctx < requested_ctx &&
+          tokens_list.size() + n_max_tokens <= requested_ctx) {
+        PLLAMA_LOG_ERROR(request.dart_logger,
+                         "Context shrunk to %d tokens by the memory budget; "
+                         "%zu prompt tokens do not fit.",
+                         n_ctx, tokens_list.size());
+        if (callback != NULL) {
+          callback("Error: Request does not fit in the memory budget", true);
+        }
+      } else {
+        PLLAMA_LOG_ERROR(request.dart_logger,
+                         "Input too large for context size.");
+        if (callback != NULL) {
+          callback("Error: Input too large for context size", true);
+        }
       }
       cleanup();
       return;
     }
 
+    // Keep the part of the KV cache shared with the previous request on this
+    // context. Image embeddings are not tracked as tokens, so prompts with
+    // images always start from an empty cache.
+    const bool track_kv_tokens = image_embeddings.empty();
+    const int n_reused = pllama_context_reuse_prefix(
+        pooled, track_kv_tokens ? tokens_list : std::vector<llama_token>());
+    if (n_reused > 0) {
+      PLLAMA_LOG_INFO(request.dart_logger, "Reusing %d cached prompt tokens.",
+                      n_reused);
+    }
+
     // Process images embeddings first if they exist
-    int n_past = 0;
+    int n_past = n_reused;
     bool add_bos = llama_vocab_get_add_bos(vocab);
     int idx_embedding = 0;
     for (auto *embedding : image_embeddings) {
@@ -602,29 +729,51 @@ pllama_inference_sync(pllama_inference_request request,
                                 add_bos, request.dart_logger);
           idx_embedding++;
         }
-        log_message("Adding image #" + std::to_string(idx_embedding + 1) +
-                       " to context.",
-                   request.dart_logger);
+        PLLAMA_LOG_DEBUG(request.dart_logger, "Adding image #%d to context.",
+                         (int)idx_embedding + 1);
         auto success =
             add_image_embed_to_context(ctx, embedding, n_batch, &n_past);
         if (!success) {
-          log_message(
+          PLLAMA_LOG_WARN(
+              request.dart_logger,
               "Unable to add image to context. Continuing to run inference "
-              "anyway.",
-              request.dart_logger);
+              "anyway.");
         }
         llava_image_embed_free(embedding);
-        log_message("Added image #" + std::to_string(idx_embedding + 1) +
-                       " to context.",
-                   request.dart_logger);
+        PLLAMA_LOG_DEBUG(request.dart_logger, "Added image #%d to context.",
+                         (int)idx_embedding + 1);
       }
     }
 
-    log_message("Adding input to context...", request.dart_logger);
+    PLLAMA_LOG_DEBUG(request.dart_logger, "Adding input to context...");
     
-    // Add text tokens to context
-    if (!add_tokens_to_context(ctx, tokens_list, n_batch, &n_past, request.dart_logger)) {
-      std::cout << "[pllama] Failed to add tokens to context." << std::endl;
+    // Add the text tokens not already in the cache, a chunk at a time. What
+    // is decoded counts as cached right away, so a request cancelled during
+    // a long prompt leaves those chunks for the next one to reuse.
+    const std::vector<llama_token> prompt_tail(tokens_list.begin() + n_reused,
+                                               tokens_list.end());
+    auto prefill_chunk = [&](int n_done) {
+      if (track_kv_tokens) {
+        pooled->tokens.assign(tokens_list.begin(),
+                              tokens_list.begin() + n_reused + n_done);
+      }
+      if (request.prefill_callback != NULL) {
+        request.prefill_callback(n_reused + n_done, (int32_t)tokens_list.size());
+      }
+      return !global_inference_queue.is_cancelled(request.request_id);
+    };
+    if (!add_tokens_to_context(ctx, prompt_tail, n_batch, &n_past,
+                               request.dart_logger, prefill_chunk)) {
+      if (global_inference_queue.is_cancelled(request.request_id)) {
+        PLLAMA_LOG_INFO(request.dart_logger,
+                        "Request cancelled while processing the prompt");
+        if (callback != NULL) {
+          callback("", true);
+        }
+        cleanup();
+        return;
+      }
+      PLLAMA_LOG_ERROR(request.dart_logger, "Failed to add tokens to context.");
       if (callback != NULL) {
         callback("Error: Failed to add tokens to context", true);
       }
@@ -632,36 +781,75 @@ pllama_inference_sync(pllama_inference_request request,
       return;
     }
     
-    log_message("Input added to context successfully", request.dart_logger);
+    PLLAMA_LOG_DEBUG(request.dart_logger, "Input added to context successfully");
+    if (track_kv_tokens) {
+      pooled->tokens = tokens_list;
+    }
+
+    // Strategies other than single-token decoding need the drafting model
+    // or the KV cache sequences set up. Any problem with the draft model
+    // falls back to single-token decoding.
+    const int n_draft =
+        request.n_draft > 0 ? request.n_draft : PLLAMA_DEFAULT_N_DRAFT;
+    if (decoder_type == PLLAMA_DECODER_DRAFT_MODEL) {
+      draft_handle = pllama_model_acquire(request.draft_model_path,
+                                          request.num_gpu_layers, nullptr,
+                                          request.n_prefault_threads);
+      if (draft_handle == nullptr) {
+        PLLAMA_LOG_WARN(request.dart_logger, "Unable to load draft model: %s",
+                        request.draft_model_path);
+      } else if (!pllama_speculative_compatible(model, draft_handle->model)) {
+        PLLAMA_LOG_WARN(request.dart_logger,
+                        "Draft model vocab does not match the model's.");
+      } else if ((draft_pooled = pllama_context_acquire(draft_handle->model,
+                                                        ctx_params)) ==
+                 nullptr) {
+        PLLAMA_LOG_WARN(request.dart_logger,
+                        "Unable to create draft model context.");
+      } else {
+        decoder.reset(new SpeculativeDecoder(
+            std::unique_ptr<DraftProposer>(
+                new DraftModelProposer(draft_pooled, n_batch)),
+            n_draft));
+      }
+    } else if (decoder_type == PLLAMA_DECODER_PROMPT_LOOKUP) {
+      decoder.reset(new SpeculativeDecoder(
+          std::unique_ptr<DraftProposer>(new PromptLookupProposer(tokens_list)),
+          n_draft));
+    } else if (decoder_type == PLLAMA_DECODER_LOOKAHEAD) {
+      decoder.reset(new LookaheadDecoder(ctx, tokens_list));
+    }
+    if (!decoder) {
+      decoder_type = PLLAMA_DECODER_SINGLE;
+      decoder.reset(new SingleTokenDecoder());
+    }
+    PLLAMA_LOG_DEBUG(request.dart_logger, "Decoder strategy: %d", decoder_type);
     
-    // Get EOS token for generation
+    // Get EOS token for generation, from the loaded vocab unless overridden
+    const char *model_eos_chars =
+        request.eos_token != NULL ? NULL : pllama_model_get_eos_token(handle);
     const char *eos_token_chars =
-        request.eos_token != NULL ? request.eos_token
-                                  : pllama_get_eos_token(request.model_path);
+        request.eos_token != NULL ? request.eos_token : model_eos_chars;
     
-    // Check if EOS token retrieval failed
+    // A vocab without an EOS token has no EOS text to stop at; the empty
+    // string is ignored by the stop matcher
     if (!eos_token_chars) {
-      std::cout << "[pllama] Failed to get EOS token." << std::endl;
-      if (callback != NULL) {
-        callback("Error: Failed to get EOS token", true);
-      }
-      cleanup();
-      return;
+      PLLAMA_LOG_DEBUG(request.dart_logger, "Model has no EOS token.");
+      eos_token_chars = "";
     }
     
     const std::string eos_token_as_string = std::string(eos_token_chars);
-    free((void *)eos_token_chars);
+    delete[] model_eos_chars;
     
     const int64_t context_setup_complete = ggml_time_ms();
-    log_message("Context setup complete in " +
-                   std::to_string(context_setup_complete - start) + " ms.",
-               request.dart_logger);
+    PLLAMA_LOG_INFO(request.dart_logger, "Context setup complete in %lld ms.",
+                    (long long)(context_setup_complete - start));
 
     // Check for cancellation before starting generation
     int request_id = request.request_id;
     if (global_inference_queue.is_cancelled(request_id)) {
-      log_message("Request cancelled before generation started",
-                 request.dart_logger);
+      PLLAMA_LOG_INFO(request.dart_logger,
+                      "Request cancelled before generation started");
       if (callback != NULL) {
         callback("", true);
       }
@@ -674,27 +862,23 @@ pllama_inference_sync(pllama_inference_request request,
       callback("", false);
     }
     
-    // Allocate result buffer with safety checks
-    const auto estimated_total_size = n_max_tokens * 10;
+    // Full output so far. Callbacks read it in place instead of a copy.
     std::string result;
-    result.reserve(estimated_total_size);
-    c_result = (char *)malloc(estimated_total_size);
-    if (!c_result) {
-      std::cout << "[pllama] Failed to allocate memory for result." << std::endl;
-      if (callback != NULL) {
-        callback("Error: Memory allocation failure", true);
-      }
-      cleanup();
-      return;
-    }
-    c_result[0] = '\0'; // Initialize to empty string
+    result.reserve(n_max_tokens * 10);
+    pllama_stream_options stream_options;
+    stream_options.flush_tokens = request.stream_flush_tokens;
+    stream_options.flush_interval_ms = request.stream_flush_interval_ms;
+    stream_options.async = request.stream_async != 0;
+    stream_options.dart_port = request.dart_port;
+    stream_options.request_id = request.request_id;
+    TokenStream stream(callback, request.delta_callback, stream_options);
 
     // Generation loop with improved error handling and stability
-    log_message("[DEBUG] starting token generation loop", request.dart_logger);
+    PLLAMA_LOG_DEBUG(request.dart_logger, "starting token generation loop");
     
     // Safely sample first token
     if (!ctx) {
-      std::cout << "[pllama] Context is null before token generation." << std::endl;
+      PLLAMA_LOG_ERROR(request.dart_logger, "Context is null before token generation.");
       if (callback != NULL) {
         callback("Error: Context is null", true);
       }
@@ -702,10 +886,21 @@ pllama_inference_sync(pllama_inference_request request,
       return;
     }
     
+    // Like llama.cpp's examples, repeating the end of the prompt is
+    // penalized too.
+    if (penalties != nullptr) {
+      const size_t n_prompt_window = std::min(
+          tokens_list.size(), static_cast<size_t>(PLLAMA_PENALTY_LAST_N));
+      for (size_t i = tokens_list.size() - n_prompt_window;
+           i < tokens_list.size(); i++) {
+        llama_sampler_accept(penalties, tokens_list[i]);
+      }
+    }
+
     // Start token generation
-    llama_token new_token_id = llama_sampler_sample(smpl, ctx, -1);
+    llama_token new_token_id = pllama_sampler_sample(smpl, ctx, -1);
     if (new_token_id == -1) {
-      std::cout << "[pllama] Failed to sample first token." << std::endl;
+      PLLAMA_LOG_ERROR(request.dart_logger, "Failed to sample first token.");
       if (callback != NULL) {
         callback("Error: Token sampling failed", true);
       }
@@ -723,108 +918,228 @@ pllama_inference_sync(pllama_inference_request request,
         "<|end|>",           // Phi 3 24-04-30
         "<|eot_id|>"         // Llama 3 24-04-30
     };
+    // End-of-turn text straight from the loaded vocab, no file access needed
+    const llama_token model_eot_token = llama_vocab_eot(vocab);
+    if (model_eot_token != LLAMA_TOKEN_NULL) {
+      eos_tokens.push_back(llama_vocab_get_text(vocab, model_eot_token));
+    }
+
+    // End-of-turn texts the model writes out instead of sampling its EOG
+    // token stop generation too, along with the request's own stops
+    StopMatcher stops;
+    for (const std::string &eos : eos_tokens) {
+      stops.add_string(eos);
+    }
+    for (int32_t i = 0; i < request.n_stop_strings; i++) {
+      if (request.stop_strings != NULL && request.stop_strings[i] != NULL) {
+        stops.add_string(request.stop_strings[i]);
+      }
+    }
+    for (int32_t i = 0; i < request.n_stop_token_ids; i++) {
+      if (request.stop_token_ids != NULL) {
+        stops.add_token(request.stop_token_ids[i]);
+      }
+    }
+    stops.build();
     
-    // Main token generation loop with batch processing
-    llama_batch batch = llama_batch_get_one(&new_token_id, 1);
+    // Token text comes from the model's piece table; characters split across
+    // tokens are held back until complete, so every delta is valid UTF-8
+    const std::shared_ptr<const pllama_piece_table> pieces = handle->pieces;
+    if (!pieces) {
+      if (callback != NULL) {
+        callback("Error: Unable to read model vocabulary", true);
+      }
+      cleanup();
+      return;
+    }
+    IncrementalDetokenizer detokenizer(*pieces);
+    std::string piece;
+
     bool generation_complete = false;
-    
+    bool stop_matched = false;
+    pllama_finish_reason finish_reason = PLLAMA_FINISH_LENGTH;
+    LoopDetector loops(request.loop_window,
+                       request.loop_min_repeats > 0
+                           ? request.loop_min_repeats
+                           : PLLAMA_DEFAULT_LOOP_MIN_REPEATS);
+
+    // Add to result and send update: only the new piece in delta mode, the
+    // full text otherwise, possibly coalesced with later tokens. Text that
+    // may be the start of a stop string waits in the matcher. Returns false
+    // when generation has to end.
+    auto emit_token = [&](llama_token token) {
+        piece.clear();
+        detokenizer.push(token, piece);
+        const size_t piece_offset = result.size();
+        const bool stopped = stops.push(piece.data(), piece.size(), result);
+        const size_t piece_len = result.size() - piece_offset;
+        if (request.token_ring != NULL) {
+            const pllama_ring_write_result written = pllama_ring_write(
+                request.token_ring, token, result.data() + piece_offset,
+                (uint32_t)piece_len, [request_id]() {
+                  return global_inference_queue.is_cancelled(request_id);
+                });
+            n_gen++;
+            if (written == pllama_ring_write_result::full) {
+                // PLLAMA_RING_OVERFLOW_STOP ends it like max_tokens
+                PLLAMA_LOG_INFO(request.dart_logger, "token ring full, stopping");
+                finish_reason = PLLAMA_FINISH_LENGTH;
+                return false;
+            }
+            if (written == pllama_ring_write_result::closed) {
+                PLLAMA_LOG_INFO(request.dart_logger,
+                                "token ring closed or request cancelled, stopping");
+                finish_reason = PLLAMA_FINISH_CANCELLED;
+                return false;
+            }
+        } else if (piece_len > 0) {
+            stream.push(result, n_gen++);
+        } else {
+            n_gen++; // Only part of a character or a possible stop so far
+        }
+        if (stopped) {
+            PLLAMA_LOG_DEBUG(request.dart_logger, "stop string matched");
+            stop_matched = true;
+            finish_reason = PLLAMA_FINISH_STOP;
+            return false;
+        }
+        if (loops.push(token)) {
+            PLLAMA_LOG_INFO(request.dart_logger,
+                            "output repeats every %d tokens, stopping",
+                            loops.period());
+            finish_reason = PLLAMA_FINISH_LOOP;
+            return false;
+        }
+        return true;
+    };
+
+    // End conditions, checked for every sampled token before it is output
+    auto should_end = [&](llama_token token) {
+        if (token == model_eos_token || llama_vocab_is_eog(vocab, token) ||
+            stops.is_stop_token(token)) {
+            PLLAMA_LOG_DEBUG(request.dart_logger, "end of generation detected");
+            finish_reason = PLLAMA_FINISH_STOP;
+            return true;
+        }
+        if (n_gen >= n_max_tokens) {
+            PLLAMA_LOG_DEBUG(request.dart_logger, "reached max tokens: %d", n_max_tokens);
+            finish_reason = PLLAMA_FINISH_LENGTH;
+            return true;
+        }
+        if (global_inference_queue.is_cancelled(request_id)) {
+            PLLAMA_LOG_DEBUG(request.dart_logger, "generation cancelled");
+            finish_reason = PLLAMA_FINISH_CANCELLED;
+            return true;
+        }
+        return false;
+    };
+
+    // Tokens sampled by the last decode: all but the last one were accepted
+    // drafts and are already in the KV cache
+    std::vector<llama_token> sampled;
+
+    // The first token too: it may be a stop, or max_tokens may allow none
+    generation_complete = should_end(new_token_id);
     while (!generation_complete) {
         // Check context space
         int n_ctx = llama_n_ctx(ctx);
         int n_ctx_used = llama_get_kv_cache_used_cells(ctx);
-        if (n_ctx_used + batch.n_tokens > n_ctx) {
-            log_message("[DEBUG] context size exceeded", request.dart_logger);
+        if (n_ctx_used + 1 > n_ctx) {
+            PLLAMA_LOG_DEBUG(request.dart_logger, "context size exceeded");
+            finish_reason = PLLAMA_FINISH_LENGTH;
             break;
         }
-    
-        // Convert current token to text
-        char token_text[256] = {0}; // Initialize to zeros for safety
-        int token_len = llama_token_to_piece(vocab, new_token_id, token_text, sizeof(token_text) - 1, 0, true);
-        if (token_len < 0) {
-            log_message("[DEBUG] failed to convert token to text", request.dart_logger);
+
+        if (!emit_token(new_token_id)) {
+            generation_complete = true;
             break;
         }
-        
-        // Ensure null termination
-        token_text[token_len < 255 ? token_len : 255] = '\0';
-        
-        // Add to result and send update
-        std::string piece(token_text);
-        result += piece;
-        n_gen++;
-        
-        // Send intermediate result to callback
-        if (callback != NULL) {
-            if (result.length() < estimated_total_size) {
-                std::strncpy(c_result, result.c_str(), estimated_total_size - 1);
-                c_result[estimated_total_size - 1] = '\0'; // Ensure null termination
-                callback(c_result, false);
-            } else {
-                log_message("[WARNING] Result exceeded estimated size", request.dart_logger);
-            }
-        }
-    
-        // Process the batch
-        if (llama_decode(ctx, batch)) {
-            log_message("[DEBUG] decode failed", request.dart_logger);
+
+        // Decode the token, with guesses of what follows it depending on
+        // the strategy, and sample the next token(s)
+        if (!decoder->step(ctx, smpl, pooled->tokens, new_token_id,
+                           n_max_tokens - n_gen, n_ctx - n_ctx_used,
+                           sampled)) {
+            PLLAMA_LOG_DEBUG(request.dart_logger, "decode failed");
+            finish_reason = PLLAMA_FINISH_ERROR;
             break;
         }
-        
-        // Sample next token
-        new_token_id = llama_sampler_sample(smpl, ctx, -1);
-    
-        // Check end conditions
-        if (new_token_id == model_eos_token || llama_vocab_is_eog(vocab, new_token_id)) {
-            log_message("[DEBUG] end of generation detected", request.dart_logger);
-            generation_complete = true;
-            break;
+        if (track_kv_tokens) {
+            pooled->tokens.push_back(new_token_id);
+            pooled->tokens.insert(pooled->tokens.end(), sampled.begin(),
+                                  sampled.end() - 1);
         }
-        
-        if (n_gen >= n_max_tokens) {
-            log_message("[DEBUG] reached max tokens: " + std::to_string(n_max_tokens), request.dart_logger);
-            generation_complete = true;
-            break;
+
+        for (size_t i = 0; i < sampled.size(); i++) {
+            new_token_id = sampled[i];
+            if (should_end(new_token_id)) {
+                generation_complete = true;
+                break;
+            }
+            // The last one is decoded on the next iteration
+            if (i + 1 < sampled.size() && !emit_token(new_token_id)) {
+                generation_complete = true;
+                break;
+            }
         }
-        
-        if (global_inference_queue.is_cancelled(request_id)) {
-            log_message("[DEBUG] generation cancelled", request.dart_logger);
-            generation_complete = true;
+        if (generation_complete) {
             break;
         }
-    
-        // Prepare next batch
-        batch = llama_batch_get_one(&new_token_id, 1);
-        
+
         // Log generation speed periodically
         const auto t_now = ggml_time_ms();
         if (t_now - t_last > 1000) {
             float speed = n_gen / ((t_now - start_t) / 1000.0f);
-            log_message("[pllama] generated " + std::to_string(n_gen) + 
-                      " tokens at " + std::to_string(speed) + " tokens/sec",
-                      request.dart_logger);
+            PLLAMA_LOG_INFO(request.dart_logger, "generated %d tokens at %f tokens/sec",
+                            n_gen, speed);
             t_last = t_now;
         }
     }
+    if (decoder->proposed() > 0) {
+        PLLAMA_LOG_INFO(request.dart_logger, "Accepted %d of %d drafted tokens",
+                        decoder->accepted(), decoder->proposed());
+    }
     
-    log_message("[DEBUG] token generation loop complete", request.dart_logger);
+    PLLAMA_LOG_DEBUG(request.dart_logger, "token generation loop complete");
+
+    // Unless a stop matched, whatever is still held back is output as is: a
+    // character that was cut off, or text that only began like a stop
+    const size_t tail_offset = result.size();
+    if (!stop_matched) {
+        piece.clear();
+        detokenizer.flush(piece);
+        if (!stops.push(piece.data(), piece.size(), result)) {
+            stops.flush(result);
+        }
+    }
+    const size_t tail_len = result.size() - tail_offset;
+    if (tail_len > 0) {
+        if (request.token_ring != NULL) {
+            pllama_ring_write(request.token_ring, PLLAMA_RING_TAIL,
+                              result.data() + tail_offset, (uint32_t)tail_len,
+                              [request_id]() {
+                                return global_inference_queue.is_cancelled(
+                                    request_id);
+                              });
+        } else {
+            stream.push(result, n_gen - 1);
+        }
+    }
     
     // Send final result
-    if (result.length() < estimated_total_size) {
-        std::strncpy(c_result, result.c_str(), estimated_total_size - 1);
-        c_result[estimated_total_size - 1] = '\0'; // Ensure null termination
-    } else {
-        log_message("[WARNING] Result exceeded estimated size", request.dart_logger);
-        std::strncpy(c_result, result.c_str(), estimated_total_size - 1);
-        c_result[estimated_total_size - 1] = '\0'; // Ensure null termination
+    if (request.finish_callback != NULL) {
+        request.finish_callback(finish_reason);
     }
-    
-    if (callback != NULL) {
-        log_message("[DEBUG] Invoking final callback", request.dart_logger);
-        callback(c_result, true);
-        log_message("[DEBUG] Final callback invoked", request.dart_logger);
+    stream.finish(result, n_gen, finish_reason);
+    if (request.dart_port != 0) {
+        // The stream already posted the done message.
+    } else if (callback != NULL) {
+        PLLAMA_LOG_DEBUG(request.dart_logger, "Invoking final callback");
+        callback(result.c_str(), true);
+        PLLAMA_LOG_DEBUG(request.dart_logger, "Final callback invoked");
     } else {
-        log_message("WARNING: callback is NULL. Output: " + result,
-                   request.dart_logger);
+        PLLAMA_LOG_WARN(request.dart_logger, "callback is NULL. Output: %s",
+                        result.c_str());
     }
 
     // Log final performance statistics
@@ -832,32 +1147,50 @@ pllama_inference_sync(pllama_inference_request request,
     const auto total_time_ms = t_now - start_t;
     const auto speed_tokens_per_sec = n_gen / (total_time_ms / 1000.0f);
     
-    const auto speed_string =
-        "Generated " + std::to_string(n_gen) + " tokens in " +
-        std::to_string(total_time_ms / 1000.0f) + " seconds, speed: " +
-        std::to_string(speed_tokens_per_sec) + " tokens/sec";
-
-    log_message(speed_string, request.dart_logger);
+    PLLAMA_LOG_INFO(request.dart_logger,
+                    "Generated %d tokens in %f seconds, speed: %f tokens/sec",
+                    n_gen, total_time_ms / 1000.0f, speed_tokens_per_sec);
     
     // Clean up resources
-    log_message("Cleaning up resources...", request.dart_logger);
+    PLLAMA_LOG_DEBUG(request.dart_logger, "Cleaning up resources...");
     cleanup();
-    log_message("Resources cleaned up successfully", request.dart_logger);
+    PLLAMA_LOG_DEBUG(request.dart_logger, "Resources cleaned up successfully");
   } catch (const std::exception &e) {
     std::string error_msg = "Unhandled error: " + std::string(e.what());
     if (callback != NULL) {
       callback(error_msg.c_str(), true);
     }
-    std::cerr << error_msg << std::endl;
-    model_loading_in_progress.store(false);
+    PLLAMA_LOG_ERROR(request.dart_logger, "%s", error_msg.c_str());
+    abandon_context();
+    cleanup();
   } catch (...) {
     std::string error_msg = "Unknown unhandled error occurred";
     if (callback != NULL) {
       callback(error_msg.c_str(), true);
     }
-    std::cerr << error_msg << std::endl;
-    model_loading_in_progress.store(false);
+    PLLAMA_LOG_ERROR(request.dart_logger, "%s", error_msg.c_str());
+    abandon_context();
+    cleanup();
+  }
+}
+
+EMSCRIPTEN_KEEPALIVE void
+pllama_inference_sync(pllama_inference_request request,
+                      pllama_inference_callback callback) {
+  run_inference(nullptr, request, callback);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_model_inference_sync(pllama_model_handle *handle,
+                            pllama_inference_request request,
+                            pllama_inference_callback callback) {
+  if (handle == NULL) {
+    if (callback != NULL) {
+      callback("Error: Model handle is null", true);
+    }
+    return;
   }
+  run_inference(handle, request, callback);
 }
 
 } // extern "C"
\ No newline at end of file
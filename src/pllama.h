@@ -15,6 +15,9 @@
 
 #include <stdint.h> // For uint8_t
 
+#include "pllama_model.h"
+#include "pllama_ring.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -23,6 +26,76 @@ extern "C" {
 // pllama.h에서 콜백 시그니처 수정
 typedef void (*pllama_inference_callback)(const char *response, uint8_t done);
 typedef void (*pllama_log_callback)(const char *);
+typedef void (*pllama_progress_callback)(float progress);
+// Streaming: piece is the text added since the previous call (piece_len
+// bytes, not NUL terminated), starting at byte_offset in the full output.
+// token_index is the index of the last generated token it covers (several
+// when coalescing). The last call has done set and an empty piece;
+// byte_offset is then the total output length and token_index the number of
+// generated tokens.
+typedef void (*pllama_delta_callback)(const char *piece, uint32_t piece_len,
+                                      uint64_t byte_offset,
+                                      int32_t token_index, uint8_t done);
+// Called once with a pllama_finish_reason when generation ends without an
+// error, before the final output is delivered.
+typedef void (*pllama_finish_callback)(int32_t finish_reason);
+// Prompt processing progress: n_done of n_total prompt tokens are decoded.
+// Called after each chunk of n_batch tokens.
+typedef void (*pllama_prefill_callback)(int32_t n_done, int32_t n_total);
+
+// Draft tokens per speculative step when the request does not set n_draft.
+#define PLLAMA_DEFAULT_N_DRAFT 8
+
+// Prompt tokens per decode when the request does not set n_batch; prefill
+// can be cancelled between decodes.
+#define PLLAMA_DEFAULT_N_BATCH 512
+
+// Tokens per micro-batch when the request does not set n_ubatch; llama.cpp's
+// default. The compute buffer grows with it.
+#define PLLAMA_DEFAULT_N_UBATCH 512
+
+// Recent tokens penalty_repeat and penalty_freq look back on; llama.cpp's
+// default.
+#define PLLAMA_PENALTY_LAST_N 64
+
+// How tokens are generated. All produce the same output for the same
+// sampler; they differ in how many tokens one decode can yield.
+enum pllama_decoder_type {
+  // Draft model when draft_model_path is set, else prompt lookup when
+  // prompt_lookup is set, else single token.
+  PLLAMA_DECODER_AUTO = 0,
+  PLLAMA_DECODER_SINGLE = 1,        // One token per decode.
+  PLLAMA_DECODER_DRAFT_MODEL = 2,   // Speculative, see draft_model_path.
+  PLLAMA_DECODER_PROMPT_LOOKUP = 3, // Speculative, see prompt_lookup.
+  PLLAMA_DECODER_LOOKAHEAD = 4,     // Lookahead (Jacobi) decoding: guesses
+                                    // from n-grams the model produced itself
+                                    // in a window decoded in the same batch.
+                                    // No second model; costs more compute
+                                    // per decode.
+};
+
+// Why generation ended.
+enum pllama_finish_reason {
+  PLLAMA_FINISH_STOP = 0,      // End-of-generation token, stop string or
+                               // stop token.
+  PLLAMA_FINISH_LENGTH = 1,    // max_tokens reached, the context is full or
+                               // the token ring is full under
+                               // PLLAMA_RING_OVERFLOW_STOP.
+  PLLAMA_FINISH_LOOP = 2,      // The output kept repeating, see loop_window.
+  PLLAMA_FINISH_CANCELLED = 3, // Cancelled, or the token ring was closed.
+  PLLAMA_FINISH_ERROR = 4,     // Decoding failed; the output so far is kept.
+};
+
+// Repetitions loop_window must hold when the request does not set
+// loop_min_repeats.
+#define PLLAMA_DEFAULT_LOOP_MIN_REPEATS 3
+
+// Bias added to one token's logit, ex. -5 to make it rarer or 5 to favor
+// it; logits typically range over a few tens.
+typedef struct pllama_logit_bias {
+  int32_t token;
+  float bias;
+} pllama_logit_bias;
 
 struct pllama_inference_request {
   int request_id; // Required: unique ID for the request. Used for cancellation.
@@ -38,13 +111,20 @@ struct pllama_inference_request {
   float
       temperature; // Optional: temperature. Defaults to 0. (llama.cpp behavior)
   float top_p; // Optional: 0 < top_p <= 1. Defaults to 1. (llama.cpp behavior)
-  float penalty_freq;   // Optional: 0 <= penalty_freq <= 1. Defaults to 0.0,
-                        // which means disabled. (llama.cpp behavior)
-  float penalty_repeat; // Optional: 0 <= penalty_repeat <= 1. Defaults to 1.0,
-                        // which means disabled. (llama.cpp behavior)
+  float penalty_freq;   // Optional: 0 <= penalty_freq <= 1. Lowers the logit
+                        // of each of the last PLLAMA_PENALTY_LAST_N tokens,
+                        // prompt included, by this much per occurrence.
+                        // Defaults to 0.0, which means disabled. (llama.cpp
+                        // behavior)
+  float penalty_repeat; // Optional: penalty_repeat > 1 makes the last
+                        // PLLAMA_PENALTY_LAST_N tokens less likely. Defaults
+                        // to 1.0, which means disabled; 0 is taken as 1.0.
+                        // (llama.cpp behavior)
   char *
-      grammar; // Optional: BNF-like grammar to constrain sampling. Defaults to
-               // "" (llama.cpp behavior). See
+      grammar; // Optional: BNF-like grammar to constrain sampling, starting
+               // at its "root" rule. Parsed once per model and text; the
+               // request fails if it does not parse. Defaults to ""
+               // (llama.cpp behavior). See
                // https://github.com/ggerganov/llama.cpp/blob/master/grammars/README.md
   char *eos_token; // Optional: end of sequence token. Defaults to one in model file. (llama.cpp behavior)
                    // For example, in ChatML / OpenAI, <|im_end|> means the message is complete.
@@ -52,6 +132,105 @@ struct pllama_inference_request {
                    // Using pllamaChat from Dart handles this automatically.
   pllama_log_callback
       dart_logger; // Optional: Dart caller logger. Defaults to NULL.
+  pllama_progress_callback
+      progress_callback; // Optional: called with model load progress, from 0
+                         // to 1. Not called when the model is already
+                         // resident. Defaults to NULL.
+  pllama_delta_callback
+      delta_callback; // Optional: stream only the new text per token. When
+                      // set, the inference callback is no longer called per
+                      // token; it still receives errors and the final full
+                      // text. Defaults to NULL, which streams the full text
+                      // through the inference callback.
+  int stream_flush_tokens; // Optional: coalesce streamed output, delivering
+                           // every N tokens. Defaults to 0, every token.
+  int stream_flush_interval_ms; // Optional: deliver at least this often
+                                // while tokens arrive, whichever of this and
+                                // stream_flush_tokens comes first. Defaults
+                                // to 0, no time limit.
+  uint8_t stream_async; // Optional: deliver streamed output from a
+                        // dispatcher thread, so a slow consumer never stalls
+                        // decoding; output is coalesced while it lags.
+                        // Defaults to 0, deliver on the inference thread.
+  pllama_token_ring *token_ring; // Optional: write generated tokens and their
+                                 // text here instead of streaming them
+                                 // through callbacks. Created and freed by
+                                 // the caller; marked done when the request
+                                 // ends. The inference callback still
+                                 // receives errors and the final full text.
+                                 // Defaults to NULL.
+  int64_t dart_port; // Optional: native port of a Dart SendPort. When set,
+                     // output is posted there as described in
+                     // pllama_dart_port.h and the inference callback is not
+                     // called. Requires pllama_dart_init. Defaults to 0.
+  const char **stop_strings; // Optional: end generation when the output
+                             // contains any of these; the output ends right
+                             // before it and streamed text never includes
+                             // any part of it. Also matched when split
+                             // across tokens. The model's end-of-turn texts
+                             // are always stops. Defaults to NULL.
+  int32_t n_stop_strings;
+  const int32_t *stop_token_ids; // Optional: end generation, without
+                                 // outputting it, when one of these tokens
+                                 // is sampled, in addition to the model's
+                                 // end-of-generation tokens. Defaults to
+                                 // NULL.
+  int32_t n_stop_token_ids;
+  char *draft_model_path; // Optional: path to a small model with the same
+                          // vocab, ex. a 1B model of the same family. When
+                          // set, it drafts tokens that the model verifies in
+                          // one batched decode (speculative decoding). The
+                          // output is the same, only faster when drafts are
+                          // accepted. Not used with images. Defaults to NULL.
+  int32_t n_draft; // Optional: most tokens drafted per step. Defaults to 0,
+                   // which means PLLAMA_DEFAULT_N_DRAFT.
+  uint8_t prompt_lookup; // Optional: speculative decoding that drafts by
+                         // finding the last generated tokens in the prompt
+                         // and proposing what followed them there. Helps
+                         // when the output copies from the input, ex.
+                         // summaries, extraction or code edits. Ignored when
+                         // draft_model_path is set. Defaults to 0.
+  int32_t decoder; // Optional: a pllama_decoder_type. Strategies other than
+                   // single token fall back to it with images. Defaults to
+                   // PLLAMA_DECODER_AUTO.
+  const char *json_schema; // Optional: JSON schema the output must match;
+                           // converted to a grammar once per model and
+                           // schema. Cannot be combined with grammar.
+                           // Defaults to NULL.
+  const pllama_logit_bias *logit_bias; // Optional: added to the logits of
+                                       // these tokens before sampling; a
+                                       // token listed twice gets both.
+                                       // Defaults to NULL.
+  int32_t n_logit_bias;
+  const int32_t *banned_token_ids; // Optional: never sampled. Defaults to
+                                   // NULL.
+  int32_t n_banned_token_ids;
+  int32_t loop_window; // Optional: end generation with PLLAMA_FINISH_LOOP
+                       // once the last loop_window generated tokens are a
+                       // block of tokens repeated loop_min_repeats times,
+                       // ex. 64. Defaults to 0, which means disabled.
+  int32_t loop_min_repeats; // Optional: at least 2. Defaults to 0, which
+                            // means PLLAMA_DEFAULT_LOOP_MIN_REPEATS.
+  pllama_finish_callback finish_callback; // Optional: told why generation
+                                          // ended; with dart_port, the done
+                                          // message carries it too.
+                                          // Defaults to NULL.
+  int32_t n_batch; // Optional: the prompt is decoded this many tokens at a
+                   // time, with a check for cancellation in between.
+                   // Defaults to 0, which means PLLAMA_DEFAULT_N_BATCH.
+                   // Capped at context_size.
+  int32_t n_ubatch; // Optional: tokens llama.cpp computes at once within a
+                    // decode; smaller needs less memory but decodes prompts
+                    // slower. Defaults to 0, which means
+                    // PLLAMA_DEFAULT_N_UBATCH. Capped at n_batch, and shrunk
+                    // to fit the memory budget when one is set.
+  pllama_prefill_callback prefill_callback; // Optional: prompt processing
+                                            // progress. Defaults to NULL.
+  int32_t n_prefault_threads; // Optional: when this request loads the model
+                              // (or draft model), this many threads fault
+                              // its tensor data into the page cache in
+                              // parallel with the load. Defaults to 0, which
+                              // leaves it to the load.
 };
 
 EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void pllama_inference(struct pllama_inference_request request,
@@ -59,6 +238,16 @@ EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void pllama_inference(struct pllama_infer
 EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void pllama_inference_sync(struct pllama_inference_request request,
                            pllama_inference_callback callback);
 EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void pllama_inference_cancel(int request_id);
+
+// Same as pllama_inference / pllama_inference_sync, but run against a model
+// opened with pllama_model_open, skipping the load. request.model_path is
+// ignored.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void pllama_model_inference(pllama_model_handle *handle,
+                                        struct pllama_inference_request request,
+                                        pllama_inference_callback callback);
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void pllama_model_inference_sync(pllama_model_handle *handle,
+                                        struct pllama_inference_request request,
+                                        pllama_inference_callback callback);
 #ifdef __cplusplus
 }
 #endif
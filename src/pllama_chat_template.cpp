@@ -12,9 +12,38 @@
 // Use consistent paths for includes
 #include "llama.h"
 #include "gguf.h"
+#include "pllama_log.h"
 
 extern "C" {
+const char *pllama_model_get_chat_template(pllama_model_handle *handle) {
+  if (handle == NULL || !pllama_model_wait(handle)) {
+    return "";
+  }
+
+  const char *targetKey = "tokenizer.chat_template";
+  int32_t len = llama_model_meta_val_str(handle->model, targetKey, NULL, 0);
+  if (len < 0) {
+    PLLAMA_LOG_INFO(nullptr, "%s: key '%s' not found.", __func__, targetKey);
+    len = 0;
+  }
+
+  // Same ownership as the file-based helper: a malloc'd copy.
+  char *safeCopy = (char *)malloc(len + 1); // +1 for null terminator
+  safeCopy[0] = '\0';
+  if (len > 0) {
+    llama_model_meta_val_str(handle->model, targetKey, safeCopy, len + 1);
+  }
+  return safeCopy;
+}
+
 const char *pllama_get_chat_template(const char *fname) {
+  // Prefer a resident copy of the model over re-parsing the file.
+  if (pllama_model_handle *resident = pllama_model_find(fname)) {
+    const char *result = pllama_model_get_chat_template(resident);
+    pllama_model_release(resident);
+    return result;
+  }
+
   struct ggml_context *meta = NULL;
 
   struct gguf_init_params params = {
@@ -24,7 +53,8 @@ const char *pllama_get_chat_template(const char *fname) {
 
   struct gguf_context *ctx = gguf_init_from_file(fname, params);
   if (!ctx) {
-    fprintf(stderr, "Unable to load model to get chat template: %s\n", fname);
+    PLLAMA_LOG_ERROR(nullptr, "Unable to load model to get chat template: %s",
+                     fname);
     return ""; // Return NULL to indicate failure to load or find the value.
   }
 
@@ -41,13 +71,14 @@ const char *pllama_get_chat_template(const char *fname) {
     } else {
       // Key was found, but it doesn't have an associated string value, or the
       // value is null.
-      printf("%s: key '%s' found, but it has no associated string value or "
-             "value is null.\n",
-             __func__, targetKey);
+      PLLAMA_LOG_WARN(nullptr,
+                      "%s: key '%s' found, but it has no associated string "
+                      "value or value is null.",
+                      __func__, targetKey);
       // result already initialized to "", so just leave it as it is.
     }
   } else {
-    printf("%s: key '%s' not found.\n", __func__, targetKey);
+    PLLAMA_LOG_INFO(nullptr, "%s: key '%s' not found.", __func__, targetKey);
     // result already initialized to "", so just leave it as it is.
   }
 
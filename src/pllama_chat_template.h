@@ -15,10 +15,14 @@
 #define FFI_PLUGIN_EXPORT
 #endif
 
+#include "pllama_model.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 FFI_PLUGIN_EXPORT const char *pllama_get_chat_template(const char *fname);
+// Same as above, read from the metadata of an open model.
+FFI_PLUGIN_EXPORT const char *pllama_model_get_chat_template(pllama_model_handle *handle);
 #ifdef __cplusplus
 }
 #endif
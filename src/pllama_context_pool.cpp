@@ -0,0 +1,185 @@
+#include "pllama_context_pool.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "pllama_log.h"
+#include "pllama_runtime.h"
+
+class ContextPool {
+public:
+  static ContextPool &getInstance() {
+    static ContextPool instance;
+    return instance;
+  }
+
+  pllama_pooled_context *acquire(llama_model *model,
+                                 const llama_context_params &params) {
+    // Held until release, so the runtime is not shut down under a context
+    // in use.
+    pllama_runtime_enter();
+    {
+      std::lock_guard<std::mutex> lock(pool_mutex);
+      for (auto *pooled : contexts) {
+        if (!pooled->in_use && pooled->model == model &&
+            pooled->n_ctx == params.n_ctx &&
+            pooled->n_batch == params.n_batch &&
+            pooled->n_ubatch == params.n_ubatch &&
+            pooled->n_threads == params.n_threads &&
+            pooled->n_seq_max == params.n_seq_max) {
+          pooled->in_use = true;
+          PLLAMA_LOG_DEBUG(nullptr, "Reusing pooled context.");
+          return pooled;
+        }
+      }
+    }
+
+    // Allocating the KV cache is the slow part; do it outside the lock.
+    llama_context *ctx = llama_init_from_model(model, params);
+    if (ctx == nullptr) {
+      pllama_runtime_leave();
+      return nullptr;
+    }
+    // Share one set of worker threads instead of spawning them per decode.
+    if (ggml_threadpool *tp = pllama_runtime_threadpool(params.n_threads)) {
+      llama_attach_threadpool(ctx, tp, tp);
+    }
+    auto *pooled = new pllama_pooled_context();
+    pooled->ctx = ctx;
+    pooled->model = model;
+    pooled->n_ctx = params.n_ctx;
+    pooled->n_batch = params.n_batch;
+    pooled->n_ubatch = params.n_ubatch;
+    pooled->n_threads = params.n_threads;
+    pooled->n_seq_max = params.n_seq_max;
+    pooled->in_use = true;
+
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    contexts.push_back(pooled);
+    return pooled;
+  }
+
+  void release(pllama_pooled_context *pooled) {
+    std::vector<pllama_pooled_context *> evicted;
+    {
+      std::lock_guard<std::mutex> lock(pool_mutex);
+      pooled->in_use = false;
+      pooled->last_used_ms = ggml_time_ms();
+      evictOverflowLocked(evicted);
+    }
+    freeAll(evicted);
+    pllama_runtime_leave();
+  }
+
+  void purge(const llama_model *model) {
+    std::vector<pllama_pooled_context *> evicted;
+    {
+      std::lock_guard<std::mutex> lock(pool_mutex);
+      takeIdleLocked(model, evicted);
+    }
+    freeAll(evicted);
+  }
+
+  size_t evictIdle() {
+    std::vector<pllama_pooled_context *> evicted;
+    {
+      std::lock_guard<std::mutex> lock(pool_mutex);
+      takeIdleLocked(nullptr, evicted);
+    }
+    freeAll(evicted);
+    return evicted.size();
+  }
+
+private:
+  // Each idle context pins a full KV cache, so only a few are kept.
+  static constexpr size_t MAX_IDLE_CONTEXTS = 2;
+
+  std::vector<pllama_pooled_context *> contexts;
+  std::mutex pool_mutex;
+
+  void evictOverflowLocked(std::vector<pllama_pooled_context *> &evicted) {
+    while (true) {
+      size_t idle = 0;
+      pllama_pooled_context *oldest = nullptr;
+      for (auto *pooled : contexts) {
+        if (pooled->in_use) {
+          continue;
+        }
+        idle++;
+        if (oldest == nullptr || pooled->last_used_ms < oldest->last_used_ms) {
+          oldest = pooled;
+        }
+      }
+      if (idle <= MAX_IDLE_CONTEXTS) {
+        return;
+      }
+      contexts.erase(std::remove(contexts.begin(), contexts.end(), oldest),
+                     contexts.end());
+      evicted.push_back(oldest);
+    }
+  }
+
+  // Moves idle contexts (for model, or all models when null) to evicted.
+  void takeIdleLocked(const llama_model *model,
+                      std::vector<pllama_pooled_context *> &evicted) {
+    auto it = contexts.begin();
+    while (it != contexts.end()) {
+      pllama_pooled_context *pooled = *it;
+      if (!pooled->in_use && (model == nullptr || pooled->model == model)) {
+        evicted.push_back(pooled);
+        it = contexts.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  static void freeAll(const std::vector<pllama_pooled_context *> &evicted) {
+    for (auto *pooled : evicted) {
+      llama_free(pooled->ctx);
+      delete pooled;
+    }
+  }
+};
+
+pllama_pooled_context *pllama_context_acquire(llama_model *model,
+                                              const llama_context_params &params) {
+  return ContextPool::getInstance().acquire(model, params);
+}
+
+void pllama_context_release(pllama_pooled_context *pooled) {
+  if (pooled == nullptr) {
+    return;
+  }
+  ContextPool::getInstance().release(pooled);
+}
+
+int pllama_context_reuse_prefix(pllama_pooled_context *pooled,
+                                const std::vector<llama_token> &prompt) {
+  size_t n_keep = 0;
+  if (!prompt.empty()) {
+    const size_t n_max = std::min(pooled->tokens.size(), prompt.size() - 1);
+    while (n_keep < n_max && pooled->tokens[n_keep] == prompt[n_keep]) {
+      n_keep++;
+    }
+  }
+
+  if (n_keep == 0) {
+    llama_kv_cache_clear(pooled->ctx);
+  } else if (!llama_kv_cache_seq_rm(pooled->ctx, 0, (llama_pos)n_keep, -1)) {
+    // Partial removal is not supported by every cache type.
+    llama_kv_cache_clear(pooled->ctx);
+    n_keep = 0;
+  }
+  pooled->tokens.resize(n_keep);
+  return (int)n_keep;
+}
+
+void pllama_context_purge(const llama_model *model) {
+  ContextPool::getInstance().purge(model);
+}
+
+size_t pllama_context_evict_idle() {
+  return ContextPool::getInstance().evictIdle();
+}
@@ -0,0 +1,53 @@
+#ifndef FLLAMA_CONTEXT_POOL_H
+#define FLLAMA_CONTEXT_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "llama.h"
+
+// A llama_context kept warm between requests. Contexts are keyed by
+// (model, n_ctx, n_batch, n_ubatch, n_threads, n_seq_max); handing one out
+// again skips the KV cache and compute buffer allocation that
+// llama_init_from_model pays every time.
+struct pllama_pooled_context {
+  llama_context *ctx = nullptr;
+  const llama_model *model = nullptr;
+  uint32_t n_ctx = 0;
+  uint32_t n_batch = 0;
+  uint32_t n_ubatch = 0;
+  int32_t n_threads = 0;
+  uint32_t n_seq_max = 1;
+  bool in_use = false;
+  int64_t last_used_ms = 0;
+  // Tokens currently held in the KV cache for sequence 0, in position order.
+  // Empty when the cache contents are unknown (ex. after image embeddings),
+  // in which case the cache is cleared before reuse.
+  std::vector<llama_token> tokens;
+};
+
+// Returns a context for exclusive use, reusing an idle one with the same key
+// when available. Returns nullptr if a new context could not be created.
+pllama_pooled_context *pllama_context_acquire(llama_model *model,
+                                              const llama_context_params &params);
+
+// Hands a context back to the pool.
+void pllama_context_release(pllama_pooled_context *pooled);
+
+// Prepares the KV cache for a prompt: keeps the longest prefix shared with
+// the previous request on this context and trims everything after it.
+// Returns the number of prompt tokens already in the cache; at least one
+// token is always left to decode so fresh logits are produced. An empty
+// prompt clears the cache.
+int pllama_context_reuse_prefix(pllama_pooled_context *pooled,
+                                const std::vector<llama_token> &prompt);
+
+// Frees every idle context created for model. Called before a model is freed.
+void pllama_context_purge(const llama_model *model);
+
+// Frees all idle contexts. Returns how many were freed.
+size_t pllama_context_evict_idle();
+
+#endif // FLLAMA_CONTEXT_POOL_H
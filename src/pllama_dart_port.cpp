@@ -0,0 +1,227 @@
+#include "pllama_dart_port.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#include "pllama_log.h"
+
+// The subset of dart_api_dl.h / dart_native_api.h used here, declared locally
+// so the plugin builds without the Dart SDK headers. Layouts follow the Dart
+// API DL version 2 ABI.
+namespace dart_dl {
+
+typedef int64_t Dart_Port;
+
+enum Dart_CObject_Type {
+  Dart_CObject_kNull = 0,
+  Dart_CObject_kBool,
+  Dart_CObject_kInt32,
+  Dart_CObject_kInt64,
+  Dart_CObject_kDouble,
+  Dart_CObject_kString,
+  Dart_CObject_kArray,
+  Dart_CObject_kTypedData,
+  Dart_CObject_kExternalTypedData,
+  Dart_CObject_kSendPort,
+  Dart_CObject_kCapability,
+  Dart_CObject_kNativePointer,
+  Dart_CObject_kUnsupported,
+  Dart_CObject_kUnmodifiableExternalTypedData,
+  Dart_CObject_kNumberOfTypes
+};
+
+enum Dart_TypedData_Type {
+  Dart_TypedData_kByteData = 0,
+  Dart_TypedData_kInt8,
+  Dart_TypedData_kUint8,
+};
+
+typedef void (*Dart_HandleFinalizer)(void *isolate_callback_data, void *peer);
+
+struct Dart_CObject {
+  Dart_CObject_Type type;
+  union {
+    bool as_bool;
+    int32_t as_int32;
+    int64_t as_int64;
+    double as_double;
+    const char *as_string;
+    struct {
+      Dart_Port id;
+      Dart_Port origin_id;
+    } as_send_port;
+    struct {
+      int64_t id;
+    } as_capability;
+    struct {
+      intptr_t length;
+      Dart_CObject **values;
+    } as_array;
+    struct {
+      Dart_TypedData_Type type;
+      intptr_t length;
+      const uint8_t *values;
+    } as_typed_data;
+    struct {
+      Dart_TypedData_Type type;
+      intptr_t length;
+      uint8_t *data;
+      void *peer;
+      Dart_HandleFinalizer callback;
+    } as_external_typed_data;
+    struct {
+      intptr_t ptr;
+      intptr_t size;
+      Dart_HandleFinalizer callback;
+    } as_native_pointer;
+  } value;
+};
+
+struct DartApiEntry {
+  const char *name;
+  void (*function)(void);
+};
+
+struct DartApi {
+  const int major;
+  const int minor;
+  const DartApiEntry *const functions;
+};
+
+static const int API_DL_MAJOR_VERSION = 2;
+
+typedef bool (*Dart_PostCObject_Type)(Dart_Port port_id, Dart_CObject *message);
+
+} // namespace dart_dl
+
+using namespace dart_dl;
+
+static std::atomic<Dart_PostCObject_Type> post_cobject{nullptr};
+
+static void free_external_bytes(void *isolate_callback_data, void *peer) {
+  (void)isolate_callback_data;
+  free(peer);
+}
+
+static bool post(int64_t port, Dart_CObject *message) {
+  Dart_PostCObject_Type fn = post_cobject.load(std::memory_order_acquire);
+  if (fn == nullptr) {
+    PLLAMA_LOG_ERROR(nullptr,
+                     "dart_port set but pllama_dart_init was not called.");
+    return false;
+  }
+  return fn(port, message);
+}
+
+static Dart_CObject int_object(int64_t value) {
+  Dart_CObject object;
+  object.type = Dart_CObject_kInt64;
+  object.value.as_int64 = value;
+  return object;
+}
+
+bool pllama_dart_post_piece(int64_t port, int request_id, const char *piece,
+                            uint32_t len, uint64_t byte_offset,
+                            int32_t token_index) {
+  // Dart takes ownership of the copy and frees it with the Uint8List.
+  uint8_t *data = static_cast<uint8_t *>(malloc(len > 0 ? len : 1));
+  if (data == nullptr) {
+    return false;
+  }
+  if (len > 0) {
+    std::memcpy(data, piece, len);
+  }
+
+  Dart_CObject id = int_object(request_id);
+  Dart_CObject kind = int_object(PLLAMA_PORT_PIECE);
+  Dart_CObject bytes;
+  bytes.type = Dart_CObject_kExternalTypedData;
+  bytes.value.as_external_typed_data.type = Dart_TypedData_kUint8;
+  bytes.value.as_external_typed_data.length = len;
+  bytes.value.as_external_typed_data.data = data;
+  bytes.value.as_external_typed_data.peer = data;
+  bytes.value.as_external_typed_data.callback = free_external_bytes;
+  Dart_CObject offset = int_object((int64_t)byte_offset);
+  Dart_CObject index = int_object(token_index);
+
+  Dart_CObject *values[] = {&id, &kind, &bytes, &offset, &index};
+  Dart_CObject message;
+  message.type = Dart_CObject_kArray;
+  message.value.as_array.length = 5;
+  message.value.as_array.values = values;
+  if (!post(port, &message)) {
+    free(data); // Ownership only moves on success.
+    return false;
+  }
+  return true;
+}
+
+bool pllama_dart_post_done(int64_t port, int request_id, uint64_t total_bytes,
+                           int32_t n_tokens, int32_t finish_reason) {
+  Dart_CObject id = int_object(request_id);
+  Dart_CObject kind = int_object(PLLAMA_PORT_DONE);
+  Dart_CObject total = int_object((int64_t)total_bytes);
+  Dart_CObject count = int_object(n_tokens);
+  Dart_CObject reason = int_object(finish_reason);
+  Dart_CObject *values[] = {&id, &kind, &total, &count, &reason};
+  Dart_CObject message;
+  message.type = Dart_CObject_kArray;
+  message.value.as_array.length = 5;
+  message.value.as_array.values = values;
+  return post(port, &message);
+}
+
+bool pllama_dart_post_ended(int64_t port, int request_id,
+                            const char *message_text) {
+  Dart_CObject id = int_object(request_id);
+  Dart_CObject kind = int_object(PLLAMA_PORT_ENDED);
+  Dart_CObject text;
+  text.type = Dart_CObject_kString;
+  text.value.as_string = message_text != nullptr ? message_text : "";
+  Dart_CObject *values[] = {&id, &kind, &text};
+  Dart_CObject message;
+  message.type = Dart_CObject_kArray;
+  message.value.as_array.length = 3;
+  message.value.as_array.values = values;
+  return post(port, &message);
+}
+
+static thread_local int64_t routed_port = 0;
+static thread_local int routed_request_id = 0;
+
+DartPortRoute::DartPortRoute(int64_t port, int request_id)
+    : previous_port(routed_port), previous_request_id(routed_request_id) {
+  routed_port = port;
+  routed_request_id = request_id;
+}
+
+DartPortRoute::~DartPortRoute() {
+  routed_port = previous_port;
+  routed_request_id = previous_request_id;
+}
+
+void pllama_dart_port_callback(const char *response, uint8_t done) {
+  if (done && routed_port != 0) {
+    pllama_dart_post_ended(routed_port, routed_request_id, response);
+  }
+}
+
+extern "C" {
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT int pllama_dart_init(void *api_dl_data) {
+  const DartApi *api = static_cast<const DartApi *>(api_dl_data);
+  if (api == nullptr || api->major != API_DL_MAJOR_VERSION) {
+    return -1;
+  }
+  for (const DartApiEntry *entry = api->functions; entry->name != nullptr;
+       entry++) {
+    if (strcmp(entry->name, "Dart_PostCObject") == 0) {
+      post_cobject.store(
+          reinterpret_cast<Dart_PostCObject_Type>(entry->function),
+          std::memory_order_release);
+      return 0;
+    }
+  }
+  return -1;
+}
+} // extern "C"
@@ -0,0 +1,70 @@
+#ifndef FLLAMA_DART_PORT_H
+#define FLLAMA_DART_PORT_H
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+#if _WIN32
+#define FFI_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define FFI_PLUGIN_EXPORT
+#endif
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Delivery to a Dart SendPort (pllama_inference_request.dart_port) instead of
+// function pointer callbacks. Posting never blocks on the receiving isolate,
+// and piece bytes arrive as external typed data, so they are not copied into
+// the Dart heap.
+//
+// Messages are Lists whose first two elements are the request id and a kind:
+//   [id, PLLAMA_PORT_PIECE, Uint8List piece, int byte_offset, int token_index]
+//   [id, PLLAMA_PORT_DONE, int total_bytes, int n_tokens, int finish_reason]
+//   [id, PLLAMA_PORT_ENDED, String message]  error, or "" when cancelled
+enum pllama_port_message {
+  PLLAMA_PORT_PIECE = 0,
+  PLLAMA_PORT_DONE = 1,
+  PLLAMA_PORT_ENDED = 2,
+};
+
+// Must be called once with NativeApi.initializeApiDLData before requests use
+// dart_port. Returns 0 on success, -1 if the Dart API version is unsupported.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT int pllama_dart_init(void *api_dl_data);
+
+#ifdef __cplusplus
+}
+
+bool pllama_dart_post_piece(int64_t port, int request_id, const char *piece,
+                            uint32_t len, uint64_t byte_offset,
+                            int32_t token_index);
+bool pllama_dart_post_done(int64_t port, int request_id, uint64_t total_bytes,
+                           int32_t n_tokens, int32_t finish_reason);
+bool pllama_dart_post_ended(int64_t port, int request_id,
+                            const char *message);
+
+// While alive, pllama_dart_port_callback on this thread posts to port as an
+// ended message. Lets a request swap its inference callback for the port
+// without touching every error path.
+class DartPortRoute {
+public:
+  DartPortRoute(int64_t port, int request_id);
+  ~DartPortRoute();
+
+private:
+  int64_t previous_port;
+  int previous_request_id;
+};
+
+// pllama_inference_callback that posts done calls to the routed port. The
+// not-done calls carry no text in port mode and are dropped.
+void pllama_dart_port_callback(const char *response, uint8_t done);
+#endif
+
+#endif // FLLAMA_DART_PORT_H
@@ -0,0 +1,44 @@
+#include "pllama_decoder.h"
+
+#include <algorithm>
+
+#include "pllama_sampling.h"
+
+bool SingleTokenDecoder::step(llama_context *ctx, llama_sampler *smpl,
+                              const std::vector<llama_token> &history,
+                              llama_token last, int n_max, int n_free,
+                              std::vector<llama_token> &sampled) {
+  (void)history;
+  (void)n_max;
+  (void)n_free;
+  sampled.clear();
+  if (llama_decode(ctx, llama_batch_get_one(&last, 1)) != 0) {
+    return false;
+  }
+  sampled.push_back(pllama_sampler_sample(smpl, ctx, -1));
+  return true;
+}
+
+SpeculativeDecoder::SpeculativeDecoder(std::unique_ptr<DraftProposer> proposer,
+                                       int n_draft)
+    : proposer(std::move(proposer)), verifier(n_draft), n_draft(n_draft) {}
+
+bool SpeculativeDecoder::step(llama_context *ctx, llama_sampler *smpl,
+                              const std::vector<llama_token> &history,
+                              llama_token last, int n_max, int n_free,
+                              std::vector<llama_token> &sampled) {
+  // Drafts past the token budget or the context would be wasted, and the
+  // verify batch (last plus the draft) has to fit in one decode.
+  int n = std::min(n_draft, std::min(n_max - 1, n_free - 1));
+  n = std::min(n, (int)llama_n_batch(ctx) - 1);
+  if (n <= 0 || !proposer->propose(history, last, n, draft)) {
+    draft.clear();
+  }
+  if (!verifier.verify(ctx, smpl, last, (llama_pos)history.size(), draft,
+                       sampled)) {
+    return false;
+  }
+  n_proposed += (int)draft.size();
+  n_accepted += (int)sampled.size() - 1;
+  return true;
+}
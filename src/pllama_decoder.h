@@ -0,0 +1,64 @@
+#ifndef FLLAMA_DECODER_H
+#define FLLAMA_DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "llama.h"
+#include "pllama_speculative.h"
+
+// How the generation loop advances: decodes the last sampled token and
+// samples what follows, possibly several tokens per decode. Every strategy
+// samples with the request's sampler at each position it outputs, so they
+// all produce the same text and differ only in speed.
+class DecoderStrategy {
+public:
+  virtual ~DecoderStrategy() = default;
+
+  // last was sampled and is not decoded yet; history is what sequence 0 of
+  // the KV cache holds before it. At most n_max tokens may be sampled and
+  // n_free cells of the KV cache are free. Replaces sampled with at least
+  // one token: all but the last are in the KV cache after last, the last one
+  // is not decoded yet. Returns false if decoding failed.
+  virtual bool step(llama_context *ctx, llama_sampler *smpl,
+                    const std::vector<llama_token> &history, llama_token last,
+                    int n_max, int n_free,
+                    std::vector<llama_token> &sampled) = 0;
+
+  // Tokens guessed and how many of them were right, for the logs.
+  int proposed() const { return n_proposed; }
+  int accepted() const { return n_accepted; }
+
+protected:
+  int n_proposed = 0;
+  int n_accepted = 0;
+};
+
+// One token per decode; does not need history.
+class SingleTokenDecoder : public DecoderStrategy {
+public:
+  bool step(llama_context *ctx, llama_sampler *smpl,
+            const std::vector<llama_token> &history, llama_token last,
+            int n_max, int n_free, std::vector<llama_token> &sampled) override;
+};
+
+// Speculative decoding: verifies the proposer's draft in one batch.
+class SpeculativeDecoder : public DecoderStrategy {
+public:
+  SpeculativeDecoder(std::unique_ptr<DraftProposer> proposer, int n_draft);
+
+  bool step(llama_context *ctx, llama_sampler *smpl,
+            const std::vector<llama_token> &history, llama_token last,
+            int n_max, int n_free, std::vector<llama_token> &sampled) override;
+
+private:
+  std::unique_ptr<DraftProposer> proposer;
+  SpeculativeVerifier verifier;
+  int n_draft;
+  std::vector<llama_token> draft;
+};
+
+#endif // FLLAMA_DECODER_H
@@ -0,0 +1,93 @@
+#include "pllama_detokenize.h"
+
+#include <cstring>
+#include "ggml.h"
+#include "pllama_log.h"
+
+std::shared_ptr<const pllama_piece_table>
+pllama_piece_table_build(const llama_model *model) {
+  const int64_t start = ggml_time_ms();
+  const llama_vocab *vocab = llama_model_get_vocab(model);
+  if (vocab == nullptr) {
+    return nullptr;
+  }
+  const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+  auto table = std::make_shared<pllama_piece_table>();
+  table->offsets.reserve((size_t)n_vocab + 1);
+  table->bytes.reserve((size_t)n_vocab * 8);
+  table->offsets.push_back(0);
+
+  char buf[256];
+  std::string long_piece;
+  for (llama_token token = 0; token < n_vocab; token++) {
+    int32_t len =
+        llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
+    if (len >= 0) {
+      table->bytes.append(buf, len);
+    } else {
+      // Negative is the size needed; rare enough to allocate for.
+      long_piece.resize(-len);
+      len = llama_token_to_piece(vocab, token, &long_piece[0],
+                                 (int32_t)long_piece.size(), 0, true);
+      if (len > 0) {
+        table->bytes.append(long_piece.data(), len);
+      }
+    }
+    table->offsets.push_back((uint32_t)table->bytes.size());
+  }
+  table->bytes.shrink_to_fit();
+
+  PLLAMA_LOG_DEBUG(nullptr, "Piece table: %d tokens, %zu bytes in %lld ms.",
+                   n_vocab, table->bytes.size(),
+                   (long long)(ggml_time_ms() - start));
+  return table;
+}
+
+// Length of a trailing UTF-8 sequence that is still missing bytes, or 0.
+// Stray continuation bytes are left alone: they can never complete.
+static size_t incomplete_utf8_tail(const char *text, size_t len) {
+  for (size_t i = 1; i <= 3 && i <= len; i++) {
+    const unsigned char c = (unsigned char)text[len - i];
+    if ((c & 0xC0) == 0x80) {
+      continue;
+    }
+    size_t expected = 1;
+    if (c >= 0xF0) {
+      expected = 4;
+    } else if (c >= 0xE0) {
+      expected = 3;
+    } else if (c >= 0xC0) {
+      expected = 2;
+    }
+    return expected > i ? i : 0;
+  }
+  return 0;
+}
+
+size_t IncrementalDetokenizer::push(llama_token token, std::string &out) {
+  const size_t before = out.size();
+  if (n_held > 0) {
+    out.append(held, n_held);
+    n_held = 0;
+  }
+  size_t len = 0;
+  const char *piece = table.piece(token, &len);
+  out.append(piece, len);
+
+  const size_t tail =
+      incomplete_utf8_tail(out.data() + before, out.size() - before);
+  if (tail > 0) {
+    std::memcpy(held, out.data() + out.size() - tail, tail);
+    n_held = tail;
+    out.resize(out.size() - tail);
+  }
+  return out.size() - before;
+}
+
+size_t IncrementalDetokenizer::flush(std::string &out) {
+  const size_t flushed = n_held;
+  out.append(held, n_held);
+  n_held = 0;
+  return flushed;
+}
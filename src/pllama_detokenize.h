@@ -0,0 +1,61 @@
+#ifndef FLLAMA_DETOKENIZE_H
+#define FLLAMA_DETOKENIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// Text of every token in a model's vocab, rendered once when the model is
+// loaded: token i is bytes[offsets[i] .. offsets[i + 1]). Turns per-token
+// detokenization into an array lookup and has no length limit. Special tokens
+// are rendered, matching llama_token_to_piece(..., special = true).
+struct pllama_piece_table {
+  std::vector<uint32_t> offsets;
+  std::string bytes;
+
+  int32_t n_tokens() const { return (int32_t)offsets.size() - 1; }
+
+  // Sets *len and returns the token's bytes; empty for unknown tokens.
+  const char *piece(llama_token token, size_t *len) const {
+    if (token < 0 || token >= n_tokens()) {
+      *len = 0;
+      return bytes.data();
+    }
+    *len = offsets[token + 1] - offsets[token];
+    return bytes.data() + offsets[token];
+  }
+};
+
+// Renders the vocab of model. Returns nullptr if the vocab cannot be read.
+std::shared_ptr<const pllama_piece_table>
+pllama_piece_table_build(const llama_model *model);
+
+// Turns a stream of tokens into text without ever splitting a UTF-8
+// character: bytes of a character whose remaining bytes belong to later
+// tokens are held back until it is complete, so every chunk appended is
+// valid UTF-8 on its own (as long as the model emits valid sequences).
+class IncrementalDetokenizer {
+public:
+  explicit IncrementalDetokenizer(const pllama_piece_table &table)
+      : table(table) {}
+
+  // Appends the newly completed text for token to out and returns how many
+  // bytes were appended, possibly 0.
+  size_t push(llama_token token, std::string &out);
+
+  // Appends anything still held back, ex. a truncated final character, at
+  // the end of generation.
+  size_t flush(std::string &out);
+
+private:
+  const pllama_piece_table &table;
+  char held[4] = {0};
+  size_t n_held = 0;
+};
+
+#endif // FLLAMA_DETOKENIZE_H
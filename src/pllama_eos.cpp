@@ -32,11 +32,51 @@
 #include <cstring>
 
 #include "pllama_eos.h"
+#include "pllama_log.h"
 
 static int gguf_data_to_int(enum gguf_type type, const void *data, int i);
 
+// Copies the text of a vocab token to the heap. The caller must `delete[]` it.
+static const char *vocab_token_text(pllama_model_handle *handle,
+                                    llama_token token) {
+  const llama_vocab *vocab = llama_model_get_vocab(handle->model);
+  if (token < 0 || token >= llama_vocab_n_tokens(vocab)) {
+    return NULL;
+  }
+  const char *text = llama_vocab_get_text(vocab, token);
+  const size_t len = strlen(text);
+  char *heapWord = new char[len + 1]; // +1 for the null terminator
+  std::memcpy(heapWord, text, len + 1);
+  return heapWord;
+}
+
 extern "C" {
+EMSCRIPTEN_KEEPALIVE const char *
+pllama_model_get_eos_token(pllama_model_handle *handle) {
+  if (handle == NULL || !pllama_model_wait(handle)) {
+    return NULL;
+  }
+  return vocab_token_text(
+      handle, llama_vocab_eos(llama_model_get_vocab(handle->model)));
+}
+
+EMSCRIPTEN_KEEPALIVE const char *
+pllama_model_get_bos_token(pllama_model_handle *handle) {
+  if (handle == NULL || !pllama_model_wait(handle)) {
+    return NULL;
+  }
+  return vocab_token_text(
+      handle, llama_vocab_bos(llama_model_get_vocab(handle->model)));
+}
+
 EMSCRIPTEN_KEEPALIVE const char *pllama_get_eos_token(const char *fname) {
+  // Prefer a resident copy of the model over re-parsing the file.
+  if (pllama_model_handle *resident = pllama_model_find(fname)) {
+    const char *word = pllama_model_get_eos_token(resident);
+    pllama_model_release(resident);
+    return word;
+  }
+
   struct ggml_context *meta = NULL;
 
   struct gguf_init_params params = {
@@ -46,23 +86,23 @@ EMSCRIPTEN_KEEPALIVE const char *pllama_get_eos_token(const char *fname) {
 
   struct gguf_context *ctx = gguf_init_from_file(fname, params);
   if (!ctx) {
-    fprintf(stderr, "Unable to load model: %s\n", fname);
+    PLLAMA_LOG_ERROR(nullptr, "Unable to load model: %s", fname);
     return NULL; // Return NULL to indicate failure to load or find the value.
   }
 
   const char *tokens_key = "tokenizer.ggml.tokens";
   const int tokens_idx = gguf_find_key(ctx, tokens_key);
-  printf("%s: tokens_idx: %d\n", __func__, tokens_idx);
+  PLLAMA_LOG_DEBUG(nullptr, "%s: tokens_idx: %d", __func__, tokens_idx);
 
   if (tokens_idx < 0) {
-    printf("%s: key '%s' not found.\n", __func__, tokens_key);
+    PLLAMA_LOG_INFO(nullptr, "%s: key '%s' not found.", __func__, tokens_key);
     return ""; // Key not found.
   }
 
   const char *eos_id_key = "tokenizer.ggml.eos_token_id";
   const int eos_id_idx = gguf_find_key(ctx, eos_id_key);
   if (eos_id_idx < 0) {
-    printf("%s: key '%s' not found.\n", __func__, eos_id_key);
+    PLLAMA_LOG_INFO(nullptr, "%s: key '%s' not found.", __func__, eos_id_key);
     return ""; // Key not found.
   }
 
@@ -70,19 +110,21 @@ EMSCRIPTEN_KEEPALIVE const char *pllama_get_eos_token(const char *fname) {
   const int eos_id_index =
       gguf_data_to_int(gguf_get_kv_type(ctx, eos_id_idx), eos_id_val_data, 0);
   if (eos_id_index == INT_MIN) {
-    printf("%s: eos_id_val is INT_MIN, indicating an error.\n", __func__);
+    PLLAMA_LOG_ERROR(nullptr, "%s: eos_id_val is INT_MIN, indicating an error.",
+                     __func__);
     return ""; // Key not found.
   }
 
   const uint32_t n_vocab = gguf_get_arr_n(ctx, tokens_idx);
   if (n_vocab <= tokens_idx) {
-    printf("%s: tokens key found, but index %d is out of bounds for array of "
-           "size %d.\n",
-           __func__, eos_id_idx, n_vocab);
+    PLLAMA_LOG_WARN(nullptr,
+                    "%s: tokens key found, but index %d is out of bounds for "
+                    "array of size %d.",
+                    __func__, eos_id_idx, n_vocab);
   }
 
   std::string word = gguf_get_arr_str(ctx, tokens_idx, eos_id_index);
-  printf("%s: word: %s\n", __func__, word.c_str());
+  PLLAMA_LOG_DEBUG(nullptr, "%s: word: %s", __func__, word.c_str());
   char *heapWord = new char[word.length() + 1]; // +1 for the null terminator
 
   // Copy the contents of `word` to the allocated memory.
@@ -95,6 +137,12 @@ EMSCRIPTEN_KEEPALIVE const char *pllama_get_eos_token(const char *fname) {
 }
 
 EMSCRIPTEN_KEEPALIVE const char *pllama_get_bos_token(const char *fname) {
+  if (pllama_model_handle *resident = pllama_model_find(fname)) {
+    const char *word = pllama_model_get_bos_token(resident);
+    pllama_model_release(resident);
+    return word;
+  }
+
   struct ggml_context *meta = NULL;
 
   struct gguf_init_params params = {
@@ -104,23 +152,23 @@ EMSCRIPTEN_KEEPALIVE const char *pllama_get_bos_token(const char *fname) {
 
   struct gguf_context *ctx = gguf_init_from_file(fname, params);
   if (!ctx) {
-    fprintf(stderr, "Unable to load model: %s\n", fname);
+    PLLAMA_LOG_ERROR(nullptr, "Unable to load model: %s", fname);
     return NULL; // Return NULL to indicate failure to load or find the value.
   }
 
   const char *tokens_key = "tokenizer.ggml.tokens";
   const int tokens_idx = gguf_find_key(ctx, tokens_key);
-  printf("%s: tokens_idx: %d\n", __func__, tokens_idx);
+  PLLAMA_LOG_DEBUG(nullptr, "%s: tokens_idx: %d", __func__, tokens_idx);
 
   if (tokens_idx < 0) {
-    printf("%s: key '%s' not found.\n", __func__, tokens_key);
+    PLLAMA_LOG_INFO(nullptr, "%s: key '%s' not found.", __func__, tokens_key);
     return ""; // Key not found.
   }
 
   const char *bos_id_key = "tokenizer.ggml.bos_token_id";
   const int bos_id_idx = gguf_find_key(ctx, bos_id_key);
   if (bos_id_idx < 0) {
-    printf("%s: key '%s' not found.\n", __func__, bos_id_key);
+    PLLAMA_LOG_INFO(nullptr, "%s: key '%s' not found.", __func__, bos_id_key);
     return ""; // Key not found.
   }
 
@@ -128,19 +176,21 @@ EMSCRIPTEN_KEEPALIVE const char *pllama_get_bos_token(const char *fname) {
   const int bos_id_index =
       gguf_data_to_int(gguf_get_kv_type(ctx, bos_id_idx), bos_id_val_data, 0);
   if (bos_id_index == INT_MIN) {
-    printf("%s: bos_id_val is INT_MIN, indicating an error.\n", __func__);
+    PLLAMA_LOG_ERROR(nullptr, "%s: bos_id_val is INT_MIN, indicating an error.",
+                     __func__);
     return ""; // Key not found.
   }
 
   const uint32_t n_vocab = gguf_get_arr_n(ctx, tokens_idx);
   if (n_vocab <= tokens_idx) {
-    printf("%s: tokens key found, but index %d is out of bounds for array of "
-           "size %d.\n",
-           __func__, bos_id_idx, n_vocab);
+    PLLAMA_LOG_WARN(nullptr,
+                    "%s: tokens key found, but index %d is out of bounds for "
+                    "array of size %d.",
+                    __func__, bos_id_idx, n_vocab);
   }
 
   std::string word = gguf_get_arr_str(ctx, tokens_idx, bos_id_index);
-  printf("%s: word: %s\n", __func__, word.c_str());
+  PLLAMA_LOG_DEBUG(nullptr, "%s: word: %s", __func__, word.c_str());
   char *heapWord = new char[word.length() + 1]; // +1 for the null terminator
 
   // Copy the contents of `word` to the allocated memory.
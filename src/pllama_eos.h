@@ -13,12 +13,20 @@
 #define FFI_PLUGIN_EXPORT
 #endif
 
+#include "pllama_model.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT const char *pllama_get_bos_token(const char *fname);
 
 EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT const char *pllama_get_eos_token(const char *fname);
+
+// Same as above, read from the vocab of an open model instead of the file.
+// The caller must `delete[]` the returned string.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT const char *pllama_model_get_bos_token(pllama_model_handle *handle);
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT const char *pllama_model_get_eos_token(pllama_model_handle *handle);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,503 @@
+#include "pllama_grammar.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable : 4244 4267) // possible loss of data
+#endif
+#include "json-schema-to-grammar.h"
+#include "llama.cpp/src/llama-grammar.h"
+#include "pllama_detokenize.h"
+#include "pllama_log.h"
+
+// Grammars kept per model; the least recently used one goes beyond this.
+static const size_t GRAMMAR_CACHE_MAX = 8;
+// Bytes of masks kept per grammar. States reached after that are matched
+// against the grammar every time, as llama.cpp's grammar sampler does.
+static const size_t GRAMMAR_MASK_BUDGET = 8 * 1024 * 1024;
+
+// Tokens a grammar state allows: listed in order when few, else a bit per
+// vocab token.
+struct grammar_mask {
+  std::vector<llama_token> tokens;
+  std::vector<uint32_t> bits;
+
+  bool allows(llama_token token) const {
+    if (bits.empty()) {
+      return std::binary_search(tokens.begin(), tokens.end(), token);
+    }
+    return token >= 0 && (size_t)(token >> 5) < bits.size() &&
+           ((bits[token >> 5] >> (token & 31)) & 1) != 0;
+  }
+
+  size_t bytes() const {
+    return tokens.size() * sizeof(llama_token) + bits.size() * sizeof(uint32_t);
+  }
+};
+
+// A parsed grammar and the masks of the states reached so far.
+struct grammar_compiled {
+  llama_grammar *initial = nullptr; // Never advanced; requests copy it.
+  std::mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<const grammar_mask>> masks;
+  size_t mask_bytes = 0;
+
+  ~grammar_compiled() {
+    if (initial != nullptr) {
+      llama_grammar_free_impl(initial);
+    }
+  }
+};
+
+// Vocab tokens by their text as code points, so tokens sharing a prefix
+// are matched against the grammar together and a prefix no grammar stack
+// accepts rules out every token below it. Text ending in a partial UTF-8
+// character depends on the state's own partial character; those tokens are
+// left out and matched one by one.
+struct grammar_trie {
+  struct node {
+    uint32_t code_point;
+    uint32_t first_child;  // 0 if none; the root is never a child.
+    uint32_t next_sibling; // 0 if none.
+    llama_token first_token; // Tokens ending here, chained through
+                             // next_token; -1 if none.
+  };
+
+  std::vector<node> nodes; // nodes[0] is the root.
+  std::vector<llama_token> next_token;
+  size_t max_depth = 0;
+  std::vector<llama_token> partial; // Matched one by one.
+  std::vector<llama_token> eog;     // Allowed where generation may end.
+};
+
+static std::unique_ptr<grammar_trie>
+grammar_trie_build(const llama_vocab *vocab, const pllama_piece_table &pieces) {
+  std::unique_ptr<grammar_trie> trie(new grammar_trie);
+  trie->nodes.push_back({0, 0, 0, -1});
+  trie->next_token.assign((size_t)pieces.n_tokens(), -1);
+  std::unordered_map<uint64_t, uint32_t> children;
+  for (llama_token token = 0; token < pieces.n_tokens(); token++) {
+    if (llama_vocab_is_eog(vocab, token)) {
+      trie->eog.push_back(token);
+      continue;
+    }
+    size_t len = 0;
+    const char *text = pieces.piece(token, &len);
+    if (len == 0 || text[0] == '\0') {
+      continue; // Never allowed.
+    }
+    const auto decoded = decode_utf8(std::string(text, len), {0, 0});
+    if (decoded.second.n_remain != 0) {
+      trie->partial.push_back(token);
+      continue;
+    }
+    // decode_utf8 ends the code points with a 0.
+    const size_t n_code_points = decoded.first.size() - 1;
+    uint32_t at = 0;
+    for (size_t i = 0; i < n_code_points; i++) {
+      const uint64_t key = (uint64_t)at << 32 | decoded.first[i];
+      const auto found = children.find(key);
+      if (found != children.end()) {
+        at = found->second;
+        continue;
+      }
+      const uint32_t child = (uint32_t)trie->nodes.size();
+      trie->nodes.push_back(
+          {decoded.first[i], 0, trie->nodes[at].first_child, -1});
+      trie->nodes[at].first_child = child;
+      children.emplace(key, child);
+      at = child;
+    }
+    trie->next_token[token] = trie->nodes[at].first_token;
+    trie->nodes[at].first_token = token;
+    trie->max_depth = std::max(trie->max_depth, n_code_points);
+  }
+  return trie;
+}
+
+struct pllama_grammar_cache {
+  struct entry {
+    size_t hash;
+    bool schema; // text is a JSON schema rather than a grammar.
+    std::string text;
+    std::shared_ptr<grammar_compiled> compiled;
+  };
+
+  const llama_vocab *vocab = nullptr;
+  int32_t n_vocab = 0;
+  std::shared_ptr<const pllama_piece_table> pieces;
+  std::once_flag trie_once;
+  std::unique_ptr<grammar_trie> trie; // Built when a mask is first needed.
+  std::mutex mutex;
+  std::list<entry> grammars; // Most recently used first.
+};
+
+std::shared_ptr<pllama_grammar_cache>
+pllama_grammar_cache_create(const llama_model *model,
+                            std::shared_ptr<const pllama_piece_table> pieces) {
+  auto cache = std::make_shared<pllama_grammar_cache>();
+  cache->vocab = llama_model_get_vocab(model);
+  cache->n_vocab = llama_vocab_n_tokens(cache->vocab);
+  cache->pieces = std::move(pieces);
+  return cache;
+}
+
+static const grammar_trie *grammar_cache_trie(pllama_grammar_cache &cache) {
+  if (cache.pieces == nullptr) {
+    return nullptr;
+  }
+  std::call_once(cache.trie_once, [&cache] {
+    cache.trie = grammar_trie_build(cache.vocab, *cache.pieces);
+    PLLAMA_LOG_DEBUG(nullptr, "Built vocab trie, %zu nodes.",
+                     cache.trie->nodes.size());
+  });
+  return cache.trie.get();
+}
+
+// Parses and converts text outside the cache lock. Returns nullptr if it
+// does not parse.
+static llama_grammar *grammar_compile(const llama_vocab *vocab,
+                                      const std::string &text, bool schema) {
+  try {
+    if (!schema) {
+      return llama_grammar_init_impl(vocab, text.c_str(), "root");
+    }
+    const std::string grammar =
+        json_schema_to_grammar(nlohmann::ordered_json::parse(text));
+    return llama_grammar_init_impl(vocab, grammar.c_str(), "root");
+  } catch (const std::exception &e) {
+    PLLAMA_LOG_ERROR(nullptr, "Failed to parse %s: %s",
+                     schema ? "JSON schema" : "grammar", e.what());
+  }
+  return nullptr;
+}
+
+static std::shared_ptr<grammar_compiled>
+grammar_cache_get(pllama_grammar_cache &cache, const char *str, bool schema) {
+  const std::string text(str);
+  const size_t hash = std::hash<std::string>()(text);
+  auto find = [&]() -> std::shared_ptr<grammar_compiled> {
+    for (auto it = cache.grammars.begin(); it != cache.grammars.end(); ++it) {
+      if (it->hash == hash && it->schema == schema && it->text == text) {
+        cache.grammars.splice(cache.grammars.begin(), cache.grammars, it);
+        return it->compiled;
+      }
+    }
+    return nullptr;
+  };
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (auto compiled = find()) {
+      return compiled;
+    }
+  }
+
+  llama_grammar *grammar = grammar_compile(cache.vocab, text, schema);
+  if (grammar == nullptr) {
+    return nullptr;
+  }
+  auto compiled = std::make_shared<grammar_compiled>();
+  compiled->initial = grammar;
+
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  if (auto raced = find()) {
+    return raced;
+  }
+  cache.grammars.push_front({hash, schema, text, compiled});
+  if (cache.grammars.size() > GRAMMAR_CACHE_MAX) {
+    cache.grammars.pop_back(); // Requests using it keep their reference.
+  }
+  PLLAMA_LOG_DEBUG(nullptr, "Compiled grammar, %zu cached.",
+                   cache.grammars.size());
+  return compiled;
+}
+
+// One request's position in a grammar.
+struct grammar_sampler {
+  std::shared_ptr<pllama_grammar_cache> cache;
+  std::shared_ptr<grammar_compiled> compiled;
+  llama_grammar *grammar = nullptr;
+  // Position of every rule element, to name states independently of where
+  // this copy of the rules lives.
+  std::unordered_map<const llama_grammar_element *, uint32_t> element_ids;
+  // Mask of the current state, until the next accept.
+  std::shared_ptr<const grammar_mask> mask;
+  std::string key;
+  std::vector<llama_token_data> candidates;
+  std::vector<llama_grammar_stacks> levels; // Stacks per trie depth.
+
+  void start(llama_grammar *copy) {
+    if (grammar != nullptr) {
+      llama_grammar_free_impl(grammar);
+    }
+    grammar = copy;
+    mask.reset();
+    element_ids.clear();
+    uint32_t id = 0;
+    for (const auto &rule : grammar->rules) {
+      for (const auto &element : rule) {
+        element_ids[&element] = id++;
+      }
+    }
+  }
+};
+
+// The state is the stacks of rule positions and any partial UTF-8
+// character; equal states allow the same tokens.
+static void grammar_state_key(grammar_sampler &s) {
+  std::string &key = s.key;
+  key.clear();
+  auto put = [&key](uint32_t value) {
+    key.append((const char *)&value, sizeof(value));
+  };
+  put(s.grammar->partial_utf8.value);
+  put((uint32_t)s.grammar->partial_utf8.n_remain);
+  for (const auto &stack : s.grammar->stacks) {
+    put((uint32_t)stack.size());
+    for (const llama_grammar_element *element : stack) {
+      const auto found = s.element_ids.find(element);
+      put(found != s.element_ids.end() ? found->second : UINT32_MAX);
+    }
+  }
+}
+
+// Appends the tokens below node that the stacks at levels[depth] accept.
+static void grammar_trie_walk(const grammar_trie &trie,
+                              const llama_grammar_rules &rules, uint32_t node,
+                              size_t depth,
+                              std::vector<llama_grammar_stacks> &levels,
+                              std::vector<llama_token> &allowed) {
+  for (uint32_t child = trie.nodes[node].first_child; child != 0;
+       child = trie.nodes[child].next_sibling) {
+    llama_grammar_accept(rules, levels[depth], trie.nodes[child].code_point,
+                         levels[depth + 1]);
+    if (levels[depth + 1].empty()) {
+      continue; // Nothing below can match either.
+    }
+    for (llama_token token = trie.nodes[child].first_token; token >= 0;
+         token = trie.next_token[token]) {
+      allowed.push_back(token);
+    }
+    grammar_trie_walk(trie, rules, child, depth + 1, levels, allowed);
+  }
+}
+
+// Matches tokens against the grammar with llama.cpp, appending the allowed
+// ones.
+static void grammar_match(grammar_sampler &s, const llama_token *tokens,
+                          size_t n_tokens, std::vector<llama_token> &allowed) {
+  s.candidates.resize(n_tokens);
+  for (size_t i = 0; i < n_tokens; i++) {
+    s.candidates[i] = {tokens[i], 0.0f, 0.0f};
+  }
+  llama_token_data_array cur = {s.candidates.data(), n_tokens, -1, false};
+  llama_grammar_apply_impl(*s.grammar, &cur);
+  for (size_t i = 0; i < n_tokens; i++) {
+    if (!std::isinf(s.candidates[i].logit)) {
+      allowed.push_back(s.candidates[i].id);
+    }
+  }
+}
+
+static std::shared_ptr<const grammar_mask>
+grammar_compute_mask(grammar_sampler &s) {
+  const int32_t n_vocab = s.cache->n_vocab;
+  const grammar_trie *trie = grammar_cache_trie(*s.cache);
+  auto mask = std::make_shared<grammar_mask>();
+  std::vector<llama_token> &allowed = mask->tokens;
+  if (trie == nullptr || s.grammar->partial_utf8.n_remain != 0) {
+    // Every token continues a partial character differently; match all.
+    std::vector<llama_token> vocab((size_t)n_vocab);
+    for (llama_token token = 0; token < n_vocab; token++) {
+      vocab[token] = token;
+    }
+    grammar_match(s, vocab.data(), vocab.size(), allowed);
+  } else {
+    s.levels.resize(trie->max_depth + 1);
+    s.levels[0] = s.grammar->stacks;
+    grammar_trie_walk(*trie, s.grammar->rules, 0, 0, s.levels, allowed);
+    grammar_match(s, trie->partial.data(), trie->partial.size(), allowed);
+    for (const auto &stack : s.grammar->stacks) {
+      if (stack.empty()) {
+        allowed.insert(allowed.end(), trie->eog.begin(), trie->eog.end());
+        break;
+      }
+    }
+    std::sort(allowed.begin(), allowed.end());
+  }
+
+  // A list takes less memory than the bits below 1 in 32 tokens.
+  if (allowed.size() * 32 >= (size_t)n_vocab) {
+    mask->bits.assign(((size_t)n_vocab + 31) / 32, 0);
+    for (llama_token token : allowed) {
+      mask->bits[token >> 5] |= 1u << (token & 31);
+    }
+    allowed.clear();
+    allowed.shrink_to_fit();
+  }
+  return mask;
+}
+
+static const grammar_mask &grammar_current_mask(grammar_sampler &s) {
+  if (s.mask) {
+    return *s.mask;
+  }
+  grammar_state_key(s);
+  grammar_compiled &compiled = *s.compiled;
+  {
+    std::lock_guard<std::mutex> lock(compiled.mutex);
+    const auto found = compiled.masks.find(s.key);
+    if (found != compiled.masks.end()) {
+      s.mask = found->second;
+      return *s.mask;
+    }
+  }
+  s.mask = grammar_compute_mask(s);
+  std::lock_guard<std::mutex> lock(compiled.mutex);
+  const size_t bytes = s.mask->bytes() + s.key.size();
+  if (compiled.mask_bytes + bytes <= GRAMMAR_MASK_BUDGET &&
+      compiled.masks.emplace(s.key, s.mask).second) {
+    compiled.mask_bytes += bytes;
+  }
+  return *s.mask;
+}
+
+static const char *grammar_name(const llama_sampler *smpl) {
+  (void)smpl;
+  return "pllama-grammar";
+}
+
+static void grammar_accept(llama_sampler *smpl, llama_token token) {
+  auto &s = *(grammar_sampler *)smpl->ctx;
+  llama_grammar_accept_impl(*s.grammar, token);
+  s.mask.reset();
+}
+
+static void grammar_apply(llama_sampler *smpl, llama_token_data_array *cur_p) {
+  auto &s = *(grammar_sampler *)smpl->ctx;
+  const grammar_mask &mask = grammar_current_mask(s);
+  // Candidates in vocab order, as llama_sampler_sample lays them out, are
+  // cut down to the allowed ones directly; moving each entry down never
+  // overwrites one still to be moved.
+  if (!mask.tokens.empty()) {
+    bool in_order = true;
+    for (llama_token token : mask.tokens) {
+      if ((size_t)token >= cur_p->size || cur_p->data[token].id != token) {
+        in_order = false;
+        break;
+      }
+    }
+    if (in_order) {
+      for (size_t i = 0; i < mask.tokens.size(); i++) {
+        cur_p->data[i] = cur_p->data[mask.tokens[i]];
+      }
+      cur_p->size = mask.tokens.size();
+      return;
+    }
+  }
+  for (size_t i = 0; i < cur_p->size; i++) {
+    if (!mask.allows(cur_p->data[i].id)) {
+      cur_p->data[i].logit = -INFINITY;
+    }
+  }
+}
+
+static void grammar_reset(llama_sampler *smpl) {
+  auto &s = *(grammar_sampler *)smpl->ctx;
+  s.start(llama_grammar_clone_impl(*s.compiled->initial));
+}
+
+static llama_sampler *grammar_clone(const llama_sampler *smpl);
+
+static void grammar_free(llama_sampler *smpl) {
+  auto *s = (grammar_sampler *)smpl->ctx;
+  if (s->grammar != nullptr) {
+    llama_grammar_free_impl(s->grammar);
+  }
+  delete s;
+}
+
+static const llama_sampler_i grammar_iface = {
+    /* .name   = */ grammar_name,
+    /* .accept = */ grammar_accept,
+    /* .apply  = */ grammar_apply,
+    /* .reset  = */ grammar_reset,
+    /* .clone  = */ grammar_clone,
+    /* .free   = */ grammar_free,
+};
+
+static llama_sampler *grammar_clone(const llama_sampler *smpl) {
+  const auto &from = *(const grammar_sampler *)smpl->ctx;
+  auto *s = new grammar_sampler;
+  s->cache = from.cache;
+  s->compiled = from.compiled;
+  s->start(llama_grammar_clone_impl(*from.grammar));
+  return new llama_sampler{&grammar_iface, s};
+}
+
+static llama_sampler *
+grammar_init(const std::shared_ptr<pllama_grammar_cache> &cache,
+             const char *str, bool schema) {
+  std::shared_ptr<grammar_compiled> compiled =
+      grammar_cache_get(*cache, str, schema);
+  if (compiled == nullptr) {
+    return nullptr;
+  }
+  auto *s = new grammar_sampler;
+  s->cache = cache;
+  s->compiled = compiled;
+  s->start(llama_grammar_clone_impl(*compiled->initial));
+  return new llama_sampler{&grammar_iface, s};
+}
+
+llama_sampler *
+pllama_sampler_init_grammar(const std::shared_ptr<pllama_grammar_cache> &cache,
+                            const char *grammar_str) {
+  return grammar_init(cache, grammar_str, false);
+}
+
+llama_sampler *pllama_sampler_init_json_schema(
+    const std::shared_ptr<pllama_grammar_cache> &cache,
+    const char *json_schema) {
+  return grammar_init(cache, json_schema, true);
+}
+
+bool pllama_sampler_is_grammar(const llama_sampler *smpl) {
+  return smpl->iface == &grammar_iface;
+}
+
+llama_token pllama_grammar_argmax(llama_sampler *smpl, const float *logits) {
+  auto &s = *(grammar_sampler *)smpl->ctx;
+  const grammar_mask &mask = grammar_current_mask(s);
+  llama_token best = -1;
+  if (mask.bits.empty()) {
+    for (llama_token token : mask.tokens) {
+      if (best < 0 || logits[token] > logits[best]) {
+        best = token;
+      }
+    }
+    return best;
+  }
+  for (size_t w = 0; w < mask.bits.size(); w++) {
+    if (mask.bits[w] == 0) {
+      continue;
+    }
+    for (uint32_t b = 0; b < 32; b++) {
+      const llama_token token = (llama_token)(w * 32 + b);
+      if (((mask.bits[w] >> b) & 1) != 0 &&
+          (best < 0 || logits[token] > logits[best])) {
+        best = token;
+      }
+    }
+  }
+  return best;
+}
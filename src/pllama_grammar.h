@@ -0,0 +1,52 @@
+#ifndef FLLAMA_GRAMMAR_H
+#define FLLAMA_GRAMMAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "llama.h"
+
+struct pllama_piece_table;
+
+// GBNF grammars compiled for one model's vocab, keyed by their text: a
+// grammar is parsed the first time a request uses it, and requests with the
+// same text start from a copy of the parsed rules. For every grammar state
+// reached, the tokens it allows are computed once and remembered, so
+// constrained sampling matches token texts against the grammar only in
+// states it has not seen before. Even then, tokens are matched through a
+// trie of the vocab's texts: tokens sharing a prefix are matched together,
+// and a prefix the grammar rejects rules out all of them at once. Token ids
+// and texts belong to the vocab, so the cache lives on the model handle.
+// Thread-safe.
+struct pllama_grammar_cache;
+
+// pieces is the model's piece table; without it, every token is matched.
+std::shared_ptr<pllama_grammar_cache>
+pllama_grammar_cache_create(const llama_model *model,
+                            std::shared_ptr<const pllama_piece_table> pieces);
+
+// Sampler constraining output to grammar_str, starting at its rule "root".
+// Like llama_sampler_init_grammar, except that it parses through cache and
+// leaves only the allowed tokens as candidates instead of setting every
+// other logit to -inf. Returns nullptr if the grammar does not parse.
+llama_sampler *
+pllama_sampler_init_grammar(const std::shared_ptr<pllama_grammar_cache> &cache,
+                            const char *grammar_str);
+
+// Sampler constraining output to JSON matching json_schema, converted to a
+// grammar with llama.cpp's json_schema_to_grammar. Cached like grammars,
+// keyed by the schema text. Returns nullptr if the schema is not valid JSON
+// or cannot be converted.
+llama_sampler *pllama_sampler_init_json_schema(
+    const std::shared_ptr<pllama_grammar_cache> &cache,
+    const char *json_schema);
+
+bool pllama_sampler_is_grammar(const llama_sampler *smpl);
+
+// Most likely token the grammar sampler smpl allows next, given the logits
+// of the whole vocab; -1 if it allows none.
+llama_token pllama_grammar_argmax(llama_sampler *smpl, const float *logits);
+
+#endif // FLLAMA_GRAMMAR_H
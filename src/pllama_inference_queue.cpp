@@ -1,7 +1,8 @@
 #include "pllama_inference_queue.h"
+#include "pllama_log.h"
 #include <atomic>
 #include <exception>
-#include <iostream>
+#include <memory>
 #include <unordered_map>
 
 // If pllama_inference_request and pllama_inference_callback types are defined
@@ -34,6 +35,23 @@ void InferenceQueue::enqueue(pllama_inference_request request,
   cond_var.notify_one();
 }
 
+void InferenceQueue::enqueue(pllama_model_handle *handle,
+                             pllama_inference_request request,
+                             pllama_inference_callback callback) {
+  pllama_model_retain(handle);
+  // Released when the last copy of the task goes away, including when a
+  // cancelled task is skipped without running.
+  std::shared_ptr<pllama_model_handle> reference(handle, pllama_model_release);
+  std::lock_guard<std::mutex> lock(queue_lock);
+  TaskWrapper taskWrapper(
+      [reference, request, callback]() {
+        pllama_model_inference_sync(reference.get(), request, callback);
+      },
+      request.request_id);
+  tasks.emplace(std::move(taskWrapper));
+  cond_var.notify_one();
+}
+
 void InferenceQueue::cancel(int request_id) {
   {
     std::lock_guard<std::mutex> lock(queue_lock);
@@ -73,7 +91,7 @@ void InferenceQueue::process_inference() {
     }              // Release the queue lock as soon as possible
 
     // Log the request_id to the console
-    std::cout << "Processing request: " << current_request_id << std::endl;
+    PLLAMA_LOG_DEBUG(nullptr, "Processing request: %d", current_request_id);
 
     { // Scope to check cancellation flag
       std::lock_guard<std::mutex> inferenceLock(inference_lock);
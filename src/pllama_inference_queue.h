@@ -47,6 +47,10 @@ public:
   // Enqueue a new inference request
   void enqueue(pllama_inference_request request,
                pllama_inference_callback callback);
+  // Enqueue a request against a resident model. Holds a reference to the
+  // handle until the task has run or been dropped.
+  void enqueue(pllama_model_handle *handle, pllama_inference_request request,
+               pllama_inference_callback callback);
   void cancel(int request_id);
   bool is_cancelled(int request_id);
 
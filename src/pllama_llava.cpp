@@ -1,5 +1,6 @@
 #include "pllama_llava.h"
 #include "clip.h"
+#include "pllama_log.h"
 
 // LLaMA.cpp cross-platform support
 #ifdef __APPLE__
@@ -48,15 +49,15 @@ bool add_image_embed_to_context(struct llama_context *ctx_llama,
         nullptr,
     };
     if (llama_decode(ctx_llama, batch)) {
-      fprintf(stderr, "%s : failed to eval\n", __func__);
+      PLLAMA_LOG_ERROR(nullptr, "%s : failed to eval", __func__);
       return false;
     }
     *n_past += n_eval;
-    fprintf(stderr, "%s: n_past: %d\n", __func__, *n_past);
+    PLLAMA_LOG_DEBUG(nullptr, "%s: n_past: %d", __func__, *n_past);
   }
-  fprintf(stderr, "finished adding %d image embeddings to context\n",
-          image_embed->n_image_pos);
-  fprintf(stderr, "finished state n_past: %d\n", *n_past);
+  PLLAMA_LOG_DEBUG(nullptr, "finished adding %d image embeddings to context",
+                   image_embed->n_image_pos);
+  PLLAMA_LOG_DEBUG(nullptr, "finished state n_past: %d", *n_past);
   return true;
 }
 
@@ -106,8 +107,8 @@ std::vector<llava_image_embed *> llava_image_embed_make_with_prompt_base64(
     auto embed = llava_image_embed_make_with_bytes(
         ctx_clip, n_threads, img_bytes.data(), img_bytes.size());
     if (!embed) {
-      fprintf(stderr, "%s: could not load image from base64 string.\n",
-              __func__);
+      PLLAMA_LOG_ERROR(nullptr, "%s: could not load image from base64 string.",
+                       __func__);
       continue;
     }
     embeddings.push_back(embed);
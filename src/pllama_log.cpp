@@ -0,0 +1,190 @@
+#include "pllama_log.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+std::atomic<int> pllama_log_runtime_level{PLLAMA_LOG_LEVEL_INFO};
+
+// Recent log lines, oldest first, in a fixed circular byte buffer. When a new
+// line does not fit, whole lines are dropped from the front.
+class LogBuffer {
+public:
+  static LogBuffer &getInstance() {
+    static LogBuffer instance;
+    return instance;
+  }
+
+  void append(const char *line, size_t len) {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    if (len + 1 > CAPACITY) {
+      // Keep the end of an oversized line.
+      line += len + 1 - CAPACITY;
+      len = CAPACITY - 1;
+    }
+    while (used + len + 1 > CAPACITY) {
+      dropFirstLineLocked();
+    }
+    for (size_t i = 0; i < len; i++) {
+      putLocked(line[i]);
+    }
+    putLocked('\n');
+  }
+
+  size_t drain(char *out, size_t max_bytes) {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    if (max_bytes == 0) {
+      return 0;
+    }
+    // Copy whole lines only, leaving room for the NUL.
+    size_t n = 0;
+    size_t line_len = 0;
+    for (size_t i = 0; i < used; i++) {
+      line_len++;
+      if (data[(head + i) % CAPACITY] == '\n') {
+        if (n + line_len + 1 > max_bytes) {
+          break;
+        }
+        n += line_len;
+        line_len = 0;
+      }
+    }
+    if (n == 0 && used > 0 && max_bytes >= 2) {
+      // The oldest line alone does not fit: hand out its start, cut short
+      // and newline terminated, and drop the rest, so the next call sees the
+      // line after it instead of getting stuck on this one.
+      const size_t kept = std::min(firstLineLenLocked() - 1, max_bytes - 2);
+      for (size_t i = 0; i < kept; i++) {
+        out[i] = data[(head + i) % CAPACITY];
+      }
+      out[kept] = '\n';
+      out[kept + 1] = '\0';
+      dropFirstLineLocked();
+      return kept + 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+      out[i] = data[(head + i) % CAPACITY];
+    }
+    out[n] = '\0';
+    head = (head + n) % CAPACITY;
+    used -= n;
+    return n;
+  }
+
+private:
+  static constexpr size_t CAPACITY = 64 * 1024;
+
+  std::mutex buffer_mutex;
+  char data[CAPACITY];
+  size_t head = 0;
+  size_t used = 0;
+
+  void putLocked(char c) {
+    data[(head + used) % CAPACITY] = c;
+    used++;
+  }
+
+  // Length of the oldest line including its newline; lines always end in
+  // one.
+  size_t firstLineLenLocked() const {
+    size_t len = 0;
+    while (len < used) {
+      if (data[(head + len) % CAPACITY] == '\n') {
+        return len + 1;
+      }
+      len++;
+    }
+    return len;
+  }
+
+  void dropFirstLineLocked() {
+    while (used > 0) {
+      const char c = data[head];
+      head = (head + 1) % CAPACITY;
+      used--;
+      if (c == '\n') {
+        return;
+      }
+    }
+  }
+};
+
+static const char *level_tag(int level) {
+  switch (level) {
+  case PLLAMA_LOG_LEVEL_DEBUG:
+    return "[DEBUG] ";
+  case PLLAMA_LOG_LEVEL_WARN:
+    return "[WARN] ";
+  case PLLAMA_LOG_LEVEL_ERROR:
+    return "[ERROR] ";
+  default:
+    return "";
+  }
+}
+
+void pllama_log_write(int level, pllama_log_callback logger, const char *format,
+                      ...) {
+  char stack_buf[512];
+  const char *tag = level_tag(level);
+  const size_t tag_len = strlen(tag);
+  std::memcpy(stack_buf, "[pllama] ", 9);
+  std::memcpy(stack_buf + 9, tag, tag_len);
+  const size_t prefix_len = 9 + tag_len;
+
+  va_list args;
+  va_start(args, format);
+  va_list args_copy;
+  va_copy(args_copy, args);
+  const int needed = vsnprintf(stack_buf + prefix_len,
+                               sizeof(stack_buf) - prefix_len, format, args);
+  va_end(args);
+  if (needed < 0) {
+    va_end(args_copy);
+    return;
+  }
+
+  const char *line = stack_buf;
+  std::string heap_buf;
+  if ((size_t)needed >= sizeof(stack_buf) - prefix_len) {
+    heap_buf.resize(prefix_len + needed + 1);
+    std::memcpy(&heap_buf[0], stack_buf, prefix_len);
+    vsnprintf(&heap_buf[prefix_len], needed + 1, format, args_copy);
+    heap_buf.resize(prefix_len + needed);
+    line = heap_buf.c_str();
+  }
+  va_end(args_copy);
+
+  const size_t len = prefix_len + needed;
+  LogBuffer::getInstance().append(line, len);
+  if (logger != nullptr) {
+    logger(line);
+  } else {
+    fprintf(stderr, "%s\n", line);
+  }
+}
+
+extern "C" {
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void pllama_log_set_level(int level) {
+  if (level < PLLAMA_LOG_LEVEL_DEBUG) {
+    level = PLLAMA_LOG_LEVEL_DEBUG;
+  } else if (level > PLLAMA_LOG_LEVEL_NONE) {
+    level = PLLAMA_LOG_LEVEL_NONE;
+  }
+  pllama_log_runtime_level.store(level, std::memory_order_relaxed);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT int pllama_log_get_level(void) {
+  return pllama_log_runtime_level.load(std::memory_order_relaxed);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT size_t pllama_log_drain(char *out,
+                                                              size_t max_bytes) {
+  if (out == NULL) {
+    return 0;
+  }
+  return LogBuffer::getInstance().drain(out, max_bytes);
+}
+} // extern "C"
@@ -0,0 +1,97 @@
+#ifndef FLLAMA_LOG_H
+#define FLLAMA_LOG_H
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+#if _WIN32
+#define FFI_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define FFI_PLUGIN_EXPORT
+#endif
+
+#include <stddef.h>
+
+#include "pllama.h" // For pllama_log_callback
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum pllama_log_level {
+  PLLAMA_LOG_LEVEL_DEBUG = 0,
+  PLLAMA_LOG_LEVEL_INFO = 1,
+  PLLAMA_LOG_LEVEL_WARN = 2,
+  PLLAMA_LOG_LEVEL_ERROR = 3,
+  PLLAMA_LOG_LEVEL_NONE = 4,
+};
+
+// Messages below level are dropped before they are formatted. Applies to
+// llama.cpp's own logs too. Defaults to PLLAMA_LOG_LEVEL_INFO.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void pllama_log_set_level(int level);
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT int pllama_log_get_level(void);
+
+// Every emitted message is also kept in a fixed-size in-memory buffer (the
+// oldest lines are overwritten), so hosts without a logger can fetch recent
+// logs, ex. for a bug report. Moves up to max_bytes of whole, newline
+// terminated lines into out, oldest first, NUL terminates it and returns the
+// number of bytes written excluding the NUL. When the oldest line alone does
+// not fit, its start is moved instead, newline terminated, and the rest of it
+// is dropped.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT size_t pllama_log_drain(char *out,
+                                                              size_t max_bytes);
+
+#ifdef __cplusplus
+}
+
+#include <atomic>
+
+// Levels below this are compiled out entirely. Release builds drop DEBUG, so
+// per-token logging in the decode loop costs nothing there.
+#ifndef PLLAMA_LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define PLLAMA_LOG_COMPILE_LEVEL PLLAMA_LOG_LEVEL_INFO
+#else
+#define PLLAMA_LOG_COMPILE_LEVEL PLLAMA_LOG_LEVEL_DEBUG
+#endif
+#endif
+
+extern std::atomic<int> pllama_log_runtime_level;
+
+inline bool pllama_log_enabled(int level) {
+  return level >= pllama_log_runtime_level.load(std::memory_order_relaxed);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PLLAMA_LOG_PRINTF_FORMAT __attribute__((format(printf, 3, 4)))
+#else
+#define PLLAMA_LOG_PRINTF_FORMAT
+#endif
+
+// Formats and emits a message: to logger when set, stderr otherwise, and to
+// the in-memory buffer. Use the macros below so disabled levels skip the
+// call, including evaluating the arguments.
+void pllama_log_write(int level, pllama_log_callback logger, const char *format,
+                      ...) PLLAMA_LOG_PRINTF_FORMAT;
+
+#define PLLAMA_LOG(level, logger, ...)                                         \
+  do {                                                                         \
+    if ((level) >= PLLAMA_LOG_COMPILE_LEVEL && pllama_log_enabled(level)) {    \
+      pllama_log_write((level), (logger), __VA_ARGS__);                        \
+    }                                                                          \
+  } while (0)
+
+#define PLLAMA_LOG_DEBUG(logger, ...)                                          \
+  PLLAMA_LOG(PLLAMA_LOG_LEVEL_DEBUG, logger, __VA_ARGS__)
+#define PLLAMA_LOG_INFO(logger, ...)                                           \
+  PLLAMA_LOG(PLLAMA_LOG_LEVEL_INFO, logger, __VA_ARGS__)
+#define PLLAMA_LOG_WARN(logger, ...)                                           \
+  PLLAMA_LOG(PLLAMA_LOG_LEVEL_WARN, logger, __VA_ARGS__)
+#define PLLAMA_LOG_ERROR(logger, ...)                                          \
+  PLLAMA_LOG(PLLAMA_LOG_LEVEL_ERROR, logger, __VA_ARGS__)
+#endif
+
+#endif // FLLAMA_LOG_H
@@ -0,0 +1,204 @@
+#include "pllama_lookahead.h"
+
+#include <algorithm>
+#include <random>
+
+#include "pllama_sampling.h"
+
+static_assert(LookaheadDecoder::LOOKAHEAD_NGRAM >= 3,
+              "the last window level must not be the first");
+
+static const int LOOKAHEAD_LEVELS = LookaheadDecoder::LOOKAHEAD_NGRAM - 1;
+static const int LOOKAHEAD_MAX_BATCH =
+    1 + LookaheadDecoder::LOOKAHEAD_MAX_VERIFY * LOOKAHEAD_LEVELS +
+    LookaheadDecoder::LOOKAHEAD_WINDOW * LOOKAHEAD_LEVELS - 1;
+
+static void lookahead_batch_add(llama_batch &batch, llama_token token,
+                                llama_pos pos, llama_seq_id seq_first,
+                                llama_seq_id seq_last, bool logits) {
+  const int32_t i = batch.n_tokens;
+  batch.token[i] = token;
+  batch.pos[i] = pos;
+  batch.n_seq_id[i] = seq_last - seq_first + 1;
+  for (llama_seq_id s = seq_first; s <= seq_last; s++) {
+    batch.seq_id[i][s - seq_first] = s;
+  }
+  batch.logits[i] = logits;
+  batch.n_tokens++;
+}
+
+LookaheadDecoder::LookaheadDecoder(llama_context *ctx,
+                                   const std::vector<llama_token> &prompt)
+    : context(ctx),
+      n_vocab(llama_vocab_n_tokens(
+          llama_model_get_vocab(llama_get_model(ctx)))),
+      batch(llama_batch_init(LOOKAHEAD_MAX_BATCH, 0, LOOKAHEAD_N_SEQ)),
+      window(LOOKAHEAD_LEVELS, std::vector<llama_token>(LOOKAHEAD_WINDOW)),
+      level_zero(LOOKAHEAD_WINDOW) {
+  // Any start converges; prompt tokens are at least plausible ones.
+  std::minstd_rand rng(LOOKAHEAD_WINDOW);
+  for (auto &level : window) {
+    for (llama_token &token : level) {
+      token = prompt.empty() ? 0 : prompt[rng() % prompt.size()];
+    }
+  }
+}
+
+LookaheadDecoder::~LookaheadDecoder() {
+  for (llama_seq_id s = 1; s < LOOKAHEAD_N_SEQ; s++) {
+    llama_kv_cache_seq_rm(context, s, -1, -1);
+  }
+  llama_batch_free(batch);
+}
+
+void LookaheadDecoder::shiftWindow(const std::vector<llama_token> &fresh) {
+  for (int j = 0; j + 1 < LOOKAHEAD_LEVELS; j++) {
+    window[j].swap(window[j + 1]);
+  }
+  window[LOOKAHEAD_LEVELS - 1] = fresh;
+}
+
+void LookaheadDecoder::addNgram(llama_token key, const llama_token *tokens) {
+  ngram_set &set = pool[key];
+  if (set.tokens.empty()) {
+    set.tokens.resize(LOOKAHEAD_MAX_VERIFY * LOOKAHEAD_LEVELS);
+  }
+  for (int g = 0; g < set.count; g++) {
+    if (std::equal(tokens, tokens + LOOKAHEAD_LEVELS,
+                   set.tokens.begin() + g * LOOKAHEAD_LEVELS)) {
+      return;
+    }
+  }
+  std::copy(tokens, tokens + LOOKAHEAD_LEVELS,
+            set.tokens.begin() + set.head * LOOKAHEAD_LEVELS);
+  set.head = (set.head + 1) % LOOKAHEAD_MAX_VERIFY;
+  set.count = std::min(set.count + 1, LOOKAHEAD_MAX_VERIFY);
+}
+
+bool LookaheadDecoder::step(llama_context *ctx, llama_sampler *smpl,
+                            const std::vector<llama_token> &history,
+                            llama_token last, int n_max, int n_free,
+                            std::vector<llama_token> &sampled) {
+  const llama_pos n_past = (llama_pos)history.size();
+  if (!sequences_ready) {
+    // Every sequence sees the prompt; cells are shared, not duplicated.
+    for (llama_seq_id s = 1; s < LOOKAHEAD_N_SEQ; s++) {
+      llama_kv_cache_seq_cp(ctx, 0, s, -1, -1);
+    }
+    sequences_ready = true;
+  }
+
+  const auto found = pool.find(last);
+  const ngram_set *candidates = found != pool.end() ? &found->second : nullptr;
+  int n_candidates = candidates != nullptr ? candidates->count : 0;
+  const int n_batch_needed = 1 + n_candidates * LOOKAHEAD_LEVELS +
+                             LOOKAHEAD_WINDOW * LOOKAHEAD_LEVELS - 1;
+  // Near the end of the budget or the context, decode just the token.
+  const bool lookahead = n_max > 1 && n_batch_needed <= n_free &&
+                         n_batch_needed <= (int)llama_n_batch(ctx);
+  if (!lookahead) {
+    n_candidates = 0;
+  }
+
+  batch.n_tokens = 0;
+  lookahead_batch_add(batch, last, n_past, 0, LOOKAHEAD_N_SEQ - 1, true);
+  // Candidates first, for less KV cache fragmentation when they are kept.
+  for (int g = 0; g < n_candidates; g++) {
+    for (int j = 0; j < LOOKAHEAD_LEVELS; j++) {
+      lookahead_batch_add(batch, candidates->tokens[g * LOOKAHEAD_LEVELS + j],
+                          n_past + 1 + j, LOOKAHEAD_WINDOW + 1 + g,
+                          LOOKAHEAD_WINDOW + 1 + g, true);
+    }
+  }
+  if (lookahead) {
+    // Column i is sequence i + 1: it sees the first level up to column i,
+    // then its own column down the levels. The real token is column 0 of
+    // the first level.
+    for (int i = 1; i < LOOKAHEAD_WINDOW; i++) {
+      lookahead_batch_add(batch, window[0][i], n_past + i, i + 1,
+                          LOOKAHEAD_WINDOW, false);
+    }
+    for (int j = 1; j < LOOKAHEAD_LEVELS; j++) {
+      for (int i = 0; i < LOOKAHEAD_WINDOW; i++) {
+        lookahead_batch_add(batch, window[j][i], n_past + j + i, i + 1, i + 1,
+                            j == LOOKAHEAD_LEVELS - 1);
+      }
+    }
+  }
+  if (llama_decode(ctx, batch) != 0) {
+    llama_kv_cache_seq_rm(ctx, -1, n_past, -1);
+    return false;
+  }
+
+  // Follow the candidates for as long as one agrees with the samples.
+  sampled.clear();
+  llama_token token = pllama_sampler_sample(smpl, ctx, 0);
+  sampled.push_back(token);
+  active.assign(n_candidates, true);
+  int best = -1;
+  for (int v = 0; v < LOOKAHEAD_LEVELS && (int)sampled.size() < n_max; v++) {
+    int match = -1;
+    for (int g = 0; g < n_candidates; g++) {
+      if (active[g] &&
+          candidates->tokens[g * LOOKAHEAD_LEVELS + v] != token) {
+        active[g] = false;
+      }
+      if (active[g] && match < 0) {
+        match = g;
+      }
+    }
+    if (match < 0) {
+      break;
+    }
+    best = match;
+    token = pllama_sampler_sample(smpl, ctx, 1 + match * LOOKAHEAD_LEVELS + v);
+    sampled.push_back(token);
+  }
+  const int n_kept = (int)sampled.size() - 1;
+  if (n_candidates > 0) {
+    n_proposed += LOOKAHEAD_LEVELS;
+    n_accepted += n_kept;
+  }
+
+  // Drop this batch's cells past what was accepted. Accepted candidate
+  // cells belong to that candidate's sequence only: make it the real one
+  // and share the result with every sequence again.
+  llama_kv_cache_seq_rm(ctx, -1, n_past + 1 + n_kept, -1);
+  if (best >= 0) {
+    const llama_seq_id seq_best = LOOKAHEAD_WINDOW + 1 + best;
+    llama_kv_cache_seq_keep(ctx, seq_best);
+    llama_kv_cache_seq_cp(ctx, seq_best, 0, -1, -1);
+    llama_kv_cache_seq_rm(ctx, seq_best, -1, -1);
+    for (llama_seq_id s = 1; s < LOOKAHEAD_N_SEQ; s++) {
+      llama_kv_cache_seq_cp(ctx, 0, s, -1, -1);
+    }
+  }
+
+  if (lookahead) {
+    // One Jacobi step: the last level's predictions become the new last
+    // level, and each column's trajectory is remembered as an n-gram.
+    level_zero = window[0];
+    const int first_output =
+        1 + n_candidates * LOOKAHEAD_LEVELS + (LOOKAHEAD_WINDOW - 1) +
+        (LOOKAHEAD_LEVELS - 2) * LOOKAHEAD_WINDOW;
+    std::vector<llama_token> fresh(LOOKAHEAD_WINDOW);
+    for (int i = 0; i < LOOKAHEAD_WINDOW; i++) {
+      fresh[i] = pllama_argmax(
+          llama_get_logits_ith(ctx, first_output + i), n_vocab);
+    }
+    shiftWindow(fresh);
+    llama_token ngram[LOOKAHEAD_LEVELS];
+    for (int i = 0; i < LOOKAHEAD_WINDOW; i++) {
+      for (int j = 0; j < LOOKAHEAD_LEVELS; j++) {
+        ngram[j] = window[j][i];
+      }
+      addNgram(level_zero[i], ngram);
+    }
+    // The window is relative to the real token; move it along with every
+    // extra accepted token, recycling the oldest level.
+    for (int v = 0; v < n_kept; v++) {
+      shiftWindow(std::vector<llama_token>(window[0]));
+    }
+  }
+  return true;
+}
@@ -0,0 +1,69 @@
+#ifndef FLLAMA_LOOKAHEAD_H
+#define FLLAMA_LOOKAHEAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+#include "pllama_decoder.h"
+
+// Lookahead decoding: drafts without a draft model or a matching prompt.
+//
+// Alongside the real token, each decode runs one step of Jacobi iteration on
+// a window of guessed future tokens: LOOKAHEAD_WINDOW columns, each a chain
+// of LOOKAHEAD_NGRAM - 1 levels, whose last level predicts a new token per
+// column. The trajectories this leaves behind form n-grams that are
+// collected in a pool keyed by their first token. Up to LOOKAHEAD_MAX_VERIFY
+// pooled n-grams starting with the real token are verified in the same
+// batch, and the longest one the model agrees with is accepted.
+//
+// Window and candidates are kept apart with KV cache sequences: the context
+// needs LOOKAHEAD_N_SEQ of them. Sequence 0 is the real one; the others are
+// cleared again when the decoder is destroyed.
+class LookaheadDecoder : public DecoderStrategy {
+public:
+  static constexpr int LOOKAHEAD_WINDOW = 4;
+  static constexpr int LOOKAHEAD_NGRAM = 4;
+  static constexpr int LOOKAHEAD_MAX_VERIFY = 4;
+  static constexpr int LOOKAHEAD_N_SEQ =
+      LOOKAHEAD_WINDOW + LOOKAHEAD_MAX_VERIFY + 1;
+
+  // The window starts out with tokens picked from prompt.
+  LookaheadDecoder(llama_context *ctx, const std::vector<llama_token> &prompt);
+  ~LookaheadDecoder() override;
+
+  LookaheadDecoder(const LookaheadDecoder &) = delete;
+  LookaheadDecoder &operator=(const LookaheadDecoder &) = delete;
+
+  bool step(llama_context *ctx, llama_sampler *smpl,
+            const std::vector<llama_token> &history, llama_token last,
+            int n_max, int n_free, std::vector<llama_token> &sampled) override;
+
+private:
+  // The LOOKAHEAD_NGRAM - 1 tokens following a key token, for up to
+  // LOOKAHEAD_MAX_VERIFY n-grams; the oldest is replaced when full.
+  struct ngram_set {
+    std::vector<llama_token> tokens;
+    int count = 0;
+    int head = 0;
+  };
+
+  llama_context *context;
+  int32_t n_vocab;
+  llama_batch batch;
+  bool sequences_ready = false;
+  // window[level][column]
+  std::vector<std::vector<llama_token>> window;
+  std::unordered_map<llama_token, ngram_set> pool;
+  std::vector<llama_token> level_zero;
+  std::vector<bool> active;
+
+  // Moves every level down one; the last level gets fresh tokens.
+  void shiftWindow(const std::vector<llama_token> &fresh);
+  void addNgram(llama_token key, const llama_token *tokens);
+};
+
+#endif // FLLAMA_LOOKAHEAD_H
@@ -0,0 +1,53 @@
+#include "pllama_loop.h"
+
+// Odd, so multiplying by it modulo 2^64 loses nothing.
+static const uint64_t LOOP_HASH_BASE = 0x100000001b3ULL;
+
+LoopDetector::LoopDetector(int32_t window, int32_t min_repeats)
+    : window(window > 0 ? window : 0),
+      max_period(min_repeats > 1 ? this->window / min_repeats : 0) {
+  if (max_period == 0) {
+    return;
+  }
+  tokens.resize((size_t)this->window);
+  prefix_hash.resize((size_t)this->window + 1);
+  powers.push_back(1);
+  for (int32_t i = 0; i < this->window; i++) {
+    powers.push_back(powers.back() * LOOP_HASH_BASE);
+  }
+}
+
+uint64_t LoopDetector::hash(uint64_t begin, uint64_t end) const {
+  return prefix_at(end) - prefix_at(begin) * powers[end - begin];
+}
+
+bool LoopDetector::push(llama_token token) {
+  if (max_period == 0) {
+    return false;
+  }
+  // + 1 so that token 0 still changes the hash.
+  const uint64_t next = prefix_at(n_tokens) * LOOP_HASH_BASE +
+                        (uint64_t)(uint32_t)token + 1;
+  tokens[n_tokens % window] = token;
+  n_tokens++;
+  prefix_hash[n_tokens % prefix_hash.size()] = next;
+  if (n_tokens < (uint64_t)window) {
+    return false;
+  }
+  const uint64_t start = n_tokens - (uint64_t)window;
+  for (int32_t p = 1; p <= max_period; p++) {
+    // Period p: every token of the window equals the one p before it.
+    if (hash(start, n_tokens - p) != hash(start + p, n_tokens)) {
+      continue;
+    }
+    bool periodic = true;
+    for (uint64_t i = start + p; i < n_tokens && periodic; i++) {
+      periodic = token_at(i) == token_at(i - p);
+    }
+    if (periodic) {
+      found_period = p;
+      return true;
+    }
+  }
+  return false;
+}
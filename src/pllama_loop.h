@@ -0,0 +1,51 @@
+#ifndef FLLAMA_LOOP_H
+#define FLLAMA_LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "llama.h"
+
+// Spots generations stuck repeating themselves: the last window tokens are
+// one block of tokens, repeated at least min_repeats times (the last
+// repetition may be cut short). The last window tokens and the hashes of the
+// output up to each of them are kept in rings, so memory is bounded by the
+// window. Whether the window repeats with a given period is one comparison
+// of two hashes, the window without its last period against the window
+// without its first; each token checks every period up to
+// window / min_repeats that way, and a match is confirmed token by token.
+class LoopDetector {
+public:
+  // A window of 0 disables detection.
+  LoopDetector(int32_t window, int32_t min_repeats);
+
+  // Adds a generated token. Returns true if the output now ends in a loop.
+  bool push(llama_token token);
+
+  // Length of the repeated block found by the last push that returned true.
+  int32_t period() const { return found_period; }
+
+private:
+  int32_t window;
+  int32_t max_period;
+  int32_t found_period = 0;
+  // Tokens generated so far.
+  uint64_t n_tokens = 0;
+  // Token i is at tokens[i % window]; the hash of the first i tokens at
+  // prefix_hash[i % (window + 1)].
+  std::vector<llama_token> tokens;
+  std::vector<uint64_t> prefix_hash;
+  // powers[i] is the base to the i.
+  std::vector<uint64_t> powers;
+
+  llama_token token_at(uint64_t i) const { return tokens[i % window]; }
+  uint64_t prefix_at(uint64_t i) const {
+    return prefix_hash[i % prefix_hash.size()];
+  }
+  // Hash of tokens [begin, end), at most window of them.
+  uint64_t hash(uint64_t begin, uint64_t end) const;
+};
+
+#endif // FLLAMA_LOOP_H
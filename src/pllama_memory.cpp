@@ -0,0 +1,368 @@
+#include "pllama_memory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+
+#if defined(__linux__) || defined(__ANDROID__)
+#include <unistd.h>
+#endif
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "ggml.h"
+#include "gguf.h"
+#include "pllama_context_pool.h"
+#include "pllama_log.h"
+
+static std::atomic<uint64_t> memory_budget_bytes(0);
+
+
+// Gives free heap pages back to the OS where the allocator supports it.
+static void trim_heap() {
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+}
+
+uint64_t pllama_memory_budget() { return memory_budget_bytes.load(); }
+
+// Shape of a model as far as memory planning is concerned.
+struct model_shape {
+  bool ok = false;
+  uint64_t weights_bytes = 0;
+  uint32_t n_layer = 0;
+  uint32_t n_embd = 0;
+  uint32_t n_head = 0;
+  uint32_t n_head_kv = 0;
+  uint32_t n_embd_head_k = 0;
+  uint32_t n_embd_head_v = 0;
+  uint32_t n_ff = 0;
+  uint32_t n_vocab = 0;
+};
+
+static std::mutex shape_cache_mutex;
+static std::map<std::string, model_shape> shape_cache;
+
+// Reads an integer metadata value. Per-layer arrays (ex. head_count_kv on
+// some architectures) yield their largest entry.
+static bool gguf_read_uint(const gguf_context *ctx, const std::string &key,
+                           uint32_t *out) {
+  const int64_t key_id = gguf_find_key(ctx, key.c_str());
+  if (key_id < 0) {
+    return false;
+  }
+  enum gguf_type type = gguf_get_kv_type(ctx, key_id);
+  const void *data = NULL;
+  size_t n = 1;
+  if (type == GGUF_TYPE_ARRAY) {
+    type = gguf_get_arr_type(ctx, key_id);
+    data = gguf_get_arr_data(ctx, key_id);
+    n = gguf_get_arr_n(ctx, key_id);
+  } else {
+    data = gguf_get_val_data(ctx, key_id);
+  }
+
+  uint64_t largest = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint64_t value = 0;
+    switch (type) {
+    case GGUF_TYPE_UINT8:
+      value = ((const uint8_t *)data)[i];
+      break;
+    case GGUF_TYPE_INT8:
+      value = (uint64_t)std::max<int8_t>(0, ((const int8_t *)data)[i]);
+      break;
+    case GGUF_TYPE_UINT16:
+      value = ((const uint16_t *)data)[i];
+      break;
+    case GGUF_TYPE_INT16:
+      value = (uint64_t)std::max<int16_t>(0, ((const int16_t *)data)[i]);
+      break;
+    case GGUF_TYPE_UINT32:
+      value = ((const uint32_t *)data)[i];
+      break;
+    case GGUF_TYPE_INT32:
+      value = (uint64_t)std::max<int32_t>(0, ((const int32_t *)data)[i]);
+      break;
+    case GGUF_TYPE_UINT64:
+      value = ((const uint64_t *)data)[i];
+      break;
+    case GGUF_TYPE_INT64:
+      value = (uint64_t)std::max<int64_t>(0, ((const int64_t *)data)[i]);
+      break;
+    default:
+      return false;
+    }
+    largest = std::max(largest, value);
+  }
+  *out = (uint32_t)std::min<uint64_t>(largest, UINT32_MAX);
+  return true;
+}
+
+static model_shape read_model_shape(const std::string &model_path) {
+  {
+    std::lock_guard<std::mutex> lock(shape_cache_mutex);
+    auto it = shape_cache.find(model_path);
+    if (it != shape_cache.end()) {
+      return it->second;
+    }
+  }
+
+  model_shape shape;
+  struct gguf_init_params params = {
+      /*.no_alloc = */ true,
+      /*.ctx      = */ NULL,
+  };
+  struct gguf_context *ctx = gguf_init_from_file(model_path.c_str(), params);
+  if (!ctx) {
+    PLLAMA_LOG_ERROR(nullptr, "Unable to read model header: %s",
+                     model_path.c_str());
+    return shape;
+  }
+
+  for (int64_t i = 0; i < gguf_get_n_tensors(ctx); i++) {
+    shape.weights_bytes += gguf_get_tensor_size(ctx, i);
+  }
+
+  const int64_t arch_id = gguf_find_key(ctx, "general.architecture");
+  const std::string arch =
+      arch_id >= 0 ? gguf_get_val_str(ctx, arch_id) : "llama";
+  const bool has_layers =
+      gguf_read_uint(ctx, arch + ".block_count", &shape.n_layer);
+  const bool has_embd =
+      gguf_read_uint(ctx, arch + ".embedding_length", &shape.n_embd);
+  const bool has_head =
+      gguf_read_uint(ctx, arch + ".attention.head_count", &shape.n_head);
+  if (!gguf_read_uint(ctx, arch + ".attention.head_count_kv",
+                      &shape.n_head_kv)) {
+    shape.n_head_kv = shape.n_head;
+  }
+  const uint32_t default_head_dim =
+      shape.n_head > 0 ? shape.n_embd / shape.n_head : 0;
+  if (!gguf_read_uint(ctx, arch + ".attention.key_length",
+                      &shape.n_embd_head_k)) {
+    shape.n_embd_head_k = default_head_dim;
+  }
+  if (!gguf_read_uint(ctx, arch + ".attention.value_length",
+                      &shape.n_embd_head_v)) {
+    shape.n_embd_head_v = default_head_dim;
+  }
+  gguf_read_uint(ctx, arch + ".feed_forward_length", &shape.n_ff);
+  if (!gguf_read_uint(ctx, arch + ".vocab_size", &shape.n_vocab)) {
+    const int64_t tokens_id = gguf_find_key(ctx, "tokenizer.ggml.tokens");
+    if (tokens_id >= 0) {
+      shape.n_vocab = (uint32_t)gguf_get_arr_n(ctx, tokens_id);
+    }
+  }
+  gguf_free(ctx);
+
+  shape.ok = has_layers && has_embd && has_head;
+  std::lock_guard<std::mutex> lock(shape_cache_mutex);
+  shape_cache[model_path] = shape;
+  return shape;
+}
+
+// Row size in bytes, falling back to F16 when n does not fill whole blocks
+// of a quantized type.
+static uint64_t row_bytes(enum ggml_type type, uint64_t n) {
+  if (n % ggml_blck_size(type) != 0) {
+    type = GGML_TYPE_F16;
+  }
+  return ggml_row_size(type, n);
+}
+
+// Whether type can size a KV cache: in range, and not one of the removed
+// types that are left with a block size of 0.
+static bool is_cache_type(int type) {
+  return type >= 0 && type < GGML_TYPE_COUNT &&
+         ggml_blck_size((enum ggml_type)type) > 0;
+}
+
+static pllama_memory_estimate estimate_from_shape(const model_shape &shape,
+                                                  uint32_t n_ctx,
+                                                  uint32_t n_ubatch,
+                                                  enum ggml_type type_k,
+                                                  enum ggml_type type_v) {
+  pllama_memory_estimate estimate = {};
+  if (!shape.ok) {
+    return estimate;
+  }
+  estimate.ok = 1;
+  estimate.weights_bytes = shape.weights_bytes;
+
+  const uint64_t n_embd_k_gqa = (uint64_t)shape.n_embd_head_k * shape.n_head_kv;
+  const uint64_t n_embd_v_gqa = (uint64_t)shape.n_embd_head_v * shape.n_head_kv;
+  estimate.kv_cache_bytes =
+      (uint64_t)shape.n_layer * n_ctx *
+      (row_bytes(type_k, n_embd_k_gqa) + row_bytes(type_v, n_embd_v_gqa));
+
+  // The compute buffer is reserved for the worst-case micro-batch. Its peak
+  // is dominated by the largest of the attention scores, the FFN activations
+  // and the output logits, all F32.
+  // Widened first: n_ubatch * n_ctx * n_head alone overflows 32 bits at
+  // long contexts.
+  const uint64_t kq_bytes = (uint64_t)n_ubatch * n_ctx * shape.n_head * 4;
+  const uint64_t ffn_bytes = (uint64_t)n_ubatch * shape.n_ff * 4 * 2;
+  const uint64_t output_bytes = (uint64_t)n_ubatch * shape.n_vocab * 4;
+  estimate.compute_bytes = std::max(kq_bytes, std::max(ffn_bytes, output_bytes)) +
+                           (uint64_t)n_ubatch * shape.n_embd * 4 * 4;
+
+  estimate.total_bytes = estimate.weights_bytes + estimate.kv_cache_bytes +
+                         estimate.compute_bytes;
+  return estimate;
+}
+
+bool pllama_memory_plan_context(const std::string &model_path,
+                                bool weights_resident, uint32_t min_ctx,
+                                uint32_t *n_ctx, uint32_t *n_batch,
+                                uint32_t *n_ubatch,
+                                pllama_log_callback logger) {
+  *n_batch = std::min(*n_batch, *n_ctx);
+  *n_ubatch = std::min(*n_ubatch, *n_batch);
+  const uint64_t budget = memory_budget_bytes.load();
+  if (budget == 0) {
+    return true;
+  }
+  const model_shape shape = read_model_shape(model_path);
+  if (!shape.ok) {
+    return true;
+  }
+
+  const uint64_t rss = pllama_memory_rss_bytes();
+  const uint64_t available = rss < budget ? budget - rss : 0;
+  const uint32_t requested_ctx = *n_ctx;
+  const uint32_t requested_ubatch = *n_ubatch;
+  min_ctx = std::min(min_ctx, requested_ctx);
+  const uint32_t min_ubatch = std::min<uint32_t>(PLLAMA_MIN_N_UBATCH,
+                                                 requested_ubatch);
+
+  // Smaller micro-batches only make prefill slower, so they go first; the
+  // context is only shrunk once they are as small as allowed.
+  uint32_t planned_ctx = requested_ctx;
+  uint32_t planned_ubatch = requested_ubatch;
+  while (true) {
+    const pllama_memory_estimate estimate = estimate_from_shape(
+        shape, planned_ctx, std::min(planned_ubatch, planned_ctx),
+        GGML_TYPE_F16, GGML_TYPE_F16);
+    const uint64_t needed = estimate.total_bytes -
+                            (weights_resident ? estimate.weights_bytes : 0);
+    if (needed <= available) {
+      break;
+    }
+    if (planned_ubatch / 2 >= min_ubatch) {
+      planned_ubatch /= 2;
+      continue;
+    }
+    if (planned_ctx / 2 < min_ctx) {
+      PLLAMA_LOG_WARN(logger,
+                      "Request needs %llu MiB but only %llu MiB of the memory "
+                      "budget is left",
+                      (unsigned long long)(needed >> 20),
+                      (unsigned long long)(available >> 20));
+      return false;
+    }
+    planned_ctx /= 2;
+  }
+
+  if (planned_ubatch != requested_ubatch) {
+    PLLAMA_LOG_INFO(logger,
+                    "Shrinking micro-batches from %u to %u tokens to fit the "
+                    "memory budget",
+                    requested_ubatch, planned_ubatch);
+  }
+  if (planned_ctx != requested_ctx) {
+    PLLAMA_LOG_INFO(logger,
+                    "Shrinking context from %u to %u to fit the memory budget",
+                    requested_ctx, planned_ctx);
+  }
+  *n_ctx = planned_ctx;
+  *n_batch = std::min(*n_batch, planned_ctx);
+  *n_ubatch = std::min(planned_ubatch, *n_batch);
+  return true;
+}
+
+void pllama_memory_relieve_pressure(pllama_log_callback logger) {
+  const uint64_t budget = memory_budget_bytes.load();
+  if (budget == 0) {
+    return;
+  }
+  uint64_t rss = pllama_memory_rss_bytes();
+  if (rss == 0 || rss <= budget) {
+    return;
+  }
+
+  const uint64_t rss_before = rss;
+  trim_heap();
+  rss = pllama_memory_rss_bytes();
+  if (rss > budget) {
+    // Idle contexts each pin a KV cache; they are the next cheapest to drop.
+    const size_t evicted = pllama_context_evict_idle();
+    if (evicted > 0) {
+      trim_heap();
+      rss = pllama_memory_rss_bytes();
+    }
+  }
+
+  PLLAMA_LOG_INFO(logger, "Memory over budget: RSS %llu MiB -> %llu MiB, budget %llu MiB",
+                  (unsigned long long)(rss_before >> 20),
+                  (unsigned long long)(rss >> 20),
+                  (unsigned long long)(budget >> 20));
+}
+
+extern "C" {
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_memory_set_budget(uint64_t budget_bytes) {
+  memory_budget_bytes.store(budget_bytes);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT struct pllama_memory_estimate
+pllama_estimate_memory(const char *model_path, int n_ctx, int n_batch,
+                       int type_k, int type_v) {
+  if (model_path == NULL || n_ctx <= 0 || n_batch <= 0 ||
+      !is_cache_type(type_k) || !is_cache_type(type_v)) {
+    pllama_memory_estimate empty = {};
+    return empty;
+  }
+  return estimate_from_shape(read_model_shape(model_path), (uint32_t)n_ctx,
+                             std::min<uint32_t>((uint32_t)n_batch,
+                                                PLLAMA_DEFAULT_N_UBATCH),
+                             (enum ggml_type)type_k,
+                             (enum ggml_type)type_v);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint64_t pllama_memory_rss_bytes(void) {
+#if defined(__linux__) || defined(__ANDROID__)
+  // Second field of statm is the resident page count.
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) {
+    return 0;
+  }
+  unsigned long long size_pages = 0;
+  unsigned long long resident_pages = 0;
+  const int fields = fscanf(statm, "%llu %llu", &size_pages, &resident_pages);
+  fclose(statm);
+  if (fields != 2) {
+    return 0;
+  }
+  return (uint64_t)resident_pages * (uint64_t)sysconf(_SC_PAGESIZE);
+#elif defined(__APPLE__)
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info,
+                &count) != KERN_SUCCESS) {
+    return 0;
+  }
+  return (uint64_t)info.resident_size;
+#else
+  return 0;
+#endif
+}
+} // extern "C"
@@ -0,0 +1,81 @@
+#ifndef FLLAMA_MEMORY_H
+#define FLLAMA_MEMORY_H
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+#if _WIN32
+#define FFI_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define FFI_PLUGIN_EXPORT
+#endif
+
+#include <stdint.h>
+
+#include "pllama.h" // For pllama_log_callback
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sets the resident memory budget in bytes. Above it, requests first return
+// freed heap to the OS and then evict idle cached contexts. 0 (the default)
+// disables the policy.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_memory_set_budget(uint64_t budget_bytes);
+
+// Current resident set size of the process in bytes, or 0 when the platform
+// does not expose it.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint64_t pllama_memory_rss_bytes(void);
+
+struct pllama_memory_estimate {
+  uint64_t weights_bytes;    // Sum of all tensor sizes in the file.
+  uint64_t kv_cache_bytes;   // K and V caches for n_ctx tokens.
+  uint64_t compute_bytes;    // Rough upper bound for the compute buffer.
+  uint64_t total_bytes;      // Sum of the above.
+  uint8_t ok;                // 0 if the GGUF header could not be read or
+                             // the arguments are invalid.
+};
+
+// Estimates the memory a request needs from the GGUF header alone, without
+// loading weights. The compute buffer is sized for micro-batches of n_batch
+// tokens, at most PLLAMA_DEFAULT_N_UBATCH. type_k / type_v are ggml_type
+// values for the KV cache; 1 (F16) is what requests use today. Unknown or
+// removed types yield ok = 0. The header of each path is parsed once and
+// cached.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT struct pllama_memory_estimate
+pllama_estimate_memory(const char *model_path, int n_ctx, int n_batch,
+                       int type_k, int type_v);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+
+uint64_t pllama_memory_budget();
+
+// Smallest micro-batch the planner shrinks n_ubatch to.
+#define PLLAMA_MIN_N_UBATCH 64
+
+// Fits a request into the budget before any weights are touched: shrinks
+// n_ubatch (halving, not below PLLAMA_MIN_N_UBATCH), then n_ctx (halving,
+// not below min_ctx), until weights (unless already resident), KV cache and
+// compute buffer fit in what is left of the budget. n_batch is capped at
+// n_ctx and n_ubatch at n_batch, budget or not. Returns false if even
+// min_ctx does not fit. Always true when no budget is set or the header
+// cannot be read.
+bool pllama_memory_plan_context(const std::string &model_path,
+                                bool weights_resident, uint32_t min_ctx,
+                                uint32_t *n_ctx, uint32_t *n_batch,
+                                uint32_t *n_ubatch,
+                                pllama_log_callback logger);
+
+// Applies the policy: does nothing while RSS is within budget, never sleeps.
+// Safe to call on the request path.
+void pllama_memory_relieve_pressure(pllama_log_callback logger);
+#endif
+
+#endif // FLLAMA_MEMORY_H
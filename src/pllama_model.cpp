@@ -0,0 +1,505 @@
+#include "pllama_model.h"
+
+#ifdef __APPLE__
+#include <TargetConditionals.h>
+#endif
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PLLAMA_HAS_MMAP 1
+#endif
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gguf.h"
+#include "llama.h"
+#include "pllama_context_pool.h"
+#include "pllama_detokenize.h"
+#include "pllama_grammar.h"
+#include "pllama_log.h"
+#include "pllama_runtime.h"
+
+// Keeps loaded models resident and hands out refcounted handles to them, so
+// that inference, tokenization and the EOS / chat template helpers share one
+// copy of the weights instead of reloading the file per call.
+class ModelRegistry {
+public:
+  static ModelRegistry &getInstance() {
+    static ModelRegistry instance;
+    return instance;
+  }
+
+  pllama_model_handle *acquire(const std::string &model_path,
+                               int num_gpu_layers,
+                               const pllama_model_progress_fn &progress,
+                               int num_threads) {
+    std::unique_lock<std::mutex> lock(registry_mutex);
+    pllama_model_handle *handle = nullptr;
+    while ((handle = findLocked(model_path, &num_gpu_layers)) != nullptr) {
+      handle->refcount++;
+      // Another caller may still be loading it; wait for the result.
+      cond_var.wait(lock, [handle] { return !handle->loading; });
+      if (handle->model != nullptr) {
+        return handle;
+      }
+      const bool retry = handle->cancelled;
+      releaseLocked(handle); // A failed load never holds a model.
+      if (!retry) {
+        return nullptr;
+      }
+      // That caller gave up, not the file; load it ourselves.
+    }
+
+    handle = new pllama_model_handle();
+    handle->path = model_path;
+    handle->num_gpu_layers = num_gpu_layers;
+    handle->refcount = 1;
+    handles.push_back(handle);
+
+    // Load outside the lock so other models stay usable meanwhile.
+    lock.unlock();
+    bool cancelled = false;
+    llama_model *model = loadPrefaulted(model_path, num_gpu_layers,
+                                        num_threads, progress, &cancelled);
+    std::shared_ptr<const pllama_piece_table> pieces =
+        model != nullptr ? pllama_piece_table_build(model) : nullptr;
+    std::shared_ptr<pllama_grammar_cache> grammars =
+        model != nullptr ? pllama_grammar_cache_create(model, pieces)
+                         : nullptr;
+    lock.lock();
+
+    handle->model = model;
+    handle->pieces = pieces;
+    handle->grammars = grammars;
+    handle->loading = false;
+    handle->cancelled = cancelled;
+    cond_var.notify_all();
+    if (model == nullptr) {
+      releaseLocked(handle);
+      return nullptr;
+    }
+    return handle;
+  }
+
+  pllama_model_handle *prefetch(const std::string &model_path,
+                                int num_gpu_layers, int num_threads) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    pllama_model_handle *handle = findLocked(model_path, &num_gpu_layers);
+    if (handle != nullptr) {
+      handle->refcount++;
+      return handle;
+    }
+
+    handle = new pllama_model_handle();
+    handle->path = model_path;
+    handle->num_gpu_layers = num_gpu_layers;
+    // One reference for the caller, one for the loader thread, so closing the
+    // handle early cannot free it under the loader.
+    handle->refcount = 2;
+    handles.push_back(handle);
+
+    std::thread([this, handle, model_path, num_gpu_layers, num_threads] {
+      // The warm-up decode needs the backend too, not only the load.
+      RuntimeUse runtime_use;
+      llama_model *model = loadPrefaulted(model_path, num_gpu_layers,
+                                          num_threads, nullptr, nullptr);
+      std::shared_ptr<const pllama_piece_table> pieces;
+      std::shared_ptr<pllama_grammar_cache> grammars;
+      if (model != nullptr) {
+        pieces = pllama_piece_table_build(model);
+        grammars = pllama_grammar_cache_create(model, pieces);
+        warmUp(model, num_threads);
+      }
+      {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        handle->model = model;
+        handle->pieces = pieces;
+        handle->grammars = grammars;
+        handle->loading = false;
+        cond_var.notify_all();
+      }
+      release(handle);
+    }).detach();
+    return handle;
+  }
+
+  bool wait(pllama_model_handle *handle) {
+    std::unique_lock<std::mutex> lock(registry_mutex);
+    cond_var.wait(lock, [handle] { return !handle->loading; });
+    return handle->model != nullptr;
+  }
+
+  pllama_model_handle *find(const std::string &model_path) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    pllama_model_handle *handle = findLocked(model_path, nullptr);
+    if (handle == nullptr || handle->loading) {
+      return nullptr;
+    }
+    handle->refcount++;
+    return handle;
+  }
+
+  void retain(pllama_model_handle *handle) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    handle->refcount++;
+  }
+
+  void release(pllama_model_handle *handle) {
+    llama_model *to_free = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(registry_mutex);
+      to_free = releaseLocked(handle);
+    }
+    if (to_free != nullptr) {
+      PLLAMA_LOG_DEBUG(nullptr, "Freeing resident model.");
+      pllama_context_purge(to_free);
+      llama_model_free(to_free);
+    }
+  }
+
+private:
+  std::vector<pllama_model_handle *> handles;
+  std::mutex registry_mutex;
+  std::condition_variable cond_var;
+
+  // Matches on path and, when given, GPU layer count. Skips entries whose load
+  // already failed so a later call gets to retry.
+  pllama_model_handle *findLocked(const std::string &model_path,
+                                  const int *num_gpu_layers) {
+    for (auto *handle : handles) {
+      if (handle->path != model_path) {
+        continue;
+      }
+      if (num_gpu_layers != nullptr &&
+          handle->num_gpu_layers != *num_gpu_layers) {
+        continue;
+      }
+      if (!handle->loading && handle->model == nullptr) {
+        continue;
+      }
+      return handle;
+    }
+    return nullptr;
+  }
+
+  // Returns the model to free once the last reference is gone. The handle is
+  // deleted here; the caller frees the model outside the lock.
+  llama_model *releaseLocked(pllama_model_handle *handle) {
+    if (--handle->refcount > 0) {
+      return nullptr;
+    }
+    handles.erase(std::remove(handles.begin(), handles.end(), handle),
+                  handles.end());
+    llama_model *model = handle->model;
+    delete handle;
+    return model;
+  }
+
+  // Cheap sanity check before handing the file to llama.cpp: only the
+  // fixed-size GGUF preamble is read.
+  static bool verifyHeader(const std::string &model_path) {
+    std::ifstream file(model_path, std::ios::binary);
+    if (!file.good()) {
+      PLLAMA_LOG_ERROR(nullptr, "Cannot open model file: %s",
+                       model_path.c_str());
+      return false;
+    }
+
+    char magic[4] = {0};
+    uint32_t version = 0;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char *>(&version), sizeof(version));
+    if (!file.good()) {
+      PLLAMA_LOG_ERROR(nullptr, "File too small to be a valid model");
+      return false;
+    }
+    if (magic[0] != 'G' || magic[1] != 'G' || magic[2] != 'U' ||
+        magic[3] != 'F') {
+      PLLAMA_LOG_ERROR(nullptr,
+                       "Invalid model file format (not a GGUF file)");
+      return false;
+    }
+    PLLAMA_LOG_DEBUG(nullptr, "GGUF version: %u", version);
+    return true;
+  }
+
+  // Byte ranges of the tensor data in a GGUF file, sorted, with neighbours
+  // less than a page apart merged. Only the header is read.
+  static std::vector<std::pair<size_t, size_t>>
+  tensorRanges(const std::string &model_path, size_t page) {
+    std::vector<std::pair<size_t, size_t>> ranges;
+    gguf_init_params params = {/*no_alloc =*/true, /*ctx =*/nullptr};
+    gguf_context *gguf = gguf_init_from_file(model_path.c_str(), params);
+    if (gguf == nullptr) {
+      return ranges;
+    }
+    const size_t data_offset = gguf_get_data_offset(gguf);
+    const int64_t n_tensors = gguf_get_n_tensors(gguf);
+    for (int64_t i = 0; i < n_tensors; i++) {
+      const size_t begin = data_offset + gguf_get_tensor_offset(gguf, i);
+      const size_t size = gguf_get_tensor_size(gguf, i);
+      if (size > 0) {
+        ranges.emplace_back(begin, begin + size);
+      }
+    }
+    gguf_free(gguf);
+
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<std::pair<size_t, size_t>> merged;
+    for (const auto &range : ranges) {
+      if (!merged.empty() && range.first <= merged.back().second + page) {
+        merged.back().second = std::max(merged.back().second, range.second);
+      } else {
+        merged.push_back(range);
+      }
+    }
+    return merged;
+  }
+
+  // Pulls the tensor data into the page cache so the first decode does not
+  // fault the weights in one page at a time; the header and metadata are
+  // left alone. The pages are shared with the llama.cpp mapping of the same
+  // file, so touching them through a separate shared, read-only mapping is
+  // enough.
+  // The tensor bytes are split evenly, and each thread advises and touches
+  // its share.
+  static void prefaultTensors(const std::string &model_path, int num_threads) {
+#ifdef PLLAMA_HAS_MMAP
+    const int64_t start = ggml_time_ms();
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const std::vector<std::pair<size_t, size_t>> ranges =
+        tensorRanges(model_path, page);
+    if (ranges.empty()) {
+      return;
+    }
+    const int fd = open(model_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+      close(fd);
+      return;
+    }
+    const size_t size = (size_t)st.st_size;
+    void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      return;
+    }
+    const uint8_t *base = static_cast<const uint8_t *>(addr);
+
+    // Tensor bytes [first, last) in the order of ranges, clipped to the file
+    // in case the header promises more than is there.
+    auto touch = [base, size, page, &ranges](size_t first, size_t last) {
+      size_t skipped = 0;
+      uint8_t sum = 0;
+      for (const auto &range : ranges) {
+        const size_t length = range.second - range.first;
+        if (skipped + length > first && skipped < last) {
+          const size_t begin = range.first + (std::max(first, skipped) - skipped);
+          const size_t end = std::min(
+              size, range.first + (std::min(last, skipped + length) - skipped));
+          if (begin < end) {
+            const size_t aligned = begin - begin % page;
+            madvise((void *)(base + aligned), end - aligned, MADV_WILLNEED);
+            for (size_t offset = aligned; offset < end; offset += page) {
+              sum += *(volatile const uint8_t *)(base +
+                                                 std::max(offset, begin));
+            }
+          }
+        }
+        skipped += length;
+      }
+      (void)sum;
+    };
+
+    size_t total = 0;
+    for (const auto &range : ranges) {
+      total += range.second - range.first;
+    }
+    const size_t per_thread = (total + num_threads - 1) / num_threads;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < num_threads; i++) {
+      const size_t first = std::min(total, i * per_thread);
+      const size_t last = std::min(total, first + per_thread);
+      if (first >= last) {
+        break;
+      }
+      workers.emplace_back(touch, first, last);
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    munmap(addr, size);
+    PLLAMA_LOG_DEBUG(nullptr,
+                     "Prefaulted %zu MiB of tensors with %zu threads in %lld ms.",
+                     (size_t)(total >> 20), workers.size(),
+                     (long long)(ggml_time_ms() - start));
+#else
+    (void)model_path;
+    (void)num_threads;
+#endif
+  }
+
+  // Loads the model while num_threads threads prefault its tensors alongside
+  // the load; both end up waiting on the same pages. 0 threads only loads.
+  static llama_model *loadPrefaulted(const std::string &model_path,
+                                     int num_gpu_layers, int num_threads,
+                                     const pllama_model_progress_fn &progress,
+                                     bool *cancelled) {
+    std::thread prefaulter;
+    if (num_threads > 0) {
+      prefaulter = std::thread(prefaultTensors, model_path, num_threads);
+    }
+    llama_model *model =
+        loadModel(model_path, num_gpu_layers, progress, cancelled);
+    if (prefaulter.joinable()) {
+      prefaulter.join();
+    }
+    return model;
+  }
+
+  // Decodes a single token on a throwaway context so backend kernels and
+  // weight buffers are initialized before the first real request.
+  static void warmUp(llama_model *model, int num_threads) {
+    const int64_t start = ggml_time_ms();
+    llama_context_params params = llama_context_default_params();
+    params.n_ctx = 64;
+    params.n_batch = 64;
+    if (num_threads > 0) {
+      params.n_threads = num_threads;
+      params.n_threads_batch = num_threads;
+    }
+    llama_context *ctx = llama_init_from_model(model, params);
+    if (ctx == nullptr) {
+      return;
+    }
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    llama_token token = llama_vocab_bos(vocab);
+    if (token == LLAMA_TOKEN_NULL) {
+      token = 0;
+    }
+    if (llama_decode(ctx, llama_batch_get_one(&token, 1)) != 0) {
+      PLLAMA_LOG_WARN(nullptr, "Warm-up decode failed.");
+    }
+    llama_free(ctx);
+    PLLAMA_LOG_DEBUG(nullptr, "Warm-up decode took %lld ms.",
+                     (long long)(ggml_time_ms() - start));
+  }
+
+  static bool progressCallback(float progress, void *user_data) {
+    const auto *state = static_cast<std::pair<const pllama_model_progress_fn *,
+                                              bool *> *>(user_data);
+    if ((*state->first)(progress)) {
+      return true;
+    }
+    *state->second = true;
+    return false;
+  }
+
+  static llama_model *loadModel(const std::string &model_path,
+                                int num_gpu_layers,
+                                const pllama_model_progress_fn &progress,
+                                bool *cancelled) {
+    if (!verifyHeader(model_path)) {
+      return nullptr;
+    }
+    RuntimeUse runtime_use;
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = num_gpu_layers;
+    model_params.use_mmap = true;   // Use memory mapping for efficiency
+    model_params.use_mlock = false; // Don't lock memory
+#if defined(__ANDROID__) ||                                                    \
+    (defined(__APPLE__) && (TARGET_OS_IOS || TARGET_IPHONE_SIMULATOR))
+    model_params.n_gpu_layers = 0; // CPU only on mobile
+#endif
+    bool abandoned = false;
+    std::pair<const pllama_model_progress_fn *, bool *> progress_state(
+        &progress, &abandoned);
+    if (progress) {
+      model_params.progress_callback = progressCallback;
+      model_params.progress_callback_user_data = &progress_state;
+    }
+
+    PLLAMA_LOG_INFO(nullptr, "Loading resident model: %s", model_path.c_str());
+    llama_model *model =
+        llama_model_load_from_file(model_path.c_str(), model_params);
+    if (abandoned) {
+      PLLAMA_LOG_INFO(nullptr, "Model load cancelled: %s", model_path.c_str());
+    } else if (model == nullptr) {
+      PLLAMA_LOG_ERROR(nullptr, "Unable to load model: %s", model_path.c_str());
+    }
+    if (cancelled != nullptr) {
+      *cancelled = abandoned;
+    }
+    return model;
+  }
+};
+
+pllama_model_handle *
+pllama_model_acquire(const std::string &model_path, int num_gpu_layers,
+                     const pllama_model_progress_fn &progress,
+                     int num_threads) {
+  return ModelRegistry::getInstance().acquire(model_path, num_gpu_layers,
+                                              progress, num_threads);
+}
+
+pllama_model_handle *pllama_model_find(const std::string &model_path) {
+  return ModelRegistry::getInstance().find(model_path);
+}
+
+void pllama_model_retain(pllama_model_handle *handle) {
+  ModelRegistry::getInstance().retain(handle);
+}
+
+void pllama_model_release(pllama_model_handle *handle) {
+  ModelRegistry::getInstance().release(handle);
+}
+
+bool pllama_model_wait(pllama_model_handle *handle) {
+  return ModelRegistry::getInstance().wait(handle);
+}
+
+extern "C" {
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT pllama_model_handle *
+pllama_model_open(const char *model_path, int num_gpu_layers,
+                  int num_threads) {
+  if (model_path == NULL) {
+    return NULL;
+  }
+  return pllama_model_acquire(model_path, num_gpu_layers, nullptr,
+                              num_threads);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_model_close(pllama_model_handle *handle) {
+  if (handle == NULL) {
+    return;
+  }
+  pllama_model_release(handle);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT pllama_model_handle *
+pllama_model_prefetch(const char *model_path, int num_gpu_layers,
+                      int num_threads) {
+  if (model_path == NULL) {
+    return NULL;
+  }
+  return ModelRegistry::getInstance().prefetch(model_path, num_gpu_layers,
+                                               num_threads);
+}
+} // extern "C"
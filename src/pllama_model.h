@@ -0,0 +1,101 @@
+#ifndef FLLAMA_MODEL_H
+#define FLLAMA_MODEL_H
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+#if _WIN32
+#define FFI_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define FFI_PLUGIN_EXPORT
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Opaque handle to a model kept resident in memory between requests.
+// Handles are refcounted: opening a path that is already resident returns the
+// same handle, and the model is freed when the last reference is closed.
+typedef struct pllama_model_handle pllama_model_handle;
+
+// Loads the model (or reuses the resident copy) and returns a new reference.
+// While loading, num_threads threads fault the tensor data into the page
+// cache in parallel (0 skips this). Returns NULL if the model could not be
+// loaded.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT pllama_model_handle *
+pllama_model_open(const char *model_path, int num_gpu_layers,
+                  int num_threads);
+
+// Drops a reference obtained from pllama_model_open or pllama_model_prefetch.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_model_close(pllama_model_handle *handle);
+
+// Starts loading the model on a background thread and returns a reference
+// right away, so the app can warm a model (ex. while the user is still typing)
+// without blocking. Requests using the handle wait for the load to finish.
+// While loading, num_threads threads fault the tensor data into the page
+// cache in parallel (0 skips this), and once loaded a single-token decode initializes
+// the compute kernels. If the model is already resident or loading, this
+// only adds a reference. Returns NULL if model_path is NULL.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT pllama_model_handle *
+pllama_model_prefetch(const char *model_path, int num_gpu_layers,
+                      int num_threads);
+
+#ifdef __cplusplus
+}
+
+#include <functional>
+#include <memory>
+#include <string>
+
+struct llama_model;
+struct pllama_grammar_cache;
+struct pllama_piece_table;
+
+struct pllama_model_handle {
+  std::string path;
+  int num_gpu_layers = 0;
+  llama_model *model = nullptr;
+  // Rendered text of every vocab token, built right after the load.
+  std::shared_ptr<const pllama_piece_table> pieces;
+  // Grammars compiled against the vocab, shared by requests.
+  std::shared_ptr<pllama_grammar_cache> grammars;
+  int refcount = 0;    // Guarded by the registry mutex.
+  bool loading = true; // True until the load attempt finishes.
+  bool cancelled = false; // The loading caller gave up; waiters retry.
+};
+
+// Receives load progress in [0, 1]. Returning false abandons the load.
+typedef std::function<bool(float)> pllama_model_progress_fn;
+
+// Internal helpers shared by inference, tokenization and the EOS / chat
+// template helpers.
+
+// Returns a new reference, loading the model if it is not resident yet.
+// progress only sees loads started by this call; when another caller is
+// already loading the same model, this waits for that load instead. A load
+// started here is prefaulted by num_threads threads, as with
+// pllama_model_prefetch. Returns nullptr if the load failed or progress
+// returned false.
+pllama_model_handle *
+pllama_model_acquire(const std::string &model_path, int num_gpu_layers,
+                     const pllama_model_progress_fn &progress = nullptr,
+                     int num_threads = 0);
+// Returns a new reference to a resident model with this path, regardless of
+// GPU layer count, or nullptr if none is loaded. Never loads.
+pllama_model_handle *pllama_model_find(const std::string &model_path);
+// Adds a reference to an existing handle.
+void pllama_model_retain(pllama_model_handle *handle);
+// Blocks while a prefetched model is still loading. Returns false if the
+// load failed. Call before touching handle->model of a handle that came from
+// the C API.
+bool pllama_model_wait(pllama_model_handle *handle);
+// Drops a reference, freeing the model when it reaches zero.
+void pllama_model_release(pllama_model_handle *handle);
+#endif
+
+#endif // FLLAMA_MODEL_H
@@ -0,0 +1,292 @@
+#include "pllama_ring.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+
+struct pllama_token_ring {
+  uint32_t token_mask = 0;
+  uint32_t byte_mask = 0;
+  int overflow_policy = PLLAMA_RING_OVERFLOW_WAIT;
+  pllama_ring_entry *entries = nullptr;
+  // Where each entry's bytes start in the ring, counting every byte ever
+  // written; entries carry offsets in the full output instead.
+  uint64_t *positions = nullptr;
+  // byte_mask + 1 bytes, plus PLLAMA_RING_MAX_PIECE of slack so a piece that
+  // starts near the end is written past it instead of wrapping.
+  uint8_t *bytes = nullptr;
+
+  // Producer owned, read by the consumer.
+  alignas(64) std::atomic<uint64_t> write_pos{0};
+  std::atomic<uint64_t> bytes_written{0};
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<bool> done{false};
+  // Bytes of output passed to pllama_ring_write so far, written or not, so
+  // byte_offset matches the request's full output.
+  uint64_t output_pos = 0;
+
+  // Consumer owned, read by the producer.
+  alignas(64) std::atomic<uint64_t> read_pos{0};
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<bool> closed{false};
+
+  // Only used to park a consumer in pllama_ring_wait; the producer takes the
+  // mutex only when it sees a waiter.
+  std::mutex wait_mutex;
+  std::condition_variable wait_cond;
+  std::atomic<bool> consumer_waiting{false};
+};
+
+static uint32_t round_up_pow2(uint32_t n) {
+  uint32_t p = 1;
+  while (p < n && p < (1u << 31)) {
+    p <<= 1;
+  }
+  return p;
+}
+
+static void wake_consumer(pllama_token_ring *ring) {
+  // Orders the cursor store before the waiter check; pairs with the store of
+  // consumer_waiting before the consumer re-checks the cursor.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (ring->consumer_waiting.load()) {
+    std::lock_guard<std::mutex> lock(ring->wait_mutex);
+    ring->wait_cond.notify_all();
+  }
+}
+
+// Whether n_entries entries holding n_bytes in all fit right now.
+static bool has_room(pllama_token_ring *ring, uint64_t n_entries,
+                     uint64_t n_bytes) {
+  const uint64_t write_pos = ring->write_pos.load(std::memory_order_relaxed);
+  const uint64_t bytes_written =
+      ring->bytes_written.load(std::memory_order_relaxed);
+  const uint64_t read_pos = ring->read_pos.load(std::memory_order_acquire);
+  const uint64_t bytes_read = ring->bytes_read.load(std::memory_order_acquire);
+  return write_pos + n_entries - read_pos <= (uint64_t)ring->token_mask + 1 &&
+         bytes_written + n_bytes - bytes_read <= (uint64_t)ring->byte_mask + 1;
+}
+
+// Writes one entry of at most PLLAMA_RING_MAX_PIECE bytes; has_room must
+// have said it fits.
+static void write_entry(pllama_token_ring *ring, int32_t token,
+                        const char *piece, uint32_t len,
+                        uint64_t output_offset) {
+  const uint64_t write_pos = ring->write_pos.load(std::memory_order_relaxed);
+  const uint64_t bytes_written =
+      ring->bytes_written.load(std::memory_order_relaxed);
+  if (len > 0) {
+    std::memcpy(ring->bytes + (bytes_written & ring->byte_mask), piece, len);
+  }
+  const uint32_t slot = (uint32_t)(write_pos & ring->token_mask);
+  pllama_ring_entry &entry = ring->entries[slot];
+  entry.token = token;
+  entry.byte_len = len;
+  entry.byte_offset = output_offset;
+  ring->positions[slot] = bytes_written;
+  ring->bytes_written.store(bytes_written + len, std::memory_order_release);
+  ring->write_pos.store(write_pos + 1, std::memory_order_release);
+}
+
+pllama_ring_write_result
+pllama_ring_write(pllama_token_ring *ring, int32_t token, const char *piece,
+                  uint32_t len, const std::function<bool()> &should_stop) {
+  const uint64_t output_offset = ring->output_pos;
+  ring->output_pos += len;
+
+  // Oversized pieces go out as several entries; only the first carries the
+  // token id. Unless the producer waits, a piece goes in whole or not at
+  // all, so no continuation is left without its start.
+  const uint32_t n_entries =
+      len == 0 ? 1 : (len + PLLAMA_RING_MAX_PIECE - 1) / PLLAMA_RING_MAX_PIECE;
+  if (ring->overflow_policy != PLLAMA_RING_OVERFLOW_WAIT &&
+      !has_room(ring, n_entries, len)) {
+    if (ring->overflow_policy == PLLAMA_RING_OVERFLOW_STOP) {
+      return pllama_ring_write_result::full;
+    }
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return pllama_ring_write_result::dropped;
+  }
+
+  uint32_t written = 0;
+  do {
+    const uint32_t chunk =
+        len - written > PLLAMA_RING_MAX_PIECE ? PLLAMA_RING_MAX_PIECE
+                                              : len - written;
+    while (!has_room(ring, 1, chunk)) {
+      if (ring->closed.load(std::memory_order_acquire) ||
+          (should_stop && should_stop())) {
+        return pllama_ring_write_result::closed;
+      }
+      wake_consumer(ring);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    write_entry(ring, written == 0 ? token : PLLAMA_RING_CONTINUATION,
+                piece + written, chunk, output_offset + written);
+    written += chunk;
+  } while (written < len);
+
+  wake_consumer(ring);
+  return pllama_ring_write_result::written;
+}
+
+void pllama_ring_finish(pllama_token_ring *ring) {
+  ring->done.store(true, std::memory_order_release);
+  wake_consumer(ring);
+}
+
+extern "C" {
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT pllama_token_ring *
+pllama_ring_create(uint32_t token_capacity, uint32_t byte_capacity,
+                   int overflow_policy) {
+  if (token_capacity == 0 || byte_capacity == 0 ||
+      overflow_policy < PLLAMA_RING_OVERFLOW_WAIT ||
+      overflow_policy > PLLAMA_RING_OVERFLOW_STOP) {
+    return NULL;
+  }
+  pllama_token_ring *ring = new (std::nothrow) pllama_token_ring();
+  if (ring == NULL) {
+    return NULL;
+  }
+  token_capacity = round_up_pow2(token_capacity);
+  // Room for at least one full piece, or a waiting producer never fits.
+  byte_capacity = round_up_pow2(byte_capacity < PLLAMA_RING_MAX_PIECE
+                                    ? PLLAMA_RING_MAX_PIECE
+                                    : byte_capacity);
+  ring->token_mask = token_capacity - 1;
+  ring->byte_mask = byte_capacity - 1;
+  ring->overflow_policy = overflow_policy;
+  ring->entries = static_cast<pllama_ring_entry *>(
+      calloc(token_capacity, sizeof(pllama_ring_entry)));
+  ring->positions =
+      static_cast<uint64_t *>(calloc(token_capacity, sizeof(uint64_t)));
+  ring->bytes = static_cast<uint8_t *>(
+      calloc((size_t)byte_capacity + PLLAMA_RING_MAX_PIECE, 1));
+  if (ring->entries == NULL || ring->positions == NULL ||
+      ring->bytes == NULL) {
+    pllama_ring_free(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_ring_free(pllama_token_ring *ring) {
+  if (ring == NULL) {
+    return;
+  }
+  free(ring->entries);
+  free(ring->positions);
+  free(ring->bytes);
+  delete ring;
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_ring_reset(pllama_token_ring *ring) {
+  if (ring == NULL) {
+    return;
+  }
+  ring->write_pos.store(0);
+  ring->bytes_written.store(0);
+  ring->dropped.store(0);
+  ring->done.store(false);
+  ring->output_pos = 0;
+  ring->read_pos.store(0);
+  ring->bytes_read.store(0);
+  ring->closed.store(false);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint32_t
+pllama_ring_peek(pllama_token_ring *ring,
+                 const struct pllama_ring_entry **entries) {
+  if (ring == NULL || entries == NULL) {
+    return 0;
+  }
+  const uint64_t read_pos = ring->read_pos.load(std::memory_order_relaxed);
+  const uint64_t write_pos = ring->write_pos.load(std::memory_order_acquire);
+  const uint32_t start = (uint32_t)(read_pos & ring->token_mask);
+  const uint64_t until_wrap = (uint64_t)ring->token_mask + 1 - start;
+  const uint64_t available = write_pos - read_pos;
+  *entries = ring->entries + start;
+  return (uint32_t)(available < until_wrap ? available : until_wrap);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT const char *
+pllama_ring_piece(pllama_token_ring *ring,
+                  const struct pllama_ring_entry *entry) {
+  if (ring == NULL || entry == NULL || entry < ring->entries ||
+      entry > ring->entries + ring->token_mask) {
+    return NULL;
+  }
+  const uint64_t position = ring->positions[entry - ring->entries];
+  return reinterpret_cast<const char *>(ring->bytes) +
+         (position & ring->byte_mask);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_ring_consume(pllama_token_ring *ring, uint32_t n) {
+  if (ring == NULL || n == 0) {
+    return;
+  }
+  const uint64_t read_pos = ring->read_pos.load(std::memory_order_relaxed);
+  const uint64_t write_pos = ring->write_pos.load(std::memory_order_acquire);
+  if (n > write_pos - read_pos) {
+    n = (uint32_t)(write_pos - read_pos);
+  }
+  if (n == 0) {
+    return;
+  }
+  const uint32_t last = (uint32_t)((read_pos + n - 1) & ring->token_mask);
+  ring->bytes_read.store(ring->positions[last] + ring->entries[last].byte_len,
+                         std::memory_order_release);
+  ring->read_pos.store(read_pos + n, std::memory_order_release);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint32_t
+pllama_ring_wait(pllama_token_ring *ring, int timeout_ms) {
+  if (ring == NULL) {
+    return 0;
+  }
+  auto unread = [ring]() {
+    return ring->write_pos.load(std::memory_order_acquire) -
+           ring->read_pos.load(std::memory_order_relaxed);
+  };
+  auto ready = [ring, &unread]() {
+    return unread() > 0 || ring->done.load(std::memory_order_acquire);
+  };
+  if (!ready()) {
+    std::unique_lock<std::mutex> lock(ring->wait_mutex);
+    ring->consumer_waiting.store(true);
+    if (timeout_ms < 0) {
+      ring->wait_cond.wait(lock, ready);
+    } else {
+      ring->wait_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                               ready);
+    }
+    ring->consumer_waiting.store(false);
+  }
+  return (uint32_t)unread();
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint8_t
+pllama_ring_done(pllama_token_ring *ring) {
+  return ring != NULL && ring->done.load(std::memory_order_acquire);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint64_t
+pllama_ring_dropped(pllama_token_ring *ring) {
+  return ring != NULL ? ring->dropped.load(std::memory_order_relaxed) : 0;
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_ring_close(pllama_token_ring *ring) {
+  if (ring != NULL) {
+    ring->closed.store(true, std::memory_order_release);
+  }
+}
+} // extern "C"
@@ -0,0 +1,135 @@
+#ifndef FLLAMA_RING_H
+#define FLLAMA_RING_H
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+#if _WIN32
+#define FFI_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define FFI_PLUGIN_EXPORT
+#endif
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Single-producer / single-consumer ring of generated tokens and their text,
+// an alternative to per-token callbacks. The host creates it, passes it in
+// pllama_inference_request.token_ring and reads from any thread while the
+// request decodes; nothing is allocated or crossed over FFI per token.
+// Cursors are published with release and read with acquire semantics, so
+// entries and bytes the consumer sees are always complete.
+typedef struct pllama_token_ring pllama_token_ring;
+
+// What the producer does when the ring is full.
+enum pllama_ring_overflow {
+  PLLAMA_RING_OVERFLOW_WAIT = 0, // Pause decoding until the consumer catches
+                                 // up, the ring is closed or the request is
+                                 // cancelled.
+  PLLAMA_RING_OVERFLOW_DROP = 1, // Drop the token, all of its piece, and
+                                 // count it; generation continues.
+  PLLAMA_RING_OVERFLOW_STOP = 2, // End generation as if max_tokens was hit.
+};
+
+// One generated token. Its text is byte_len bytes at
+// pllama_ring_piece(ring, entry), contiguous even across the wrap.
+struct pllama_ring_entry {
+  int32_t token;        // PLLAMA_RING_CONTINUATION or PLLAMA_RING_TAIL
+                        // instead of a token id for text that is not the
+                        // start of one token's piece.
+  uint32_t byte_len;
+  uint64_t byte_offset; // Offset of the piece in the full output; text
+                        // dropped under PLLAMA_RING_OVERFLOW_DROP leaves a
+                        // gap before the next entry.
+};
+
+#define PLLAMA_RING_MAX_PIECE 512
+
+// The rest of a piece that was split because it exceeded
+// PLLAMA_RING_MAX_PIECE bytes.
+#define PLLAMA_RING_CONTINUATION -1
+// Text held back during generation and written once it ended: the start of
+// a stop string that never completed, or a character that was cut off. It
+// belongs to tokens already written. At most one per request, last; it may
+// be followed by continuations of its own.
+#define PLLAMA_RING_TAIL -2
+
+// Capacities are rounded up to powers of two. Returns NULL on bad arguments
+// or allocation failure.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT pllama_token_ring *
+pllama_ring_create(uint32_t token_capacity, uint32_t byte_capacity,
+                   int overflow_policy);
+
+// Only once the request using it has finished (pllama_ring_done is set).
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_ring_free(pllama_token_ring *ring);
+
+// Clears cursors and flags so the ring can serve another request. Only while
+// no request is writing to it.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_ring_reset(pllama_token_ring *ring);
+
+// Consumer side.
+
+// Points *entries at the unread entries that are contiguous in memory and
+// returns how many there are (0 if none). They stay valid until consumed.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint32_t
+pllama_ring_peek(pllama_token_ring *ring,
+                 const struct pllama_ring_entry **entries);
+
+// Text of an entry returned by pllama_ring_peek, not NUL terminated.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT const char *
+pllama_ring_piece(pllama_token_ring *ring,
+                  const struct pllama_ring_entry *entry);
+
+// Releases the first n peeked entries and their bytes to the producer.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_ring_consume(pllama_token_ring *ring, uint32_t n);
+
+// Blocks until entries are available, the request is done, or timeout_ms
+// passes (negative waits indefinitely). Returns the number of unread entries.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint32_t
+pllama_ring_wait(pllama_token_ring *ring, int timeout_ms);
+
+// Set once the request wrote its last entry, whatever the reason it ended.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint8_t
+pllama_ring_done(pllama_token_ring *ring);
+
+// Tokens dropped under PLLAMA_RING_OVERFLOW_DROP.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint64_t
+pllama_ring_dropped(pllama_token_ring *ring);
+
+// Tells a producer waiting under PLLAMA_RING_OVERFLOW_WAIT that nobody will
+// read any more; it stops generating instead.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_ring_close(pllama_token_ring *ring);
+
+#ifdef __cplusplus
+}
+
+#include <functional>
+
+// Producer side, used by the decode loop.
+
+// full: the ring is full under PLLAMA_RING_OVERFLOW_STOP. closed: under
+// PLLAMA_RING_OVERFLOW_WAIT, the ring was closed or should_stop returned
+// true while waiting.
+enum class pllama_ring_write_result { written, dropped, full, closed };
+
+// Appends one token's text. Never allocates. Under the WAIT policy, polls
+// should_stop while the ring is full and gives up when it returns true.
+pllama_ring_write_result
+pllama_ring_write(pllama_token_ring *ring, int32_t token, const char *piece,
+                  uint32_t len, const std::function<bool()> &should_stop);
+
+// Publishes the done flag and wakes the consumer.
+void pllama_ring_finish(pllama_token_ring *ring);
+#endif
+
+#endif // FLLAMA_RING_H
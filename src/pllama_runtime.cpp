@@ -0,0 +1,202 @@
+#include "pllama_runtime.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "ggml-backend.h"
+#include "llama.h"
+#include "pllama_context_pool.h"
+#include "pllama_log.h"
+
+class Runtime {
+public:
+  static Runtime &getInstance() {
+    static Runtime instance;
+    return instance;
+  }
+
+  void init(const pllama_runtime_params &params) {
+    runtime_logger.store(params.logger);
+    std::lock_guard<std::mutex> lock(runtime_mutex);
+    initLocked();
+    if (params.num_threads > 0) {
+      threadpoolLocked(params.num_threads);
+    }
+  }
+
+  void ensureInit() {
+    if (initialized.load(std::memory_order_acquire)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(runtime_mutex);
+    initLocked();
+  }
+
+  bool shutdown() {
+    std::lock_guard<std::mutex> lock(runtime_mutex);
+    if (!initialized.load()) {
+      return true;
+    }
+    // Checked-out contexts hold a threadpool, and loads and warm-ups use the
+    // backend; freeing either under them would leave them dangling.
+    if (users > 0) {
+      PLLAMA_LOG_WARN(nullptr,
+                      "Runtime still in use by %d contexts or model loads; "
+                      "not shutting down.",
+                      users);
+      return false;
+    }
+    // Idle contexts may still have a threadpool attached.
+    pllama_context_evict_idle();
+    for (auto &entry : threadpools) {
+      ggml_threadpool_free(entry.second);
+    }
+    threadpools.clear();
+    llama_backend_free();
+    initialized.store(false, std::memory_order_release);
+    PLLAMA_LOG_DEBUG(nullptr, "Runtime shut down.");
+    return true;
+  }
+
+  void enter() {
+    std::lock_guard<std::mutex> lock(runtime_mutex);
+    initLocked();
+    users++;
+  }
+
+  void leave() {
+    std::lock_guard<std::mutex> lock(runtime_mutex);
+    users--;
+  }
+
+  void setRequestLogger(pllama_log_callback logger) {
+    request_logger.store(logger);
+  }
+
+  ggml_threadpool *threadpool(int n_threads) {
+    ensureInit();
+    std::lock_guard<std::mutex> lock(runtime_mutex);
+    return threadpoolLocked(n_threads);
+  }
+
+private:
+  std::mutex runtime_mutex;
+  std::atomic<bool> initialized{false};
+  bool backends_loaded = false;
+  std::atomic<pllama_log_callback> runtime_logger{nullptr};
+  std::atomic<pllama_log_callback> request_logger{nullptr};
+  std::map<int, ggml_threadpool *> threadpools;
+  // Contexts checked out of the pool plus model loads in flight.
+  int users = 0;
+
+  void initLocked() {
+    if (initialized.load()) {
+      return;
+    }
+    // Installed once; the callback picks the logger per message.
+    llama_log_set(logCallback, this);
+    llama_backend_init();
+    // Backend registration is process-wide and survives shutdown.
+    if (!backends_loaded) {
+      ggml_backend_load_all();
+      backends_loaded = true;
+    }
+    initialized.store(true, std::memory_order_release);
+    PLLAMA_LOG_DEBUG(nullptr, "Runtime initialized.");
+  }
+
+  ggml_threadpool *threadpoolLocked(int n_threads) {
+    if (n_threads <= 0) {
+      return nullptr;
+    }
+    auto it = threadpools.find(n_threads);
+    if (it != threadpools.end()) {
+      return it->second;
+    }
+    ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+    ggml_threadpool *tp = ggml_threadpool_new(&tpp);
+    if (tp == nullptr) {
+      PLLAMA_LOG_ERROR(nullptr, "Unable to create threadpool with %d threads.",
+                       n_threads);
+      return nullptr;
+    }
+    threadpools[n_threads] = tp;
+    return tp;
+  }
+
+  static int pllamaLevel(enum ggml_log_level level) {
+    switch (level) {
+    case GGML_LOG_LEVEL_DEBUG:
+      return PLLAMA_LOG_LEVEL_DEBUG;
+    case GGML_LOG_LEVEL_WARN:
+      return PLLAMA_LOG_LEVEL_WARN;
+    case GGML_LOG_LEVEL_ERROR:
+      return PLLAMA_LOG_LEVEL_ERROR;
+    default:
+      return PLLAMA_LOG_LEVEL_INFO;
+    }
+  }
+
+  // llama.cpp logs go through the same sink as pllama's own: the in-memory
+  // buffer, then the logger or stderr. Messages arrive in pieces, so each
+  // thread collects them into whole lines first.
+  static void logCallback(enum ggml_log_level level, const char *text,
+                          void *user_data) {
+    // Continuations belong to the previous message on this thread.
+    static thread_local int last_level = PLLAMA_LOG_LEVEL_INFO;
+    static thread_local std::string pending;
+    Runtime *runtime = static_cast<Runtime *>(user_data);
+    pllama_log_callback logger = runtime->request_logger.load();
+    if (logger == nullptr) {
+      logger = runtime->runtime_logger.load();
+    }
+    if (level != GGML_LOG_LEVEL_CONT) {
+      // A message that did not end its line is done all the same.
+      if (!pending.empty()) {
+        PLLAMA_LOG(last_level, logger, "[llama] %s", pending.c_str());
+        pending.clear();
+      }
+      last_level = pllamaLevel(level);
+    }
+    if (!pllama_log_enabled(last_level)) {
+      return;
+    }
+    pending += text;
+    size_t start = 0;
+    size_t end;
+    while ((end = pending.find('\n', start)) != std::string::npos) {
+      PLLAMA_LOG(last_level, logger, "[llama] %.*s", (int)(end - start),
+                 pending.data() + start);
+      start = end + 1;
+    }
+    pending.erase(0, start);
+  }
+};
+
+void pllama_runtime_ensure_init() { Runtime::getInstance().ensureInit(); }
+
+void pllama_runtime_enter() { Runtime::getInstance().enter(); }
+
+void pllama_runtime_leave() { Runtime::getInstance().leave(); }
+
+void pllama_runtime_set_request_logger(pllama_log_callback logger) {
+  Runtime::getInstance().setRequestLogger(logger);
+}
+
+ggml_threadpool *pllama_runtime_threadpool(int n_threads) {
+  return Runtime::getInstance().threadpool(n_threads);
+}
+
+extern "C" {
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_runtime_init(struct pllama_runtime_params params) {
+  Runtime::getInstance().init(params);
+}
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint8_t
+pllama_runtime_shutdown(void) {
+  return Runtime::getInstance().shutdown();
+}
+} // extern "C"
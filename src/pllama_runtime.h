@@ -0,0 +1,80 @@
+#ifndef FLLAMA_RUNTIME_H
+#define FLLAMA_RUNTIME_H
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+#if _WIN32
+#define FFI_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define FFI_PLUGIN_EXPORT
+#endif
+
+#include <stdint.h>
+
+#include "pllama.h" // For pllama_log_callback
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct pllama_runtime_params {
+  int num_threads; // Optional: size of the CPU threadpool to create up front.
+                   // 0 creates threadpools lazily, one per thread count used
+                   // by requests.
+  pllama_log_callback logger; // Optional: receives llama.cpp logs when no
+                              // request-specific logger is active. Defaults
+                              // to stderr. They are kept for
+                              // pllama_log_drain either way.
+};
+
+// Process-level setup: backend discovery, llama.cpp logging and the CPU
+// threadpool. Calling it is optional - every entry point initializes the
+// runtime with default params on first use - but doing it once up front
+// keeps that cost off the first request. Repeated calls only update the
+// logger.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT void
+pllama_runtime_init(struct pllama_runtime_params params);
+
+// Releases the threadpools and backend state; a later call to any entry point
+// initializes the runtime again. Refuses and returns 0 while a request holds
+// a context or a model is loading or warming up, including prefetches;
+// returns 1 otherwise.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT uint8_t pllama_runtime_shutdown(void);
+
+#ifdef __cplusplus
+}
+
+struct ggml_threadpool;
+
+// Initializes the runtime with default params if that has not happened yet.
+void pllama_runtime_ensure_init();
+
+// Marks the runtime in use, initializing it if needed, until the matching
+// pllama_runtime_leave; pllama_runtime_shutdown refuses meanwhile.
+void pllama_runtime_enter();
+void pllama_runtime_leave();
+
+// Holds the runtime in use for a scope.
+class RuntimeUse {
+public:
+  RuntimeUse() { pllama_runtime_enter(); }
+  ~RuntimeUse() { pllama_runtime_leave(); }
+  RuntimeUse(const RuntimeUse &) = delete;
+  RuntimeUse &operator=(const RuntimeUse &) = delete;
+};
+
+// Routes llama.cpp logs to logger while a request runs; nullptr restores the
+// runtime logger.
+void pllama_runtime_set_request_logger(pllama_log_callback logger);
+
+// Returns the shared threadpool for n_threads, creating it on first use.
+// Decoding is serialized by the inference queue, so contexts with the same
+// thread count can share one pool. Returns nullptr if none could be created.
+ggml_threadpool *pllama_runtime_threadpool(int n_threads);
+#endif
+
+#endif // FLLAMA_RUNTIME_H
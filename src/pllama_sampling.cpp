@@ -0,0 +1,426 @@
+#include "pllama_sampling.h"
+
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pllama_grammar.h"
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PLLAMA_SAMPLING_NEON 1
+#elif defined(__SSE__) || defined(_M_X64) ||                                   \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define PLLAMA_SAMPLING_SSE 1
+#endif
+
+#if defined(PLLAMA_SAMPLING_NEON) || defined(PLLAMA_SAMPLING_SSE)
+
+// Logits per iteration of the vectorized loops: four registers of four.
+static const int32_t SAMPLING_BLOCK = 16;
+
+// Maximum of x[0, n), n a positive multiple of SAMPLING_BLOCK.
+static float sampling_block_max(const float *x, int32_t n) {
+#if defined(PLLAMA_SAMPLING_NEON)
+  float32x4_t m0 = vld1q_f32(x);
+  float32x4_t m1 = vld1q_f32(x + 4);
+  float32x4_t m2 = vld1q_f32(x + 8);
+  float32x4_t m3 = vld1q_f32(x + 12);
+  for (int32_t i = SAMPLING_BLOCK; i < n; i += SAMPLING_BLOCK) {
+    m0 = vmaxq_f32(m0, vld1q_f32(x + i));
+    m1 = vmaxq_f32(m1, vld1q_f32(x + i + 4));
+    m2 = vmaxq_f32(m2, vld1q_f32(x + i + 8));
+    m3 = vmaxq_f32(m3, vld1q_f32(x + i + 12));
+  }
+  return vmaxvq_f32(vmaxq_f32(vmaxq_f32(m0, m1), vmaxq_f32(m2, m3)));
+#elif defined(PLLAMA_SAMPLING_SSE)
+  __m128 m0 = _mm_loadu_ps(x);
+  __m128 m1 = _mm_loadu_ps(x + 4);
+  __m128 m2 = _mm_loadu_ps(x + 8);
+  __m128 m3 = _mm_loadu_ps(x + 12);
+  for (int32_t i = SAMPLING_BLOCK; i < n; i += SAMPLING_BLOCK) {
+    m0 = _mm_max_ps(m0, _mm_loadu_ps(x + i));
+    m1 = _mm_max_ps(m1, _mm_loadu_ps(x + i + 4));
+    m2 = _mm_max_ps(m2, _mm_loadu_ps(x + i + 8));
+    m3 = _mm_max_ps(m3, _mm_loadu_ps(x + i + 12));
+  }
+  __m128 m = _mm_max_ps(_mm_max_ps(m0, m1), _mm_max_ps(m2, m3));
+  m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+  m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_cvtss_f32(m);
+#endif
+}
+
+// Start of the first block of x[0, n) holding value, or n if none does; n is
+// a multiple of SAMPLING_BLOCK.
+static int32_t sampling_block_find(const float *x, int32_t n, float value) {
+#if defined(PLLAMA_SAMPLING_NEON)
+  const float32x4_t v = vdupq_n_f32(value);
+  for (int32_t i = 0; i < n; i += SAMPLING_BLOCK) {
+    const uint32x4_t eq =
+        vorrq_u32(vorrq_u32(vceqq_f32(vld1q_f32(x + i), v),
+                            vceqq_f32(vld1q_f32(x + i + 4), v)),
+                  vorrq_u32(vceqq_f32(vld1q_f32(x + i + 8), v),
+                            vceqq_f32(vld1q_f32(x + i + 12), v)));
+    if (vmaxvq_u32(eq) != 0) {
+      return i;
+    }
+  }
+  return n;
+#elif defined(PLLAMA_SAMPLING_SSE)
+  const __m128 v = _mm_set1_ps(value);
+  for (int32_t i = 0; i < n; i += SAMPLING_BLOCK) {
+    const __m128 eq =
+        _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(_mm_loadu_ps(x + i), v),
+                            _mm_cmpeq_ps(_mm_loadu_ps(x + i + 4), v)),
+                  _mm_or_ps(_mm_cmpeq_ps(_mm_loadu_ps(x + i + 8), v),
+                            _mm_cmpeq_ps(_mm_loadu_ps(x + i + 12), v)));
+    if (_mm_movemask_ps(eq) != 0) {
+      return i;
+    }
+  }
+  return n;
+#endif
+}
+#endif
+
+llama_token pllama_argmax(const float *logits, int32_t n_vocab) {
+  if (n_vocab <= 0) {
+    return 0;
+  }
+#if defined(PLLAMA_SAMPLING_NEON) || defined(PLLAMA_SAMPLING_SSE)
+  const int32_t n_blocks = n_vocab - n_vocab % SAMPLING_BLOCK;
+  float max = n_blocks > 0 ? sampling_block_max(logits, n_blocks) : logits[0];
+  for (int32_t i = n_blocks; i < n_vocab; i++) {
+    max = logits[i] > max ? logits[i] : max;
+  }
+  // Blocks only say where to look; the scalar scan picks the first token.
+  const int32_t start = sampling_block_find(logits, n_blocks, max);
+  for (int32_t i = start; i < n_vocab; i++) {
+    if (logits[i] == max) {
+      return i;
+    }
+  }
+  return 0; // NaN logits
+#else
+  llama_token best = 0;
+  for (llama_token token = 1; token < n_vocab; token++) {
+    if (logits[token] > logits[best]) {
+      best = token;
+    }
+  }
+  return best;
+#endif
+}
+
+static const char *sampling_greedy_name(const llama_sampler *smpl) {
+  (void)smpl;
+  return "pllama-greedy";
+}
+
+static void sampling_greedy_apply(llama_sampler *smpl,
+                                  llama_token_data_array *cur_p) {
+  (void)smpl;
+  cur_p->selected = 0;
+  for (size_t i = 1; i < cur_p->size; i++) {
+    if (cur_p->data[i].logit > cur_p->data[cur_p->selected].logit) {
+      cur_p->selected = (int64_t)i;
+    }
+  }
+}
+
+static llama_sampler *sampling_greedy_clone(const llama_sampler *smpl) {
+  (void)smpl;
+  return pllama_sampler_init_greedy();
+}
+
+// Stateless: nothing to accept, reset or free.
+static const llama_sampler_i sampling_greedy_iface = {
+    /* .name   = */ sampling_greedy_name,
+    /* .accept = */ nullptr,
+    /* .apply  = */ sampling_greedy_apply,
+    /* .reset  = */ nullptr,
+    /* .clone  = */ sampling_greedy_clone,
+    /* .free   = */ nullptr,
+};
+
+llama_sampler *pllama_sampler_init_greedy() {
+  return new llama_sampler{&sampling_greedy_iface, nullptr};
+}
+
+// A sampler that changes the logits of a few tokens, the ones it lists.
+class SparseLogitStage {
+public:
+  virtual ~SparseLogitStage() = default;
+
+  virtual const char *name() const = 0;
+  virtual void accept(llama_token token) { (void)token; }
+  virtual void reset() {}
+  virtual SparseLogitStage *clone() const = 0;
+
+  // Tokens whose logits change; valid until the next accept or reset.
+  virtual const std::vector<llama_token> &tokens() const = 0;
+  // New logit of tokens()[i], given its current one.
+  virtual float apply(size_t i, float logit) const = 0;
+};
+
+static const char *sampling_sparse_name(const llama_sampler *smpl) {
+  return ((const SparseLogitStage *)smpl->ctx)->name();
+}
+
+static void sampling_sparse_accept(llama_sampler *smpl, llama_token token) {
+  ((SparseLogitStage *)smpl->ctx)->accept(token);
+}
+
+static void sampling_sparse_apply(llama_sampler *smpl,
+                                  llama_token_data_array *cur_p) {
+  const auto *stage = (const SparseLogitStage *)smpl->ctx;
+  const std::vector<llama_token> &tokens = stage->tokens();
+  if (tokens.empty()) {
+    return;
+  }
+  cur_p->sorted = false;
+  // llama_sampler_sample lays the vocab out in token order; only when an
+  // earlier sampler reordered or cut it are the tokens looked up.
+  bool in_order = true;
+  for (llama_token token : tokens) {
+    if (token < 0 || (size_t)token >= cur_p->size ||
+        cur_p->data[token].id != token) {
+      in_order = false;
+      break;
+    }
+  }
+  if (in_order) {
+    for (size_t i = 0; i < tokens.size(); i++) {
+      float &logit = cur_p->data[tokens[i]].logit;
+      logit = stage->apply(i, logit);
+    }
+    return;
+  }
+  std::unordered_map<llama_token, size_t> index;
+  for (size_t i = 0; i < tokens.size(); i++) {
+    index[tokens[i]] = i;
+  }
+  for (size_t j = 0; j < cur_p->size; j++) {
+    const auto found = index.find(cur_p->data[j].id);
+    if (found != index.end()) {
+      cur_p->data[j].logit = stage->apply(found->second, cur_p->data[j].logit);
+    }
+  }
+}
+
+static void sampling_sparse_reset(llama_sampler *smpl) {
+  ((SparseLogitStage *)smpl->ctx)->reset();
+}
+
+static llama_sampler *sampling_sparse_clone(const llama_sampler *smpl);
+
+static void sampling_sparse_free(llama_sampler *smpl) {
+  delete (SparseLogitStage *)smpl->ctx;
+}
+
+static const llama_sampler_i sampling_sparse_iface = {
+    /* .name   = */ sampling_sparse_name,
+    /* .accept = */ sampling_sparse_accept,
+    /* .apply  = */ sampling_sparse_apply,
+    /* .reset  = */ sampling_sparse_reset,
+    /* .clone  = */ sampling_sparse_clone,
+    /* .free   = */ sampling_sparse_free,
+};
+
+static llama_sampler *sampling_sparse_clone(const llama_sampler *smpl) {
+  return new llama_sampler{&sampling_sparse_iface,
+                           ((const SparseLogitStage *)smpl->ctx)->clone()};
+}
+
+// Tokens in the window are a ring; seen lists each distinct one once, with
+// its count in the same slot, and slots finds it there.
+class PenaltyStage : public SparseLogitStage {
+public:
+  PenaltyStage(int32_t last_n, float penalty_repeat, float penalty_freq)
+      : window((size_t)last_n), penalty_repeat(penalty_repeat),
+        penalty_freq(penalty_freq) {}
+
+  const char *name() const override { return "pllama-penalties"; }
+
+  void accept(llama_token token) override {
+    if (window.empty()) {
+      return;
+    }
+    if (n_window == window.size()) {
+      retire(window[head]);
+    } else {
+      n_window++;
+    }
+    window[head] = token;
+    head = (head + 1) % window.size();
+    const auto found = slots.find(token);
+    if (found != slots.end()) {
+      counts[found->second]++;
+    } else {
+      slots[token] = seen.size();
+      seen.push_back(token);
+      counts.push_back(1);
+    }
+  }
+
+  void reset() override {
+    n_window = 0;
+    head = 0;
+    seen.clear();
+    counts.clear();
+    slots.clear();
+  }
+
+  SparseLogitStage *clone() const override { return new PenaltyStage(*this); }
+
+  const std::vector<llama_token> &tokens() const override { return seen; }
+
+  float apply(size_t i, float logit) const override {
+    logit = logit <= 0 ? logit * penalty_repeat : logit / penalty_repeat;
+    return logit - (float)counts[i] * penalty_freq;
+  }
+
+private:
+  std::vector<llama_token> window;
+  size_t n_window = 0;
+  size_t head = 0;
+  std::vector<llama_token> seen;
+  std::vector<int32_t> counts;
+  std::unordered_map<llama_token, size_t> slots;
+  float penalty_repeat;
+  float penalty_freq;
+
+  // Swaps the last slot into one whose count drops to 0.
+  void retire(llama_token token) {
+    const size_t slot = slots[token];
+    if (--counts[slot] > 0) {
+      return;
+    }
+    seen[slot] = seen.back();
+    counts[slot] = counts.back();
+    slots[seen[slot]] = slot;
+    seen.pop_back();
+    counts.pop_back();
+    slots.erase(token);
+  }
+};
+
+llama_sampler *pllama_sampler_init_penalties(int32_t last_n,
+                                             float penalty_repeat,
+                                             float penalty_freq) {
+  return new llama_sampler{
+      &sampling_sparse_iface,
+      new PenaltyStage(last_n > 0 ? last_n : 0, penalty_repeat, penalty_freq)};
+}
+
+// Fixed biases; a token listed more than once gets their sum, and one
+// banned stays banned.
+class BiasStage : public SparseLogitStage {
+public:
+  explicit BiasStage(const std::vector<std::pair<llama_token, float>> &biases) {
+    std::unordered_map<llama_token, size_t> slots;
+    for (const auto &entry : biases) {
+      const auto found = slots.find(entry.first);
+      if (found == slots.end()) {
+        slots[entry.first] = ids.size();
+        ids.push_back(entry.first);
+        amounts.push_back(entry.second);
+      } else {
+        amounts[found->second] += entry.second;
+      }
+    }
+  }
+
+  const char *name() const override { return "pllama-logit-bias"; }
+
+  SparseLogitStage *clone() const override { return new BiasStage(*this); }
+
+  const std::vector<llama_token> &tokens() const override { return ids; }
+
+  float apply(size_t i, float logit) const override {
+    return logit + amounts[i];
+  }
+
+private:
+  std::vector<llama_token> ids;
+  std::vector<float> amounts;
+};
+
+llama_sampler *pllama_sampler_init_logit_bias(
+    const std::vector<std::pair<llama_token, float>> &biases) {
+  return new llama_sampler{&sampling_sparse_iface, new BiasStage(biases)};
+}
+
+// Number of sparse stages if smpl is a chain of sparse stages, then
+// optionally a grammar, then the greedy sampler; -1 otherwise.
+static int sampling_sparse_greedy_stages(const llama_sampler *smpl) {
+  if (strcmp(llama_sampler_name(smpl), "chain") != 0) {
+    return -1;
+  }
+  const int n = llama_sampler_chain_n(smpl);
+  if (n == 0 || llama_sampler_chain_get(smpl, n - 1)->iface !=
+                    &sampling_greedy_iface) {
+    return -1;
+  }
+  int n_sparse = 0;
+  while (n_sparse + 1 < n && llama_sampler_chain_get(smpl, n_sparse)->iface ==
+                                 &sampling_sparse_iface) {
+    n_sparse++;
+  }
+  if (n_sparse + 1 == n ||
+      (n_sparse + 2 == n &&
+       pllama_sampler_is_grammar(llama_sampler_chain_get(smpl, n_sparse)))) {
+    return n_sparse;
+  }
+  return -1;
+}
+
+llama_token pllama_sampler_sample(llama_sampler *smpl, llama_context *ctx,
+                                  int32_t idx) {
+  const bool greedy = smpl->iface == &sampling_greedy_iface;
+  const int n_sparse = greedy ? 0 : sampling_sparse_greedy_stages(smpl);
+  if (n_sparse < 0) {
+    return llama_sampler_sample(smpl, ctx, idx);
+  }
+  const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(ctx));
+  const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+  float *logits = llama_get_logits_ith(ctx, idx);
+  if (greedy) {
+    return pllama_argmax(logits, n_vocab);
+  }
+
+  static thread_local std::vector<std::pair<llama_token, float>> saved;
+  saved.clear();
+  for (int s = 0; s < n_sparse; s++) {
+    const auto *stage =
+        (const SparseLogitStage *)llama_sampler_chain_get(smpl, s)->ctx;
+    const std::vector<llama_token> &tokens = stage->tokens();
+    for (size_t i = 0; i < tokens.size(); i++) {
+      const llama_token token = tokens[i];
+      if (token >= 0 && token < n_vocab) {
+        saved.emplace_back(token, logits[token]);
+        logits[token] = stage->apply(i, logits[token]);
+      }
+    }
+  }
+  // A grammar only looks at the tokens it allows.
+  llama_sampler *grammar = n_sparse + 2 == llama_sampler_chain_n(smpl)
+                               ? llama_sampler_chain_get(smpl, n_sparse)
+                               : nullptr;
+  const llama_token token = grammar != nullptr
+                                ? pllama_grammar_argmax(grammar, logits)
+                                : pllama_argmax(logits, n_vocab);
+  // Backwards, so a token edited twice ends up with its original logit.
+  for (size_t i = saved.size(); i-- > 0;) {
+    logits[saved[i].first] = saved[i].second;
+  }
+  if (token < 0) {
+    // Nothing allowed; leave it to llama.cpp, like any other dead end.
+    return llama_sampler_sample(smpl, ctx, idx);
+  }
+  llama_sampler_accept(smpl, token);
+  return token;
+}
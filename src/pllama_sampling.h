@@ -0,0 +1,49 @@
+#ifndef FLLAMA_SAMPLING_H
+#define FLLAMA_SAMPLING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "llama.h"
+
+// Most likely token, the first one on ties. Vectorized with NEON or SSE
+// where available: two passes over the logits, one for the maximum and one
+// for where it is, each a few instructions per 16 logits.
+llama_token pllama_argmax(const float *logits, int32_t n_vocab);
+
+// Sampler for temperature 0: always the most likely token. Through
+// llama_sampler_sample it behaves like llama_sampler_init_greedy(). Through
+// pllama_sampler_sample it skips llama.cpp's sampling altogether, which
+// builds a candidate array over the whole vocab for every token, and takes
+// pllama_argmax of the logits instead.
+llama_sampler *pllama_sampler_init_greedy();
+
+// Repetition and frequency penalties for tokens among the last last_n
+// accepted, computed like llama_sampler_init_penalties: a token seen n times
+// has its logit divided by penalty_repeat (multiplied if negative), then
+// lowered by n * penalty_freq. Counts are kept incrementally, so accepting a
+// token updates two counts instead of recounting the window, and only
+// tokens with a count are penalized instead of scanning every candidate.
+llama_sampler *pllama_sampler_init_penalties(int32_t last_n,
+                                             float penalty_repeat,
+                                             float penalty_freq);
+
+// Adds a fixed bias to the logits of the tokens in biases, -INFINITY to ban
+// one, like llama_sampler_init_logit_bias. Only the listed tokens are
+// touched, instead of every candidate being checked against the list.
+llama_sampler *pllama_sampler_init_logit_bias(
+    const std::vector<std::pair<llama_token, float>> &biases);
+
+// Samples output idx of the last decode with smpl, like llama_sampler_sample.
+// When smpl is the greedy sampler, or a chain of it following only samplers
+// from this file that change a few logits and optionally a grammar sampler
+// from pllama_grammar.h, the logits are edited in place, their argmax over
+// the tokens the grammar allows taken and the edits undone; no candidate
+// array is built.
+llama_token pllama_sampler_sample(llama_sampler *smpl, llama_context *ctx,
+                                  int32_t idx);
+
+#endif // FLLAMA_SAMPLING_H
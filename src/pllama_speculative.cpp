@@ -0,0 +1,201 @@
+#include "pllama_speculative.h"
+
+#include "pllama_sampling.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+// Vocabs of models in one family may differ by a few trailing added tokens.
+static const int32_t SPECULATIVE_VOCAB_SLACK = 128;
+
+static void speculative_batch_add(llama_batch &batch, llama_token token,
+                                  llama_pos pos, bool logits) {
+  const int32_t i = batch.n_tokens;
+  batch.token[i] = token;
+  batch.pos[i] = pos;
+  batch.n_seq_id[i] = 1;
+  batch.seq_id[i][0] = 0;
+  batch.logits[i] = logits;
+  batch.n_tokens++;
+}
+
+bool pllama_speculative_compatible(const llama_model *target,
+                                   const llama_model *draft) {
+  const llama_vocab *target_vocab = llama_model_get_vocab(target);
+  const llama_vocab *draft_vocab = llama_model_get_vocab(draft);
+  if (target_vocab == nullptr || draft_vocab == nullptr) {
+    return false;
+  }
+  if (llama_vocab_type(target_vocab) != llama_vocab_type(draft_vocab) ||
+      llama_vocab_get_add_bos(target_vocab) !=
+          llama_vocab_get_add_bos(draft_vocab) ||
+      llama_vocab_get_add_eos(target_vocab) !=
+          llama_vocab_get_add_eos(draft_vocab) ||
+      llama_vocab_bos(target_vocab) != llama_vocab_bos(draft_vocab) ||
+      llama_vocab_eos(target_vocab) != llama_vocab_eos(draft_vocab)) {
+    return false;
+  }
+  const int32_t n_target = llama_vocab_n_tokens(target_vocab);
+  const int32_t n_draft = llama_vocab_n_tokens(draft_vocab);
+  return std::abs(n_target - n_draft) <= SPECULATIVE_VOCAB_SLACK;
+}
+
+SpeculativeVerifier::SpeculativeVerifier(int n_draft_max)
+    : batch(llama_batch_init(n_draft_max + 1, 0, 1)),
+      n_draft_max(n_draft_max) {}
+
+SpeculativeVerifier::~SpeculativeVerifier() { llama_batch_free(batch); }
+
+bool SpeculativeVerifier::verify(llama_context *ctx, llama_sampler *smpl,
+                                 llama_token last, llama_pos n_past,
+                                 const std::vector<llama_token> &draft,
+                                 std::vector<llama_token> &accepted) {
+  const size_t n_draft = std::min(draft.size(), (size_t)n_draft_max);
+  batch.n_tokens = 0;
+  speculative_batch_add(batch, last, n_past, true);
+  for (size_t i = 0; i < n_draft; i++) {
+    speculative_batch_add(batch, draft[i], n_past + 1 + (llama_pos)i, true);
+  }
+  if (llama_decode(ctx, batch) != 0) {
+    llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+    return false;
+  }
+
+  accepted.clear();
+  for (size_t i = 0; i <= n_draft; i++) {
+    const llama_token token = pllama_sampler_sample(smpl, ctx, (int32_t)i);
+    accepted.push_back(token);
+    if (i == n_draft || token != draft[i]) {
+      break;
+    }
+  }
+  llama_kv_cache_seq_rm(ctx, 0, n_past + (llama_pos)accepted.size(), -1);
+  return true;
+}
+
+DraftModelProposer::DraftModelProposer(pllama_pooled_context *draft,
+                                       int n_batch)
+    : draft(draft), batch(llama_batch_init(n_batch, 0, 1)), n_batch(n_batch),
+      n_vocab(llama_vocab_n_tokens(llama_model_get_vocab(draft->model))) {}
+
+DraftModelProposer::~DraftModelProposer() { llama_batch_free(batch); }
+
+bool DraftModelProposer::decodePending() {
+  std::vector<llama_token> &cached = draft->tokens;
+  for (size_t start = 0; start < pending.size(); start += n_batch) {
+    const size_t end = std::min(pending.size(), start + (size_t)n_batch);
+    batch.n_tokens = 0;
+    for (size_t i = start; i < end; i++) {
+      speculative_batch_add(batch, pending[i], (llama_pos)cached.size(),
+                            i + 1 == pending.size());
+      cached.push_back(pending[i]);
+    }
+    if (llama_decode(draft->ctx, batch) != 0) {
+      // Cache contents are unknown now; start over next time.
+      llama_kv_cache_seq_rm(draft->ctx, 0, 0, -1);
+      cached.clear();
+      return false;
+    }
+  }
+  pending.clear();
+  return true;
+}
+
+bool DraftModelProposer::propose(const std::vector<llama_token> &history,
+                                 llama_token last, int n_draft,
+                                 std::vector<llama_token> &out) {
+  out.clear();
+  if (n_draft <= 0) {
+    return true;
+  }
+
+  // Bring the draft cache up to history + last, keeping the shared prefix.
+  // At least last is decoded again so its logits are fresh.
+  std::vector<llama_token> &cached = draft->tokens;
+  size_t n_keep = 0;
+  const size_t n_common = std::min(cached.size(), history.size());
+  while (n_keep < n_common && cached[n_keep] == history[n_keep]) {
+    n_keep++;
+  }
+  llama_kv_cache_seq_rm(draft->ctx, 0, (llama_pos)n_keep, -1);
+  cached.resize(n_keep);
+  pending.assign(history.begin() + n_keep, history.end());
+  pending.push_back(last);
+  if (!decodePending()) {
+    return false;
+  }
+
+  const llama_vocab *vocab = llama_model_get_vocab(draft->model);
+  for (int i = 0; i < n_draft; i++) {
+    const llama_token token =
+        pllama_argmax(llama_get_logits_ith(draft->ctx, -1), n_vocab);
+    out.push_back(token);
+    // The last draft is never needed as context; nor is anything past EOG.
+    if (i + 1 == n_draft || llama_vocab_is_eog(vocab, token)) {
+      break;
+    }
+    pending.push_back(token);
+    if (!decodePending()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Key of the n tokens ending at end; the length is mixed in so n-grams of
+// different sizes do not share keys.
+static uint64_t prompt_lookup_key(const llama_token *end, int n) {
+  uint64_t key = (uint64_t)n;
+  for (int i = n; i > 0; i--) {
+    key = key * 0x9E3779B97F4A7C15ull + (uint32_t)end[-i] + 1;
+    key ^= key >> 29;
+  }
+  return key;
+}
+
+PromptLookupProposer::PromptLookupProposer(
+    const std::vector<llama_token> &prompt)
+    : prompt(prompt) {
+  // Only n-grams with at least one token after them; later occurrences
+  // overwrite earlier ones, as recent context is the better guess.
+  index.reserve(prompt.size() * PROMPT_LOOKUP_NGRAM_MAX);
+  for (int n = 1; n <= PROMPT_LOOKUP_NGRAM_MAX; n++) {
+    for (size_t end = n; end < prompt.size(); end++) {
+      index[prompt_lookup_key(prompt.data() + end, n)] = (uint32_t)end;
+    }
+  }
+}
+
+bool PromptLookupProposer::propose(const std::vector<llama_token> &history,
+                                   llama_token last, int n_draft,
+                                   std::vector<llama_token> &out) {
+  out.clear();
+  if (n_draft <= 0) {
+    return true;
+  }
+  llama_token tail[PROMPT_LOOKUP_NGRAM_MAX];
+  int n_tail = 0;
+  for (size_t i = std::min(history.size(),
+                           (size_t)PROMPT_LOOKUP_NGRAM_MAX - 1);
+       i > 0; i--) {
+    tail[n_tail++] = history[history.size() - i];
+  }
+  tail[n_tail++] = last;
+
+  for (int n = n_tail; n > 0; n--) {
+    const llama_token *end = tail + n_tail;
+    const auto found = index.find(prompt_lookup_key(end, n));
+    if (found == index.end()) {
+      continue;
+    }
+    // Keys can collide; check the tokens themselves.
+    const uint32_t start = found->second;
+    if (!std::equal(end - n, end, prompt.begin() + (start - n))) {
+      continue;
+    }
+    const size_t n_copy = std::min((size_t)n_draft, prompt.size() - start);
+    out.assign(prompt.begin() + start, prompt.begin() + start + n_copy);
+    return true;
+  }
+  return true;
+}
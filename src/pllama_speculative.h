@@ -0,0 +1,110 @@
+#ifndef FLLAMA_SPECULATIVE_H
+#define FLLAMA_SPECULATIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+#include "pllama_context_pool.h"
+
+// Speculative decoding: cheaply guessed continuations ("drafts") are checked
+// by the target model in one batched decode instead of one decode per token.
+// Decode of a single sequence is bound by reading the weights, so verifying
+// several positions costs about as much as decoding one.
+//
+// Verification samples the target at every drafted position with the
+// request's own sampler and keeps drafts only while they equal those
+// samples, so the output is exactly what plain decoding with the same
+// sampler would produce; drafts only change how fast it arrives.
+
+// True if draft proposes tokens the target can verify: same tokenizer type,
+// special tokens and (almost) the same vocab.
+bool pllama_speculative_compatible(const llama_model *target,
+                                   const llama_model *draft);
+
+// Decodes a token and the draft following it on the target context in one
+// batch and samples the target after each of them.
+class SpeculativeVerifier {
+public:
+  explicit SpeculativeVerifier(int n_draft_max);
+  ~SpeculativeVerifier();
+
+  SpeculativeVerifier(const SpeculativeVerifier &) = delete;
+  SpeculativeVerifier &operator=(const SpeculativeVerifier &) = delete;
+
+  // last is the sampled token that is not decoded yet, at position n_past.
+  // Replaces accepted with the target's samples: the first
+  // accepted.size() - 1 equal the accepted drafts, the last one is new. The
+  // KV cache then holds last and the accepted drafts; rejected positions are
+  // removed. Returns false if the decode failed.
+  bool verify(llama_context *ctx, llama_sampler *smpl, llama_token last,
+              llama_pos n_past, const std::vector<llama_token> &draft,
+              std::vector<llama_token> &accepted);
+
+private:
+  llama_batch batch;
+  int n_draft_max;
+};
+
+// Guesses the tokens that follow a sequence.
+class DraftProposer {
+public:
+  virtual ~DraftProposer() = default;
+
+  // Proposes up to n_draft tokens following history and then last; history
+  // is everything in the target's KV cache. Returns false on failure; an
+  // empty draft is not a failure.
+  virtual bool propose(const std::vector<llama_token> &history,
+                       llama_token last, int n_draft,
+                       std::vector<llama_token> &draft) = 0;
+};
+
+// Drafts with a smaller model sharing the target's vocab, ex. a 1B model for
+// an 8B one. The draft context follows the target's token history, decoding
+// only what it has not seen yet. Drafts greedily.
+class DraftModelProposer : public DraftProposer {
+public:
+  DraftModelProposer(pllama_pooled_context *draft, int n_batch);
+  ~DraftModelProposer() override;
+
+  DraftModelProposer(const DraftModelProposer &) = delete;
+  DraftModelProposer &operator=(const DraftModelProposer &) = delete;
+
+  bool propose(const std::vector<llama_token> &history, llama_token last,
+               int n_draft, std::vector<llama_token> &draft) override;
+
+private:
+  pllama_pooled_context *draft;
+  llama_batch batch;
+  int n_batch;
+  int32_t n_vocab;
+  std::vector<llama_token> pending;
+
+  // Decodes pending on the draft context; logits for the last one only.
+  bool decodePending();
+};
+
+// Drafts by copying from the prompt: when the last few tokens also occur in
+// the prompt, what followed them there is proposed. Pays off when the output
+// quotes its input, ex. summaries, extraction and code edits, and needs no
+// second model. The index maps every n-gram of the prompt, for n up to
+// PROMPT_LOOKUP_NGRAM_MAX, to where its last occurrence ends.
+class PromptLookupProposer : public DraftProposer {
+public:
+  static constexpr int PROMPT_LOOKUP_NGRAM_MAX = 3;
+
+  explicit PromptLookupProposer(const std::vector<llama_token> &prompt);
+
+  // Prefers the longest n-gram that matches.
+  bool propose(const std::vector<llama_token> &history, llama_token last,
+               int n_draft, std::vector<llama_token> &draft) override;
+
+private:
+  const std::vector<llama_token> &prompt; // Must outlive the proposer.
+  std::unordered_map<uint64_t, uint32_t> index;
+};
+
+#endif // FLLAMA_SPECULATIVE_H
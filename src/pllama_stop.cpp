@@ -0,0 +1,108 @@
+#include "pllama_stop.h"
+
+#include <algorithm>
+#include <queue>
+
+int32_t StopMatcher::add_node(uint32_t depth) {
+  nodes.emplace_back();
+  node &added = nodes.back();
+  std::fill(std::begin(added.next), std::end(added.next), -1);
+  added.depth = depth;
+  return (int32_t)nodes.size() - 1;
+}
+
+void StopMatcher::add_string(const std::string &stop) {
+  if (stop.empty()) {
+    return;
+  }
+  if (nodes.empty()) {
+    add_node(0);
+  }
+  int32_t current = 0;
+  for (const char c : stop) {
+    const unsigned char byte = (unsigned char)c;
+    if (nodes[current].next[byte] < 0) {
+      const int32_t child = add_node(nodes[current].depth + 1);
+      nodes[current].next[byte] = child;
+    }
+    current = nodes[current].next[byte];
+  }
+  nodes[current].match_len = (uint32_t)stop.size();
+}
+
+void StopMatcher::add_token(llama_token token) { stop_tokens.push_back(token); }
+
+void StopMatcher::build() {
+  std::sort(stop_tokens.begin(), stop_tokens.end());
+  stop_tokens.erase(std::unique(stop_tokens.begin(), stop_tokens.end()),
+                    stop_tokens.end());
+  if (nodes.empty()) {
+    return;
+  }
+
+  // Breadth first, so a node's fail target is complete before its children
+  // need it. Missing edges become edges of the fail target, turning the trie
+  // into a DFA: one lookup per byte while matching.
+  std::queue<int32_t> pending;
+  for (int c = 0; c < 256; c++) {
+    int32_t &child = nodes[0].next[c];
+    if (child < 0) {
+      child = 0;
+    } else {
+      nodes[child].fail = 0;
+      pending.push(child);
+    }
+  }
+  while (!pending.empty()) {
+    const int32_t current = pending.front();
+    pending.pop();
+    const int32_t fail = nodes[current].fail;
+    if (nodes[current].match_len == 0) {
+      nodes[current].match_len = nodes[fail].match_len;
+    }
+    for (int c = 0; c < 256; c++) {
+      const int32_t child = nodes[current].next[c];
+      if (child < 0) {
+        nodes[current].next[c] = nodes[fail].next[c];
+      } else {
+        nodes[child].fail = nodes[fail].next[c];
+        pending.push(child);
+      }
+    }
+  }
+}
+
+bool StopMatcher::is_stop_token(llama_token token) const {
+  return std::binary_search(stop_tokens.begin(), stop_tokens.end(), token);
+}
+
+bool StopMatcher::push(const char *text, size_t len, std::string &out) {
+  if (nodes.empty()) {
+    out.append(text, len);
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    state = nodes[state].next[(unsigned char)text[i]];
+    held.push_back(text[i]);
+    const node &current = nodes[state];
+    if (current.match_len > 0) {
+      out.append(held, 0, held.size() - current.match_len);
+      held.clear();
+      state = 0;
+      return true;
+    }
+    // Only the last depth bytes can still begin a stop.
+    if (held.size() > current.depth) {
+      const size_t released = held.size() - current.depth;
+      out.append(held, 0, released);
+      held.erase(0, released);
+    }
+  }
+  return false;
+}
+
+void StopMatcher::flush(std::string &out) {
+  out.append(held);
+  held.clear();
+  state = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef FLLAMA_STOP_H
+#define FLLAMA_STOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// Ends generation at any of a set of stop strings or stop tokens.
+//
+// Strings are matched with an Aho-Corasick automaton over the generated
+// bytes, one byte at a time, so a stop spanning any number of tokens is found
+// at the byte that completes it with no rescanning. Text is passed through
+// push(): bytes that could still turn out to be the start of a stop are held
+// back, so streamed output never contains any part of a stop string.
+class StopMatcher {
+public:
+  StopMatcher() = default;
+
+  // Empty strings are ignored.
+  void add_string(const std::string &stop);
+  void add_token(llama_token token);
+
+  // Builds the automaton; call after adding and before matching.
+  void build();
+
+  bool is_stop_token(llama_token token) const;
+
+  // Appends the text that can no longer be part of a stop to out. Returns
+  // true if a stop string completed: out then ends right before it and the
+  // rest of text is dropped.
+  bool push(const char *text, size_t len, std::string &out);
+
+  // Appends the text still held back, at the end of generation.
+  void flush(std::string &out);
+
+private:
+  struct node {
+    int32_t next[256];
+    int32_t fail = 0;
+    uint32_t depth = 0;
+    // Longest stop that is a suffix of this node's string, 0 if none.
+    uint32_t match_len = 0;
+  };
+
+  std::vector<node> nodes;
+  std::vector<llama_token> stop_tokens; // Sorted after build().
+  int32_t state = 0;
+  std::string held;
+
+  int32_t add_node(uint32_t depth);
+};
+
+#endif // FLLAMA_STOP_H
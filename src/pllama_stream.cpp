@@ -0,0 +1,199 @@
+#include "pllama_stream.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "ggml.h"
+#include "pllama_dart_port.h"
+
+// One thread delivering streamed output for every request, so callbacks never
+// run on the decode thread.
+class StreamDispatcher {
+public:
+  static StreamDispatcher &getInstance() {
+    static StreamDispatcher instance;
+    return instance;
+  }
+
+  // Queues a delivery. Without wait, returns false instead of blocking when
+  // the queue is full.
+  bool post(std::function<void()> task, bool wait) {
+    std::unique_lock<std::mutex> lock(dispatch_mutex);
+    if (queue.size() >= MAX_QUEUED) {
+      if (!wait) {
+        return false;
+      }
+      not_full.wait(lock, [this] { return queue.size() < MAX_QUEUED; });
+    }
+    queue.push_back(std::move(task));
+    not_empty.notify_one();
+    return true;
+  }
+
+private:
+  // Deliveries are coalesced while the queue is full, so this only bounds
+  // how far the consumer may lag.
+  static constexpr size_t MAX_QUEUED = 64;
+
+  std::mutex dispatch_mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::deque<std::function<void()>> queue;
+  bool done = false;
+  std::thread worker;
+
+  StreamDispatcher() : worker(&StreamDispatcher::run, this) {}
+
+  ~StreamDispatcher() {
+    {
+      std::lock_guard<std::mutex> lock(dispatch_mutex);
+      done = true;
+    }
+    not_empty.notify_all();
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  void run() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(dispatch_mutex);
+        not_empty.wait(lock, [this] { return done || !queue.empty(); });
+        if (queue.empty()) {
+          return;
+        }
+        task = std::move(queue.front());
+        queue.pop_front();
+      }
+      not_full.notify_one();
+      task();
+    }
+  }
+};
+
+TokenStream::TokenStream(pllama_inference_callback callback,
+                         pllama_delta_callback delta_callback,
+                         const pllama_stream_options &options)
+    : callback(callback), delta_callback(delta_callback), options(options),
+      last_flush_ms(ggml_time_ms()) {}
+
+TokenStream::~TokenStream() {
+  if (options.async && options.dart_port == 0 && !finished) {
+    drain();
+  }
+}
+
+void TokenStream::push(const std::string &text, int token_index) {
+  last_token_index = token_index;
+  pending_tokens++;
+
+  bool due = options.flush_tokens <= 0 && options.flush_interval_ms <= 0;
+  if (options.flush_tokens > 0 && pending_tokens >= options.flush_tokens) {
+    due = true;
+  }
+  if (options.flush_interval_ms > 0 &&
+      ggml_time_ms() - last_flush_ms >= options.flush_interval_ms) {
+    due = true;
+  }
+  if (due) {
+    flush(text, false);
+  }
+}
+
+void TokenStream::finish(const std::string &text, int n_tokens,
+                         int32_t finish_reason) {
+  if (options.dart_port != 0) {
+    flush(text, true);
+    pllama_dart_post_done(options.dart_port, options.request_id, text.size(),
+                          n_tokens, finish_reason);
+    finished = true;
+    return;
+  }
+  // In full-text mode the caller's final callback carries everything pending.
+  if (delta_callback != NULL) {
+    flush(text, true);
+    pllama_delta_callback delta = delta_callback;
+    const uint64_t total = text.size();
+    auto done = [delta, total, n_tokens]() {
+      delta("", 0, total, n_tokens, true);
+    };
+    if (options.async) {
+      StreamDispatcher::getInstance().post(done, true);
+    } else {
+      done();
+    }
+  }
+  if (options.async) {
+    drain();
+  }
+  finished = true;
+}
+
+bool TokenStream::flush(const std::string &text, bool wait) {
+  if (pending_tokens == 0) {
+    return true;
+  }
+
+  const uint64_t offset = pending_offset;
+  const int32_t token_index = last_token_index;
+  if (options.dart_port != 0) {
+    pllama_dart_post_piece(options.dart_port, options.request_id,
+                           text.data() + offset,
+                           (uint32_t)(text.size() - offset), offset,
+                           token_index);
+  } else if (delta_callback != NULL) {
+    if (!options.async) {
+      delta_callback(text.data() + offset, (uint32_t)(text.size() - offset),
+                     offset, token_index, false);
+    } else {
+      pllama_delta_callback delta = delta_callback;
+      std::string piece = text.substr(offset);
+      auto deliver = [delta, piece, offset, token_index]() {
+        delta(piece.data(), (uint32_t)piece.size(), offset, token_index, false);
+      };
+      if (!StreamDispatcher::getInstance().post(deliver, wait)) {
+        return false;
+      }
+    }
+  } else if (callback != NULL) {
+    if (!options.async) {
+      callback(text.c_str(), false);
+    } else {
+      // Only the new text crosses over; the dispatcher rebuilds the full
+      // text in its own copy, so a flush costs the decode thread the delta,
+      // not the whole output.
+      pllama_inference_callback full = callback;
+      std::shared_ptr<std::string> accumulated = delivered_text;
+      std::string piece = text.substr(offset);
+      auto deliver = [full, accumulated, piece]() {
+        accumulated->append(piece);
+        full(accumulated->c_str(), false);
+      };
+      if (!StreamDispatcher::getInstance().post(deliver, wait)) {
+        return false;
+      }
+    }
+  }
+
+  pending_offset = text.size();
+  pending_tokens = 0;
+  last_flush_ms = ggml_time_ms();
+  return true;
+}
+
+// Queues a marker behind this stream's deliveries and waits for it, so nothing
+// of this request is delivered after the caller moves on.
+void TokenStream::drain() {
+  auto delivered = std::make_shared<std::promise<void>>();
+  std::future<void> done = delivered->get_future();
+  StreamDispatcher::getInstance().post([delivered]() { delivered->set_value(); },
+                                       true);
+  done.wait();
+}
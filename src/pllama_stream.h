@@ -0,0 +1,71 @@
+#ifndef FLLAMA_STREAM_H
+#define FLLAMA_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "pllama.h"
+
+// How generated text reaches the caller's callbacks.
+struct pllama_stream_options {
+  int flush_tokens = 0;      // Deliver after this many tokens; 0 = every token
+                             // unless flush_interval_ms is set.
+  int flush_interval_ms = 0; // Deliver once this long has passed since the
+                             // last delivery; 0 = no time limit.
+  bool async = false;        // Deliver on the dispatcher thread.
+  int64_t dart_port = 0;     // Post pieces to this Dart port instead of
+                             // calling the callbacks. Posting never blocks,
+                             // so async is not needed with it.
+  int request_id = 0;        // Tags port messages.
+};
+
+// Delivers streamed output for one request, coalescing tokens per the
+// options. In async mode deliveries go through a bounded queue drained by a
+// shared dispatcher thread: when the queue is full the text stays pending and
+// is merged into the next delivery, so the decode loop never waits on a slow
+// consumer. Deliveries of one request keep their order.
+class TokenStream {
+public:
+  TokenStream(pllama_inference_callback callback,
+              pllama_delta_callback delta_callback,
+              const pllama_stream_options &options);
+  // Waits until everything already handed to the dispatcher was delivered.
+  ~TokenStream();
+
+  TokenStream(const TokenStream &) = delete;
+  TokenStream &operator=(const TokenStream &) = delete;
+
+  // Called after each token's text was appended to text.
+  void push(const std::string &text, int token_index);
+
+  // Delivers whatever is pending and, in delta or port mode, the final done
+  // message, which in port mode carries finish_reason. Blocks until the
+  // dispatcher is done with this stream. Outside port mode the caller sends
+  // the final full text itself afterwards.
+  void finish(const std::string &text, int n_tokens, int32_t finish_reason);
+
+private:
+  pllama_inference_callback callback;
+  pllama_delta_callback delta_callback;
+  pllama_stream_options options;
+  size_t pending_offset = 0; // Start of the text not delivered yet.
+  int pending_tokens = 0;
+  int last_token_index = -1;
+  int64_t last_flush_ms = 0;
+  bool finished = false;
+  // Async full-text mode: the text delivered so far, only touched by the
+  // dispatcher thread.
+  std::shared_ptr<std::string> delivered_text =
+      std::make_shared<std::string>();
+
+  // Hands pending text to the consumer. With wait set, blocks for room in the
+  // queue instead of keeping the text pending. Returns false if it stayed
+  // pending.
+  bool flush(const std::string &text, bool wait);
+  void drain();
+};
+
+#endif // FLLAMA_STREAM_H
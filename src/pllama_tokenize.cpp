@@ -1,6 +1,7 @@
 #include "pllama_tokenize.h"
 
 // Add these headers at the top
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <memory>
@@ -15,12 +16,8 @@
 
 #include "llama.h"
 #include "ggml.h"
-
-// Modify the logging macro to use a more compatible approach
-#define PLLAMA_LOG(level, message) \
-    do { \
-        std::cerr << "[pllama-tokenize:" << level << "] " << message << std::endl; \
-    } while(0)
+#include "pllama_log.h"
+#include "pllama_runtime.h"
 
 class TokenizerManager {
   public:
@@ -30,16 +27,16 @@ class TokenizerManager {
       static void log(LogLevel level, const std::string& message) {
           switch(level) {
               case LogLevel::ERROR:
-                  PLLAMA_LOG("ERROR", message);
+                  PLLAMA_LOG_ERROR(nullptr, "tokenize: %s", message.c_str());
                   break;
               case LogLevel::WARNING:
-                  PLLAMA_LOG("WARNING", message);
+                  PLLAMA_LOG_WARN(nullptr, "tokenize: %s", message.c_str());
                   break;
               case LogLevel::INFO:
-                  PLLAMA_LOG("INFO", message);
+                  PLLAMA_LOG_INFO(nullptr, "tokenize: %s", message.c_str());
                   break;
               case LogLevel::DEBUG:
-                  PLLAMA_LOG("DEBUG", message);
+                  PLLAMA_LOG_DEBUG(nullptr, "tokenize: %s", message.c_str());
                   break;
           }
       }
@@ -52,6 +49,16 @@ class TokenizerManager {
   
       // Improved model caching with more compatible locking
       std::shared_ptr<llama_model> getOrLoadModel(const std::string& model_path) {
+          // A resident full model already carries the vocab we need.
+          if (pllama_model_handle* resident = pllama_model_find(model_path)) {
+              return std::shared_ptr<llama_model>(
+                  resident->model,
+                  [resident](llama_model*) {
+                      pllama_model_release(resident);
+                  }
+              );
+          }
+
           // Use standard mutex instead of shared_mutex
           std::unique_lock<std::mutex> lock(cache_mutex);
           auto now = std::chrono::steady_clock::now();
@@ -107,25 +114,14 @@ class TokenizerManager {
           mparams.use_mmap = true;
           mparams.n_gpu_layers = 0;
   
-          // Suppress extensive logging
-          llama_log_set(
-              [](enum ggml_log_level level, const char* text, void*) {
-                  if (level >= GGML_LOG_LEVEL_ERROR) {
-                      std::cerr << "[llama-internal] " << text;
-                  }
-              }, 
-              nullptr
-          );
-  
-          // Initialize backend
-          llama_backend_init();
+          // Backend and logging are set up once per process
+          pllama_runtime_ensure_init();
   
           // Load model
           llama_model* raw_model = llama_model_load_from_file(model_path.c_str(), mparams);
           
           if (!raw_model) {
               log(LogLevel::ERROR, "Failed to load model: " + model_path);
-              llama_backend_free();
               return nullptr;
           }
   
@@ -150,7 +146,6 @@ class TokenizerManager {
           };
           total_cached_models++;
   
-          llama_backend_free();
           return model;
       }
   
@@ -169,6 +164,77 @@ class TokenizerManager {
       }
   };
 
+static size_t tokenize_with_model(TokenizerManager& manager,
+                                  const llama_model* model,
+                                  const char* input) {
+    // Get vocabulary
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    if (!vocab) {
+        manager.log(TokenizerManager::LogLevel::ERROR, 
+                    "Failed to retrieve vocabulary from model");
+        return 0;
+    }
+
+    // Validate input length
+    const size_t input_len = strlen(input);
+    if (input_len == 0) {
+        manager.log(TokenizerManager::LogLevel::INFO, 
+                    "Empty input provided for tokenization");
+        return 0;
+    }
+
+    // Allocate token buffer with safe sizing
+    const size_t max_possible_tokens = input_len * 2 + 16;
+    std::vector<llama_token> tokens(max_possible_tokens);
+
+    // First pass: determine required token count
+    const int token_count_needed = -llama_tokenize(
+        vocab, 
+        input, 
+        input_len, 
+        nullptr, 
+        0, 
+        llama_vocab_get_add_bos(vocab), 
+        true
+    );
+
+    if (token_count_needed <= 0) {
+        manager.log(TokenizerManager::LogLevel::WARNING, 
+                    "Tokenization count determination failed");
+        return 0;
+    }
+
+    // Resize buffer if needed
+    if (static_cast<size_t>(token_count_needed) > tokens.size()) {
+        tokens.resize(token_count_needed + 8);
+    }
+
+    // Perform actual tokenization
+    const int n_tokens = llama_tokenize(
+        vocab, 
+        input, 
+        input_len, 
+        tokens.data(), 
+        tokens.size(), 
+        llama_vocab_get_add_bos(vocab), 
+        true
+    );
+
+    if (n_tokens < 0) {
+        manager.log(TokenizerManager::LogLevel::ERROR, 
+                    "Tokenization failed with error code: " + 
+                    std::to_string(n_tokens));
+        return 0;
+    }
+
+    // Log successful tokenization
+    manager.log(TokenizerManager::LogLevel::INFO, 
+                "Successful tokenization: " + 
+                std::to_string(n_tokens) + " tokens");
+
+    return n_tokens;
+}
+
 extern "C" {
 EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT 
 size_t pllama_tokenize(struct pllama_tokenize_request request) {
@@ -190,72 +256,7 @@ size_t pllama_tokenize(struct pllama_tokenize_request request) {
             return 0;
         }
 
-        // Get vocabulary
-        const llama_vocab* vocab = llama_model_get_vocab(model.get());
-        if (!vocab) {
-            manager.log(TokenizerManager::LogLevel::ERROR, 
-                        "Failed to retrieve vocabulary from model");
-            return 0;
-        }
-
-        // Validate input length
-        const size_t input_len = strlen(request.input);
-        if (input_len == 0) {
-            manager.log(TokenizerManager::LogLevel::INFO, 
-                        "Empty input provided for tokenization");
-            return 0;
-        }
-
-        // Allocate token buffer with safe sizing
-        const size_t max_possible_tokens = input_len * 2 + 16;
-        std::vector<llama_token> tokens(max_possible_tokens);
-
-        // First pass: determine required token count
-        const int token_count_needed = -llama_tokenize(
-            vocab, 
-            request.input, 
-            input_len, 
-            nullptr, 
-            0, 
-            llama_vocab_get_add_bos(vocab), 
-            true
-        );
-
-        if (token_count_needed <= 0) {
-            manager.log(TokenizerManager::LogLevel::WARNING, 
-                        "Tokenization count determination failed");
-            return 0;
-        }
-
-        // Resize buffer if needed
-        if (static_cast<size_t>(token_count_needed) > tokens.size()) {
-            tokens.resize(token_count_needed + 8);
-        }
-
-        // Perform actual tokenization
-        const int n_tokens = llama_tokenize(
-            vocab, 
-            request.input, 
-            input_len, 
-            tokens.data(), 
-            tokens.size(), 
-            llama_vocab_get_add_bos(vocab), 
-            true
-        );
-
-        if (n_tokens < 0) {
-            manager.log(TokenizerManager::LogLevel::ERROR, 
-                        "Tokenization failed with error code: " + 
-                        std::to_string(n_tokens));
-            return 0;
-        }
-
-        // Log successful tokenization
-        manager.log(TokenizerManager::LogLevel::INFO, 
-                    "Successful tokenization: " + 
-                    std::to_string(n_tokens) + " tokens");
-
-        return n_tokens;
+        return tokenize_with_model(manager, model.get(), request.input);
     }
     catch (const std::exception& e) {
         manager.log(TokenizerManager::LogLevel::ERROR, 
@@ -269,4 +270,30 @@ size_t pllama_tokenize(struct pllama_tokenize_request request) {
         return 0;
     }
 }
-} // extern "C"
\ No newline at end of file
+
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT
+size_t pllama_model_tokenize(pllama_model_handle* handle, const char* input) {
+    auto& manager = TokenizerManager::getInstance();
+
+    if (!handle || !input || !pllama_model_wait(handle)) {
+        manager.log(TokenizerManager::LogLevel::ERROR,
+                    "Invalid tokenization request: missing model or input");
+        return 0;
+    }
+
+    try {
+        return tokenize_with_model(manager, handle->model, input);
+    }
+    catch (const std::exception& e) {
+        manager.log(TokenizerManager::LogLevel::ERROR,
+                    "Unexpected error during tokenization: " +
+                    std::string(e.what()));
+        return 0;
+    }
+    catch (...) {
+        manager.log(TokenizerManager::LogLevel::ERROR,
+                    "Unknown critical error during tokenization");
+        return 0;
+    }
+}
+} // extern "C"
@@ -16,6 +16,8 @@
 #define FFI_PLUGIN_EXPORT
 #endif
 
+#include "pllama_model.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -28,6 +30,8 @@ struct pllama_tokenize_request
 };
 
 EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT size_t pllama_tokenize(struct pllama_tokenize_request request);
+// Same as above, against an open model instead of a path.
+EMSCRIPTEN_KEEPALIVE FFI_PLUGIN_EXPORT size_t pllama_model_tokenize(pllama_model_handle *handle, const char *input);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "pllama_detokenize.h"
+#include "pllama_test.h"
+
+// Piece table whose token i renders as pieces[i].
+static pllama_piece_table make_table(const std::vector<std::string> &pieces) {
+  pllama_piece_table table;
+  table.offsets.push_back(0);
+  for (const auto &piece : pieces) {
+    table.bytes += piece;
+    table.offsets.push_back((uint32_t)table.bytes.size());
+  }
+  return table;
+}
+
+// Complete characters only, and no truncated one at the end.
+static bool is_valid_utf8(const std::string &text) {
+  for (size_t i = 0; i < text.size();) {
+    const unsigned char c = (unsigned char)text[i];
+    size_t len = 1;
+    if (c >= 0xF0) {
+      len = 4;
+    } else if (c >= 0xE0) {
+      len = 3;
+    } else if (c >= 0xC0) {
+      len = 2;
+    } else if (c >= 0x80) {
+      return false;
+    }
+    if (i + len > text.size()) {
+      return false;
+    }
+    for (size_t j = 1; j < len; j++) {
+      if (((unsigned char)text[i + j] & 0xC0) != 0x80) {
+        return false;
+      }
+    }
+    i += len;
+  }
+  return true;
+}
+
+// Detokenizes tokens 0, 1, ... of table, checking every chunk on its way.
+static std::string detokenize_all(const pllama_piece_table &table) {
+  IncrementalDetokenizer detokenizer(table);
+  std::string out;
+  for (llama_token token = 0; token < table.n_tokens(); token++) {
+    const size_t before = out.size();
+    const size_t appended = detokenizer.push(token, out);
+    PLLAMA_CHECK(appended == out.size() - before);
+    PLLAMA_CHECK(is_valid_utf8(out.substr(before)));
+  }
+  detokenizer.flush(out);
+  return out;
+}
+
+static void test_split_characters() {
+  // é split after its first byte, 😀 split twice.
+  const pllama_piece_table table = make_table(
+      {"h", "\xC3", "\xA9llo ", "\xF0\x9F", "\x98", "\x80!"});
+  IncrementalDetokenizer detokenizer(table);
+  std::string out;
+  PLLAMA_CHECK(detokenizer.push(0, out) == 1);
+  PLLAMA_CHECK(detokenizer.push(1, out) == 0);
+  PLLAMA_CHECK(detokenizer.push(2, out) == 6);
+  PLLAMA_CHECK(out == "h\xC3\xA9llo ");
+  PLLAMA_CHECK(detokenizer.push(3, out) == 0);
+  PLLAMA_CHECK(detokenizer.push(4, out) == 0);
+  PLLAMA_CHECK(detokenizer.push(5, out) == 5);
+  PLLAMA_CHECK(detokenizer.flush(out) == 0);
+  PLLAMA_CHECK(out == "h\xC3\xA9llo \xF0\x9F\x98\x80!");
+}
+
+static void test_truncated_tail() {
+  // Generation ends in the middle of a character: flush still outputs it.
+  const pllama_piece_table table = make_table({"ok ", "\xE2\x82"});
+  IncrementalDetokenizer detokenizer(table);
+  std::string out;
+  detokenizer.push(0, out);
+  PLLAMA_CHECK(detokenizer.push(1, out) == 0);
+  PLLAMA_CHECK(out == "ok ");
+  PLLAMA_CHECK(detokenizer.flush(out) == 2);
+  PLLAMA_CHECK(out == "ok \xE2\x82");
+  PLLAMA_CHECK(detokenizer.flush(out) == 0);
+}
+
+static void test_stray_bytes() {
+  // Continuation bytes with no lead byte can never complete; they are not
+  // held back.
+  const pllama_piece_table table = make_table({"a\x80", "\x80\x80", "b"});
+  IncrementalDetokenizer detokenizer(table);
+  std::string out;
+  PLLAMA_CHECK(detokenizer.push(0, out) == 2);
+  PLLAMA_CHECK(detokenizer.push(1, out) == 2);
+  PLLAMA_CHECK(detokenizer.push(2, out) == 1);
+  PLLAMA_CHECK(out == "a\x80\x80\x80"
+                      "b");
+}
+
+static void test_unknown_tokens() {
+  const pllama_piece_table table = make_table({"x"});
+  size_t len = 1;
+  table.piece(-1, &len);
+  PLLAMA_CHECK(len == 0);
+  table.piece(1, &len);
+  PLLAMA_CHECK(len == 0);
+  IncrementalDetokenizer detokenizer(table);
+  std::string out;
+  PLLAMA_CHECK(detokenizer.push(5, out) == 0);
+  PLLAMA_CHECK(detokenizer.push(0, out) == 1);
+  PLLAMA_CHECK(out == "x");
+}
+
+// Text with 1 to 4 byte characters cut into pieces at random bytes, as a
+// byte-level BPE vocab does.
+static void test_random_splits() {
+  const std::vector<std::string> characters = {
+      "a", " ", "\xC3\xA9", "\xD0\x96", "\xE2\x82\xAC", "\xED\x95\x9C",
+      "\xF0\x9F\x98\x80", "\xF0\x90\x8D\x88"};
+  std::mt19937 rng(7);
+  for (int run = 0; run < 2000; run++) {
+    std::string text;
+    const size_t n_characters = 1 + rng() % 30;
+    for (size_t i = 0; i < n_characters; i++) {
+      text += characters[rng() % characters.size()];
+    }
+    std::vector<std::string> pieces;
+    for (size_t at = 0; at < text.size();) {
+      const size_t len = std::min(text.size() - at, (size_t)(1 + rng() % 5));
+      pieces.push_back(text.substr(at, len));
+      at += len;
+    }
+    PLLAMA_CHECK(detokenize_all(make_table(pieces)) == text);
+  }
+}
+
+int main() {
+  test_split_characters();
+  test_truncated_tail();
+  test_stray_bytes();
+  test_unknown_tokens();
+  test_random_splits();
+  return 0;
+}
@@ -0,0 +1,271 @@
+// Checks that the tokens the grammar sampler allows, computed through the
+// vocab trie and cached per state, are exactly the ones llama.cpp's
+// llama_grammar_apply_impl allows, over a real vocab and in every state
+// reached by a few texts and random walks.
+//
+// Usage: pllama_grammar_test <vocab.gguf>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable : 4244 4267) // possible loss of data
+#endif
+#include "json-schema-to-grammar.h"
+#include "llama.cpp/src/llama-grammar.h"
+#include "pllama_detokenize.h"
+#include "pllama_grammar.h"
+#include "pllama_test.h"
+
+static const char *PERSON_SCHEMA = R"({
+  "type": "object",
+  "properties": {
+    "name": {"type": "string"},
+    "age": {"type": "integer"},
+    "tags": {"type": "array", "items": {"type": "string"}}
+  },
+  "required": ["name", "age"],
+  "additionalProperties": false
+})";
+
+struct grammar_test {
+  const llama_vocab *vocab = nullptr;
+  int32_t n_vocab = 0;
+  std::shared_ptr<const pllama_piece_table> pieces;
+  std::shared_ptr<pllama_grammar_cache> cache;
+  std::vector<llama_token_data> cur;
+  // States checked that were partway through a UTF-8 character, and that
+  // allowed ending generation.
+  int partial_states = 0;
+  int eog_states = 0;
+};
+
+// Sampler and reference grammar for text, a GBNF grammar or a JSON schema.
+struct grammar_pair {
+  llama_sampler *smpl = nullptr;
+  llama_grammar *reference = nullptr;
+
+  grammar_pair(grammar_test &t, const std::string &text, bool schema) {
+    smpl = schema ? pllama_sampler_init_json_schema(t.cache, text.c_str())
+                  : pllama_sampler_init_grammar(t.cache, text.c_str());
+    const std::string gbnf =
+        schema ? json_schema_to_grammar(nlohmann::ordered_json::parse(text))
+               : text;
+    reference = llama_grammar_init_impl(t.vocab, gbnf.c_str(), "root");
+    PLLAMA_CHECK(smpl != nullptr);
+    PLLAMA_CHECK(reference != nullptr);
+  }
+
+  ~grammar_pair() {
+    llama_sampler_free(smpl);
+    llama_grammar_free_impl(reference);
+  }
+
+  void accept(llama_token token) {
+    llama_sampler_accept(smpl, token);
+    llama_grammar_accept_impl(*reference, token);
+  }
+};
+
+static void fill_candidates(grammar_test &t, llama_token_data_array &cur_p) {
+  t.cur.resize((size_t)t.n_vocab);
+  for (llama_token token = 0; token < t.n_vocab; token++) {
+    t.cur[token] = llama_token_data{token, 0.0f, 0.0f};
+  }
+  cur_p = {t.cur.data(), t.cur.size(), -1, false};
+}
+
+static std::vector<llama_token>
+allowed_by(const llama_token_data_array &cur_p) {
+  std::vector<llama_token> allowed;
+  for (size_t i = 0; i < cur_p.size; i++) {
+    if (!std::isinf(cur_p.data[i].logit)) {
+      allowed.push_back(cur_p.data[i].id);
+    }
+  }
+  std::sort(allowed.begin(), allowed.end());
+  return allowed;
+}
+
+// Compares both ways of masking the current state and returns the allowed
+// tokens.
+static std::vector<llama_token> check_state(grammar_test &t,
+                                            grammar_pair &pair) {
+  llama_token_data_array cur_p;
+  fill_candidates(t, cur_p);
+  llama_grammar_apply_impl(*pair.reference, &cur_p);
+  const std::vector<llama_token> expected = allowed_by(cur_p);
+
+  fill_candidates(t, cur_p);
+  llama_sampler_apply(pair.smpl, &cur_p);
+  PLLAMA_CHECK(allowed_by(cur_p) == expected);
+
+  // The greedy fast path reads the same mask.
+  std::vector<float> logits((size_t)t.n_vocab, 0.0f);
+  const llama_token best = pllama_grammar_argmax(pair.smpl, logits.data());
+  PLLAMA_CHECK(best == (expected.empty() ? -1 : expected.front()));
+
+  if (pair.reference->partial_utf8.n_remain != 0) {
+    t.partial_states++;
+  }
+  for (llama_token token : expected) {
+    if (llama_vocab_is_eog(t.vocab, token)) {
+      t.eog_states++;
+      break;
+    }
+  }
+  return expected;
+}
+
+static bool allows_eog(const grammar_test &t,
+                       const std::vector<llama_token> &allowed) {
+  for (llama_token token : allowed) {
+    if (llama_vocab_is_eog(t.vocab, token)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static std::vector<llama_token> tokenize(const grammar_test &t,
+                                         const std::string &text) {
+  std::vector<llama_token> tokens(text.size() + 1);
+  const int32_t n =
+      llama_tokenize(t.vocab, text.data(), (int32_t)text.size(), tokens.data(),
+                     (int32_t)tokens.size(), false, false);
+  PLLAMA_CHECK(n >= 0);
+  tokens.resize((size_t)n);
+  return tokens;
+}
+
+// Feeds text token by token. Returns the index of the first token the
+// grammar rejects, or -1 if it accepts all of them and may end there.
+static int walk_text(grammar_test &t, const std::string &grammar, bool schema,
+                     const std::string &text) {
+  grammar_pair pair(t, grammar, schema);
+  const std::vector<llama_token> tokens = tokenize(t, text);
+  for (size_t i = 0; i < tokens.size(); i++) {
+    const std::vector<llama_token> allowed = check_state(t, pair);
+    if (!std::binary_search(allowed.begin(), allowed.end(), tokens[i])) {
+      return (int)i;
+    }
+    pair.accept(tokens[i]);
+  }
+  PLLAMA_CHECK(allows_eog(t, check_state(t, pair)));
+  return -1;
+}
+
+// True if the token's text ends partway through a UTF-8 character.
+static bool ends_partial(const grammar_test &t, llama_token token) {
+  size_t len = 0;
+  const char *text = t.pieces->piece(token, &len);
+  for (size_t i = 1; i <= 4 && i <= len; i++) {
+    const unsigned char c = (unsigned char)text[len - i];
+    if ((c & 0xC0) == 0x80) {
+      continue;
+    }
+    const size_t expected = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return expected > i;
+  }
+  return false;
+}
+
+// Generates by picking allowed tokens at random, half the time one ending in
+// a partial character when there is one, until only ending is allowed.
+static void walk_random(grammar_test &t, const std::string &grammar,
+                        bool schema, uint32_t seed, int max_steps) {
+  std::mt19937 rng(seed);
+  grammar_pair pair(t, grammar, schema);
+  for (int step = 0; step < max_steps; step++) {
+    std::vector<llama_token> allowed = check_state(t, pair);
+    allowed.erase(std::remove_if(allowed.begin(), allowed.end(),
+                                 [&t](llama_token token) {
+                                   return llama_vocab_is_eog(t.vocab, token);
+                                 }),
+                  allowed.end());
+    if (allowed.empty()) {
+      return;
+    }
+    std::vector<llama_token> partial;
+    for (llama_token token : allowed) {
+      if (ends_partial(t, token)) {
+        partial.push_back(token);
+      }
+    }
+    const std::vector<llama_token> &from =
+        !partial.empty() && rng() % 2 == 0 ? partial : allowed;
+    pair.accept(from[rng() % from.size()]);
+  }
+}
+
+static void test_grammars(grammar_test &t) {
+  const std::string yes_no = "root ::= \"yes\" | \"no\"";
+  PLLAMA_CHECK(walk_text(t, yes_no, false, "yes") == -1);
+  PLLAMA_CHECK(walk_text(t, yes_no, false, "maybe") == 0);
+
+  const std::string list = "root ::= \"[\" item (\",\" \" \"? item)* \"]\"\n"
+                           "item ::= [0-9]+ | \"\\\"\" [a-z ]* \"\\\"\"\n";
+  PLLAMA_CHECK(walk_text(t, list, false, "[12, \"ab c\",7]") == -1);
+  PLLAMA_CHECK(walk_text(t, list, false, "[12,,7]") > 0);
+  walk_random(t, list, false, 1, 48);
+
+  // Characters of 2 to 4 bytes, which byte-level vocabs split across tokens.
+  const std::string utf8 =
+      "root ::= \"h\\u00e9llo \" [\\uac00-\\ud7a3]+ \" \" [\\U0001F600-"
+      "\\U0001F64F]* \"!\"";
+  PLLAMA_CHECK(walk_text(t, utf8, false,
+                         "h\xC3\xA9llo \xED\x95\x9C\xEA\xB5\xAD\xEC\x96\xB4 "
+                         "\xF0\x9F\x98\x80!") == -1);
+  for (uint32_t seed = 0; seed < 3; seed++) {
+    walk_random(t, utf8, false, seed, 32);
+  }
+}
+
+static void test_json_schema(grammar_test &t) {
+  PLLAMA_CHECK(walk_text(t, PERSON_SCHEMA, true,
+                         "{\"name\": \"Ada\", \"age\": 36}") == -1);
+  PLLAMA_CHECK(walk_text(t, PERSON_SCHEMA, true,
+                         "{\"name\": \"Ada\", \"age\": 36, \"tags\": "
+                         "[\"math\", \"engines\"]}") == -1);
+  // A string where the schema wants an integer, and a missing property.
+  PLLAMA_CHECK(walk_text(t, PERSON_SCHEMA, true,
+                         "{\"name\": \"Ada\", \"age\": \"36\"}") > 0);
+  PLLAMA_CHECK(walk_text(t, PERSON_SCHEMA, true, "{\"name\": \"Ada\"}") > 0);
+  walk_random(t, PERSON_SCHEMA, true, 7, 48);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <vocab.gguf>\n", argv[0]);
+    return 1;
+  }
+  llama_backend_init();
+  llama_model_params params = llama_model_default_params();
+  params.vocab_only = true;
+  llama_model *model = llama_model_load_from_file(argv[1], params);
+  PLLAMA_CHECK(model != nullptr);
+
+  grammar_test t;
+  t.vocab = llama_model_get_vocab(model);
+  t.n_vocab = llama_vocab_n_tokens(t.vocab);
+  t.pieces = pllama_piece_table_build(model);
+  t.cache = pllama_grammar_cache_create(model, t.pieces);
+  PLLAMA_CHECK(t.pieces != nullptr);
+  PLLAMA_CHECK(t.cache != nullptr);
+
+  // Twice: the second time, the masks of states seen come from the cache.
+  for (int pass = 0; pass < 2; pass++) {
+    test_grammars(t);
+    test_json_schema(t);
+  }
+  PLLAMA_CHECK(t.partial_states > 0);
+  PLLAMA_CHECK(t.eog_states > 0);
+
+  t.cache.reset();
+  llama_model_free(model);
+  llama_backend_free();
+  return 0;
+}
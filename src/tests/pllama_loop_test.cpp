@@ -0,0 +1,126 @@
+#include <random>
+#include <vector>
+
+#include "pllama_loop.h"
+#include "pllama_test.h"
+
+// Shortest period p <= window / min_repeats such that each of the last window
+// tokens equals the one p before it, or 0.
+static int32_t naive_period(const std::vector<llama_token> &tokens,
+                            int32_t window, int32_t min_repeats) {
+  const int32_t n = (int32_t)tokens.size();
+  if (window <= 0 || min_repeats < 2 || n < window) {
+    return 0;
+  }
+  for (int32_t p = 1; p <= window / min_repeats; p++) {
+    bool periodic = true;
+    for (int32_t i = n - window + p; i < n && periodic; i++) {
+      periodic = tokens[i] == tokens[i - p];
+    }
+    if (periodic) {
+      return p;
+    }
+  }
+  return 0;
+}
+
+static void test_periods() {
+  // "1 2 3" three times fills a window of 9.
+  LoopDetector detector(9, 3);
+  const llama_token block[] = {1, 2, 3};
+  for (int i = 0; i < 8; i++) {
+    PLLAMA_CHECK(!detector.push(block[i % 3]));
+  }
+  PLLAMA_CHECK(detector.push(block[8 % 3]));
+  PLLAMA_CHECK(detector.period() == 3);
+
+  // The shortest block is reported: 7 7 7 7 is period 1, not 2.
+  LoopDetector repeated(4, 2);
+  for (int i = 0; i < 3; i++) {
+    PLLAMA_CHECK(!repeated.push(7));
+  }
+  PLLAMA_CHECK(repeated.push(7));
+  PLLAMA_CHECK(repeated.period() == 1);
+
+  // The last repetition may be cut short: 1 2 3 1 2 3 1 2 has period 3.
+  LoopDetector partial(8, 2);
+  bool found = false;
+  for (int i = 0; i < 8; i++) {
+    found = partial.push(block[i % 3]);
+  }
+  PLLAMA_CHECK(found);
+  PLLAMA_CHECK(partial.period() == 3);
+
+  // Too few repeats for the window: a period of 5 needs a window of 15.
+  LoopDetector long_block(14, 3);
+  for (int i = 0; i < 100; i++) {
+    PLLAMA_CHECK(!long_block.push(i % 5));
+  }
+}
+
+static void test_disabled() {
+  LoopDetector off(0, 3);
+  LoopDetector one_repeat(16, 1);
+  for (int i = 0; i < 100; i++) {
+    PLLAMA_CHECK(!off.push(1));
+    PLLAMA_CHECK(!one_repeat.push(1));
+  }
+}
+
+// A loop that starts long after the first window, so the rings have wrapped
+// many times over.
+static void test_late_loop() {
+  LoopDetector detector(32, 4);
+  std::mt19937 rng(3);
+  for (int i = 0; i < 10000; i++) {
+    PLLAMA_CHECK(!detector.push(100 + (llama_token)(rng() % 1000)));
+  }
+  const llama_token block[] = {5, 6, 7, 8, 9, 10};
+  int pushed = 0;
+  while (!detector.push(block[pushed % 6])) {
+    pushed++;
+    PLLAMA_CHECK(pushed < 32);
+  }
+  PLLAMA_CHECK(pushed + 1 == 32);
+  PLLAMA_CHECK(detector.period() == 6);
+}
+
+// Random windows and token streams over small alphabets, with tokens copied
+// from a few back often enough that loops form.
+static void test_against_naive() {
+  std::mt19937 rng(11);
+  int loops = 0;
+  for (int run = 0; run < 3000; run++) {
+    const int32_t window = 1 + (int32_t)(rng() % 40);
+    const int32_t min_repeats = (int32_t)(rng() % 5);
+    const uint32_t alphabet = 1 + rng() % 4;
+    LoopDetector detector(window, min_repeats);
+    std::vector<llama_token> tokens;
+    for (int step = 0; step < 200; step++) {
+      llama_token token = (llama_token)(rng() % alphabet);
+      if (tokens.size() > 5 && rng() % 3 == 0) {
+        token = tokens[tokens.size() - 1 - rng() % 5];
+      } else if (rng() % 7 == 0) {
+        token = -1; // Any id hashes, even negative ones.
+      }
+      tokens.push_back(token);
+      const bool found = detector.push(token);
+      const int32_t expected = naive_period(tokens, window, min_repeats);
+      PLLAMA_CHECK(found == (expected > 0));
+      if (found) {
+        PLLAMA_CHECK(detector.period() == expected);
+        loops++;
+        break;
+      }
+    }
+  }
+  PLLAMA_CHECK(loops > 0);
+}
+
+int main() {
+  test_periods();
+  test_disabled();
+  test_late_loop();
+  test_against_naive();
+  return 0;
+}
@@ -0,0 +1,253 @@
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pllama_ring.h"
+#include "pllama_test.h"
+
+static pllama_ring_write_result write(pllama_token_ring *ring, int32_t token,
+                                      const std::string &piece) {
+  return pllama_ring_write(ring, token, piece.data(), (uint32_t)piece.size(),
+                           nullptr);
+}
+
+// Reads everything unread, checking that entries follow on from each other
+// in the output. Appends their tokens and text.
+static void drain(pllama_token_ring *ring, uint64_t &offset,
+                  std::vector<int32_t> &tokens, std::string &text) {
+  const pllama_ring_entry *entries = nullptr;
+  uint32_t n = 0;
+  while ((n = pllama_ring_peek(ring, &entries)) > 0) {
+    for (uint32_t i = 0; i < n; i++) {
+      PLLAMA_CHECK(entries[i].byte_offset == offset);
+      offset += entries[i].byte_len;
+      tokens.push_back(entries[i].token);
+      text.append(pllama_ring_piece(ring, &entries[i]), entries[i].byte_len);
+    }
+    pllama_ring_consume(ring, n);
+  }
+}
+
+static void test_create() {
+  PLLAMA_CHECK(pllama_ring_create(0, 1024, PLLAMA_RING_OVERFLOW_WAIT) ==
+               NULL);
+  PLLAMA_CHECK(pllama_ring_create(8, 0, PLLAMA_RING_OVERFLOW_WAIT) == NULL);
+  PLLAMA_CHECK(pllama_ring_create(8, 1024, 3) == NULL);
+  PLLAMA_CHECK(pllama_ring_create(8, 1024, -1) == NULL);
+
+  // 5 tokens round up to 8.
+  pllama_token_ring *ring =
+      pllama_ring_create(5, 1024, PLLAMA_RING_OVERFLOW_STOP);
+  PLLAMA_CHECK(ring != NULL);
+  for (int32_t token = 0; token < 8; token++) {
+    PLLAMA_CHECK(write(ring, token, "x") == pllama_ring_write_result::written);
+  }
+  PLLAMA_CHECK(write(ring, 8, "x") == pllama_ring_write_result::full);
+  pllama_ring_free(ring);
+  pllama_ring_free(NULL);
+}
+
+// Few slots and the smallest byte buffer, so both cursors wrap hundreds of
+// times and pieces often straddle the end of the buffer.
+static void test_wraparound() {
+  pllama_token_ring *ring = pllama_ring_create(4, 1, PLLAMA_RING_OVERFLOW_STOP);
+  std::mt19937 rng(5);
+  std::string expected_text;
+  std::vector<int32_t> expected_tokens;
+  std::string text;
+  std::vector<int32_t> tokens;
+  uint64_t offset = 0;
+  int32_t token = 0;
+  for (int round = 0; round < 2000; round++) {
+    const uint32_t n_writes = 1 + rng() % 4;
+    // A piece that did not fit still counts in the output offset.
+    uint64_t skipped = 0;
+    for (uint32_t i = 0; i < n_writes; i++) {
+      std::string piece(rng() % 200, 'a' + (char)(token % 26));
+      const pllama_ring_write_result result = write(ring, token, piece);
+      if (result == pllama_ring_write_result::full) {
+        skipped = piece.size();
+        break;
+      }
+      PLLAMA_CHECK(result == pllama_ring_write_result::written);
+      expected_tokens.push_back(token);
+      expected_text += piece;
+      token++;
+    }
+    drain(ring, offset, tokens, text);
+    offset += skipped;
+  }
+  PLLAMA_CHECK(tokens == expected_tokens);
+  PLLAMA_CHECK(text == expected_text);
+  PLLAMA_CHECK(token > 2000);
+  pllama_ring_free(ring);
+}
+
+static void test_long_piece() {
+  pllama_token_ring *ring =
+      pllama_ring_create(8, 2048, PLLAMA_RING_OVERFLOW_STOP);
+  const std::string piece(2 * PLLAMA_RING_MAX_PIECE + 100, 'z');
+  PLLAMA_CHECK(write(ring, 42, piece) == pllama_ring_write_result::written);
+  std::vector<int32_t> tokens;
+  std::string text;
+  uint64_t offset = 0;
+  drain(ring, offset, tokens, text);
+  PLLAMA_CHECK(tokens == std::vector<int32_t>({42, PLLAMA_RING_CONTINUATION,
+                                               PLLAMA_RING_CONTINUATION}));
+  PLLAMA_CHECK(text == piece);
+  pllama_ring_free(ring);
+}
+
+static void test_overflow_drop() {
+  pllama_token_ring *ring =
+      pllama_ring_create(2, 1024, PLLAMA_RING_OVERFLOW_DROP);
+  PLLAMA_CHECK(write(ring, 1, "a") == pllama_ring_write_result::written);
+  PLLAMA_CHECK(write(ring, 2, "b") == pllama_ring_write_result::written);
+  PLLAMA_CHECK(write(ring, 3, "c") == pllama_ring_write_result::dropped);
+  PLLAMA_CHECK(write(ring, 4, "d") == pllama_ring_write_result::dropped);
+  PLLAMA_CHECK(pllama_ring_dropped(ring) == 2);
+
+  std::vector<int32_t> tokens;
+  std::string text;
+  uint64_t offset = 0;
+  drain(ring, offset, tokens, text);
+  PLLAMA_CHECK(write(ring, 5, "e") == pllama_ring_write_result::written);
+  offset += 2; // "cd" was dropped, but still counts in the output offset.
+  drain(ring, offset, tokens, text);
+  PLLAMA_CHECK(tokens == std::vector<int32_t>({1, 2, 5}));
+  PLLAMA_CHECK(text == "abe");
+
+  pllama_ring_reset(ring);
+  PLLAMA_CHECK(pllama_ring_dropped(ring) == 0);
+  const pllama_ring_entry *entries = nullptr;
+  PLLAMA_CHECK(pllama_ring_peek(ring, &entries) == 0);
+  pllama_ring_free(ring);
+}
+
+// A piece split into several entries is dropped whole when they do not all
+// fit, or stops generation before any of it is written.
+static void test_overflow_long_piece() {
+  const std::string piece(2 * PLLAMA_RING_MAX_PIECE + 1, 'z');
+  pllama_token_ring *ring =
+      pllama_ring_create(4, 4096, PLLAMA_RING_OVERFLOW_DROP);
+  PLLAMA_CHECK(write(ring, 1, "a") == pllama_ring_write_result::written);
+  PLLAMA_CHECK(write(ring, 2, "b") == pllama_ring_write_result::written);
+  PLLAMA_CHECK(write(ring, 3, piece) == pllama_ring_write_result::dropped);
+  PLLAMA_CHECK(pllama_ring_dropped(ring) == 1);
+  std::vector<int32_t> tokens;
+  std::string text;
+  uint64_t offset = 0;
+  drain(ring, offset, tokens, text);
+  PLLAMA_CHECK(write(ring, 4, piece) == pllama_ring_write_result::written);
+  offset += piece.size();
+  drain(ring, offset, tokens, text);
+  PLLAMA_CHECK(tokens ==
+               std::vector<int32_t>({1, 2, 4, PLLAMA_RING_CONTINUATION,
+                                     PLLAMA_RING_CONTINUATION}));
+  PLLAMA_CHECK(text == "ab" + piece);
+  pllama_ring_free(ring);
+
+  ring = pllama_ring_create(4, 4096, PLLAMA_RING_OVERFLOW_STOP);
+  PLLAMA_CHECK(write(ring, 1, "a") == pllama_ring_write_result::written);
+  PLLAMA_CHECK(write(ring, 2, "b") == pllama_ring_write_result::written);
+  PLLAMA_CHECK(write(ring, 3, piece) == pllama_ring_write_result::full);
+  tokens.clear();
+  text.clear();
+  offset = 0;
+  drain(ring, offset, tokens, text);
+  PLLAMA_CHECK(tokens == std::vector<int32_t>({1, 2}));
+  pllama_ring_free(ring);
+}
+
+static void test_overflow_wait() {
+  pllama_token_ring *ring =
+      pllama_ring_create(1, 1024, PLLAMA_RING_OVERFLOW_WAIT);
+  PLLAMA_CHECK(write(ring, 1, "a") == pllama_ring_write_result::written);
+  // Full: the producer gives up when asked to stop, or once closed.
+  int polls = 0;
+  PLLAMA_CHECK(pllama_ring_write(ring, 2, "b", 1, [&polls] {
+                 return ++polls == 3;
+               }) == pllama_ring_write_result::closed);
+  PLLAMA_CHECK(polls == 3);
+  pllama_ring_close(ring);
+  PLLAMA_CHECK(write(ring, 2, "b") == pllama_ring_write_result::closed);
+  PLLAMA_CHECK(pllama_ring_dropped(ring) == 0);
+  pllama_ring_free(ring);
+}
+
+static void test_wait_and_done() {
+  pllama_token_ring *ring =
+      pllama_ring_create(4, 1024, PLLAMA_RING_OVERFLOW_WAIT);
+  PLLAMA_CHECK(pllama_ring_wait(ring, 1) == 0);
+  PLLAMA_CHECK(!pllama_ring_done(ring));
+  write(ring, 1, "a");
+  PLLAMA_CHECK(pllama_ring_wait(ring, -1) == 1);
+  pllama_ring_finish(ring);
+  PLLAMA_CHECK(pllama_ring_done(ring));
+  pllama_ring_reset(ring);
+  PLLAMA_CHECK(!pllama_ring_done(ring));
+  PLLAMA_CHECK(pllama_ring_wait(ring, 0) == 0);
+  pllama_ring_free(ring);
+}
+
+// A producer on its own thread outpacing a consumer that waits, with a piece
+// now and then split for exceeding PLLAMA_RING_MAX_PIECE.
+static void test_threads() {
+  pllama_token_ring *ring =
+      pllama_ring_create(8, 600, PLLAMA_RING_OVERFLOW_WAIT);
+  const int32_t n_tokens = 20000;
+  std::string expected_text;
+  for (int32_t token = 0; token < n_tokens; token++) {
+    expected_text += std::to_string(token);
+    if (token % 97 == 0) {
+      expected_text += std::string(700, 'x');
+    }
+  }
+  std::thread producer([ring, n_tokens] {
+    for (int32_t token = 0; token < n_tokens; token++) {
+      std::string piece = std::to_string(token);
+      if (token % 97 == 0) {
+        piece += std::string(700, 'x');
+      }
+      PLLAMA_CHECK(write(ring, token, piece) ==
+                   pllama_ring_write_result::written);
+    }
+    pllama_ring_finish(ring);
+  });
+
+  std::vector<int32_t> tokens;
+  std::string text;
+  uint64_t offset = 0;
+  while (true) {
+    // Done is read first: entries written before it are then visible.
+    const bool done = pllama_ring_done(ring);
+    pllama_ring_wait(ring, 10);
+    drain(ring, offset, tokens, text);
+    if (done) {
+      break;
+    }
+  }
+  producer.join();
+  PLLAMA_CHECK(text == expected_text);
+  int32_t next = 0;
+  for (int32_t token : tokens) {
+    if (token != PLLAMA_RING_CONTINUATION) {
+      PLLAMA_CHECK(token == next++);
+    }
+  }
+  PLLAMA_CHECK(next == n_tokens);
+  pllama_ring_free(ring);
+}
+
+int main() {
+  test_create();
+  test_wraparound();
+  test_long_piece();
+  test_overflow_drop();
+  test_overflow_long_piece();
+  test_overflow_wait();
+  test_wait_and_done();
+  test_threads();
+  return 0;
+}
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "pllama_stop.h"
+#include "pllama_test.h"
+
+struct stop_result {
+  std::string out;
+  bool stopped = false;
+};
+
+// Feeds text to a matcher for stops in the given chunks, flushing at the end
+// when no stop completes.
+static stop_result match(const std::vector<std::string> &stops,
+                         const std::vector<std::string> &chunks) {
+  StopMatcher matcher;
+  for (const auto &stop : stops) {
+    matcher.add_string(stop);
+  }
+  matcher.build();
+  stop_result result;
+  for (const auto &chunk : chunks) {
+    if (matcher.push(chunk.data(), chunk.size(), result.out)) {
+      result.stopped = true;
+      return result;
+    }
+  }
+  matcher.flush(result.out);
+  return result;
+}
+
+// The stop that ends first wins, the longest of those ending at the same
+// byte; the output ends right before it.
+static stop_result match_naive(const std::vector<std::string> &stops,
+                               const std::string &text) {
+  stop_result result;
+  for (size_t end = 1; end <= text.size(); end++) {
+    size_t longest = 0;
+    for (const auto &stop : stops) {
+      if (!stop.empty() && stop.size() <= end &&
+          text.compare(end - stop.size(), stop.size(), stop) == 0) {
+        longest = std::max(longest, stop.size());
+      }
+    }
+    if (longest > 0) {
+      result.out = text.substr(0, end - longest);
+      result.stopped = true;
+      return result;
+    }
+  }
+  result.out = text;
+  return result;
+}
+
+// The whole text, one byte at a time, and for short texts every way of
+// cutting it into chunks.
+static std::vector<std::vector<std::string>> splits(const std::string &text) {
+  std::vector<std::vector<std::string>> all;
+  all.push_back({text});
+  std::vector<std::string> bytes;
+  for (char c : text) {
+    bytes.push_back(std::string(1, c));
+  }
+  all.push_back(bytes);
+  if (text.size() <= 12) {
+    for (uint32_t cuts = 0; cuts < (1u << (text.size() - 1)); cuts++) {
+      std::vector<std::string> chunks(1);
+      for (size_t i = 0; i < text.size(); i++) {
+        chunks.back().push_back(text[i]);
+        if (i + 1 < text.size() && ((cuts >> i) & 1) != 0) {
+          chunks.emplace_back();
+        }
+      }
+      all.push_back(chunks);
+    }
+  }
+  return all;
+}
+
+static void check_every_split(const std::vector<std::string> &stops,
+                              const std::string &text,
+                              const std::string &expected, bool stopped) {
+  for (const auto &chunks : splits(text)) {
+    const stop_result result = match(stops, chunks);
+    PLLAMA_CHECK(result.out == expected);
+    PLLAMA_CHECK(result.stopped == stopped);
+  }
+}
+
+static void test_split_across_chunks() {
+  check_every_split({"<|end|>"}, "Hello <|end|> more", "Hello ", true);
+  check_every_split({"\n\n", "User:"}, "Hi\n\nUser:", "Hi", true);
+  check_every_split({"\n\n", "User:"}, "Hi\nUserx", "Hi\nUserx", false);
+  // A prefix of a stop that turns out not to be one is released.
+  check_every_split({"aab"}, "aaaaac", "aaaaac", false);
+  check_every_split({"aab"}, "aaaab", "aa", true);
+  // The stop that completes first wins, even if another started earlier.
+  check_every_split({"abcd", "bc"}, "xabcde", "xa", true);
+  // Multi-byte stops split inside a character.
+  check_every_split({"\xEB\x81\x9D"}, "ok\xEB\x81\x9D!", "ok", true);
+  check_every_split({}, "no stops", "no stops", false);
+}
+
+static void test_streaming_holds_back() {
+  StopMatcher matcher;
+  matcher.add_string("STOP");
+  matcher.build();
+  std::string out;
+  PLLAMA_CHECK(!matcher.push("abST", 4, out));
+  PLLAMA_CHECK(out == "ab");
+  PLLAMA_CHECK(!matcher.push("x", 1, out));
+  PLLAMA_CHECK(out == "abSTx");
+  PLLAMA_CHECK(!matcher.push("ST", 2, out));
+  PLLAMA_CHECK(out == "abSTx");
+  matcher.flush(out);
+  PLLAMA_CHECK(out == "abSTxST");
+}
+
+static void test_stop_tokens() {
+  StopMatcher matcher;
+  matcher.add_token(7);
+  matcher.add_token(3);
+  matcher.add_token(7);
+  matcher.build();
+  PLLAMA_CHECK(matcher.is_stop_token(3));
+  PLLAMA_CHECK(matcher.is_stop_token(7));
+  PLLAMA_CHECK(!matcher.is_stop_token(5));
+  // Without stop strings, text passes straight through.
+  std::string out;
+  PLLAMA_CHECK(!matcher.push("abc", 3, out));
+  PLLAMA_CHECK(out == "abc");
+}
+
+// Random stops and texts over a small alphabet, so stops overlap and share
+// prefixes often, cut into random chunks.
+static void test_against_naive() {
+  std::mt19937 rng(1234);
+  const char alphabet[] = "abc";
+  auto random_string = [&](size_t max_len) {
+    std::string s(1 + rng() % max_len, 'a');
+    for (char &c : s) {
+      c = alphabet[rng() % 3];
+    }
+    return s;
+  };
+  for (int run = 0; run < 20000; run++) {
+    std::vector<std::string> stops(rng() % 4);
+    for (auto &stop : stops) {
+      stop = random_string(4);
+    }
+    const std::string text = random_string(40);
+    std::vector<std::string> chunks;
+    for (size_t at = 0; at < text.size();) {
+      const size_t len = std::min(text.size() - at, (size_t)(rng() % 6));
+      chunks.push_back(text.substr(at, len));
+      at += len;
+    }
+    const stop_result expected = match_naive(stops, text);
+    const stop_result result = match(stops, chunks);
+    PLLAMA_CHECK(result.out == expected.out);
+    PLLAMA_CHECK(result.stopped == expected.stopped);
+  }
+}
+
+int main() {
+  test_split_across_chunks();
+  test_streaming_holds_back();
+  test_stop_tokens();
+  test_against_naive();
+  return 0;
+}
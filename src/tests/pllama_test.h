@@ -0,0 +1,17 @@
+#ifndef FLLAMA_TEST_H
+#define FLLAMA_TEST_H
+
+#include <cstdio>
+#include <cstdlib>
+
+// Ends the test with a failure, naming the condition and where it is.
+#define PLLAMA_CHECK(cond)                                                     \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,        \
+              #cond);                                                          \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+#endif // FLLAMA_TEST_H